@@ -0,0 +1,102 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+//binary dataset file: one header page followed by the rows as raw doubles (label in column 0),
+//in the byte order of the machine that wrote it
+//the header takes a whole page so every block of rows starts page aligned in the file
+const char binary_dataset_magic[8] = { 'K', 'N', 'N', 'B', 'I', 'N', '1', '\0' };
+const size_t binary_header_size = 4096;
+
+struct BinaryDatasetHeader {
+	char magic[8];
+	uint32_t feature_size;
+	uint32_t reserved;
+	uint64_t rows;
+};
+
+//writes rows block by block, the row count in the header is patched on close()
+class BinaryDatasetWriter {
+private:
+	std::ofstream file;
+	BinaryDatasetHeader header;
+
+public:
+	bool open(const std::string& filename, int feature_size) {
+		file.open(filename, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			return false;
+		}
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, binary_dataset_magic, sizeof(header.magic));
+		header.feature_size = (uint32_t)feature_size;
+		write_header();
+		return file.good();
+	}
+
+	//rows are stored one after another, rows * feature_size doubles
+	bool write_rows(const double* rows, size_t count) {
+		file.write(reinterpret_cast<const char*>(rows), (std::streamsize)(count * header.feature_size * sizeof(double)));
+		header.rows += count;
+		return file.good();
+	}
+
+	bool close() {
+		if (!file.is_open()) return false;
+		file.seekp(0);
+		write_header();
+		bool ok = file.good();
+		file.close();
+		return ok;
+	}
+
+private:
+	void write_header() {
+		char page[binary_header_size] = {};
+		std::memcpy(page, &header, sizeof(header));
+		file.write(page, sizeof(page));
+	}
+};
+
+//sequential block reader, one instance is used by one thread at a time
+class BinaryDatasetReader {
+private:
+	std::ifstream file;
+	BinaryDatasetHeader header;
+	uint64_t rows_left = 0;
+
+public:
+	bool open(const std::string& filename) {
+		file.open(filename, std::ios::binary);
+		if (!file.is_open()) {
+			return false;
+		}
+		char page[binary_header_size];
+		file.read(page, sizeof(page));
+		std::memcpy(&header, page, sizeof(header));
+		if (!file.good() || std::memcmp(header.magic, binary_dataset_magic, sizeof(header.magic)) != 0) {
+			file.close();
+			return false;
+		}
+		rows_left = header.rows;
+		return true;
+	}
+
+	//read up to max_rows rows into buffer, returns the number of rows read (0 at the end of the file)
+	int read_block(double* buffer, int max_rows) {
+		int rows = (rows_left < (uint64_t)max_rows) ? (int)rows_left : max_rows;
+		if (rows == 0) return 0;
+		file.read(reinterpret_cast<char*>(buffer), (std::streamsize)((size_t)rows * header.feature_size * sizeof(double)));
+		if (!file.good()) {
+			rows_left = 0;
+			return 0;
+		}
+		rows_left -= rows;
+		return rows;
+	}
+
+	uint64_t rows() const { return header.rows; }
+	int feature_size() const { return (int)header.feature_size; }
+};
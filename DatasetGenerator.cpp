@@ -0,0 +1,290 @@
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <random>
+#define HAVE_STRUCT_TIMESPEC
+#include <pthread.h>
+#include "BinaryDataset.h"
+using namespace std;
+
+//synthetic diabetes_binary.csv: same 22 columns, per-column value frequencies of the real data
+//(BRFSS 2015 diabetes health indicators) and about the same share of exact duplicate rows up to a few million rows
+//the label follows a logistic model of the main risk factors, so KNN still finds structure in it
+//rows are generated in fixed chunks, each seeded by (seed, chunk), so the output does not depend on the thread count
+
+const int num_threads = 8;
+const int feature_size = 22;
+//rows per generated chunk, the unit of work of a thread and of the seeding
+const int chunk_rows = 1 << 15;
+//share of exact duplicate rows in the real data (253,680 rows)
+const double target_duplicate_share = 0.095;
+//share of rows that are duplicates by chance when none are planted, measured on generated files of these sizes;
+//it grows with the row count and passes target_duplicate_share at about 5.5M rows, larger files plant nothing
+//and still have more duplicates than the real data (13.4% at 10M)
+const long long chance_sizes[] = { 253680, 500000, 1000000, 2000000, 4000000, 6000000, 10000000 };
+const double chance_shares[] = { 0.0080, 0.0155, 0.0282, 0.0487, 0.0785, 0.1009, 0.1339 };
+const int chance_points = sizeof(chance_sizes) / sizeof(chance_sizes[0]);
+const unsigned long long default_seed = 2015;
+
+const char* csv_header = "Diabetes_binary,HighBP,HighChol,CholCheck,BMI,Smoker,Stroke,HeartDiseaseorAttack,PhysActivity,Fruits,Veggies,"
+	"HvyAlcoholConsump,AnyHealthcare,NoDocbcCost,GenHlth,MentHlth,PhysHlth,DiffWalk,Sex,Age,Education,Income";
+
+//share of 1 in every 0/1 column (index = column, 0 where the column is not binary)
+const double binary_rate[feature_size] = {
+	0.0,	//Diabetes_binary, from the label model
+	0.429,	//HighBP
+	0.424,	//HighChol
+	0.963,	//CholCheck
+	0.0,	//BMI
+	0.443,	//Smoker
+	0.041,	//Stroke
+	0.094,	//HeartDiseaseorAttack
+	0.757,	//PhysActivity
+	0.634,	//Fruits
+	0.811,	//Veggies
+	0.056,	//HvyAlcoholConsump
+	0.951,	//AnyHealthcare
+	0.084,	//NoDocbcCost
+	0.0, 0.0, 0.0,	//GenHlth, MentHlth, PhysHlth
+	0.168,	//DiffWalk
+	0.440,	//Sex
+	0.0, 0.0, 0.0	//Age, Education, Income
+};
+
+//value frequencies of the ordinal columns
+const vector<pair<int, double>> gen_hlth_values = { {1, 0.179}, {2, 0.351}, {3, 0.298}, {4, 0.124}, {5, 0.048} };
+const vector<pair<int, double>> ment_hlth_values = {
+	{0, 0.693}, {1, 0.034}, {2, 0.052}, {3, 0.029}, {4, 0.015}, {5, 0.036}, {6, 0.004}, {7, 0.012}, {8, 0.003}, {10, 0.025},
+	{12, 0.002}, {14, 0.005}, {15, 0.022}, {20, 0.013}, {21, 0.001}, {25, 0.005}, {28, 0.001}, {30, 0.048} };
+const vector<pair<int, double>> phys_hlth_values = {
+	{0, 0.631}, {1, 0.045}, {2, 0.058}, {3, 0.034}, {4, 0.018}, {5, 0.030}, {6, 0.005}, {7, 0.018}, {8, 0.003}, {10, 0.022},
+	{12, 0.002}, {14, 0.010}, {15, 0.019}, {20, 0.013}, {21, 0.006}, {25, 0.005}, {28, 0.003}, {30, 0.078} };
+const vector<pair<int, double>> age_values = {
+	{1, 0.022}, {2, 0.030}, {3, 0.044}, {4, 0.055}, {5, 0.064}, {6, 0.078}, {7, 0.103}, {8, 0.121}, {9, 0.131}, {10, 0.127},
+	{11, 0.093}, {12, 0.063}, {13, 0.069} };
+const vector<pair<int, double>> education_values = { {1, 0.001}, {2, 0.016}, {3, 0.037}, {4, 0.247}, {5, 0.276}, {6, 0.423} };
+const vector<pair<int, double>> income_values = { {1, 0.039}, {2, 0.046}, {3, 0.062}, {4, 0.079}, {5, 0.102}, {6, 0.144}, {7, 0.170}, {8, 0.358} };
+
+//BMI is right skewed (mean about 28.4, long tail up to 98): log-normal, rounded and clamped to the real range
+const double bmi_log_mean = 3.32;
+const double bmi_log_sd = 0.21;
+
+//logistic label model, intercept tuned for about 14% positive rows like the real file
+const double label_intercept = -6.6;
+
+class ColumnSampler {
+private:
+	vector<int> values;
+	discrete_distribution<int> pick;
+
+public:
+	ColumnSampler(const vector<pair<int, double>>& table) {
+		vector<double> weights;
+		for (const auto& entry : table) {
+			values.push_back(entry.first);
+			weights.push_back(entry.second);
+		}
+		pick = discrete_distribution<int>(weights.begin(), weights.end());
+	}
+
+	int operator()(mt19937_64& generator) { return values[pick(generator)]; }
+};
+
+struct GenerateParams {
+	unsigned long long seed;
+	long long first_chunk;
+	long long total_rows;
+	int num_chunks;		//chunks of this wave
+	int thread_id;
+	double duplicate_rate;	//share of rows that repeat an earlier row of their chunk
+	vector<double>* rows;	//this wave's rows, chunk-major
+	vector<string>* text;	//CSV text of every chunk, empty in binary mode
+};
+
+static void generate_row(mt19937_64& generator, double* row, ColumnSampler& genHlth, ColumnSampler& mentHlth,
+	ColumnSampler& physHlth, ColumnSampler& age, ColumnSampler& education, ColumnSampler& income) {
+	uniform_real_distribution<double> unit(0.0, 1.0);
+	normal_distribution<double> bmiNoise(bmi_log_mean, bmi_log_sd);
+
+	for (int j = 1; j < feature_size; j++) {
+		if (binary_rate[j] > 0.0) {
+			row[j] = (unit(generator) < binary_rate[j]) ? 1.0 : 0.0;
+		}
+	}
+	row[4] = min(98.0, max(12.0, round(exp(bmiNoise(generator)))));
+	row[14] = genHlth(generator);
+	row[15] = mentHlth(generator);
+	row[16] = physHlth(generator);
+	row[19] = age(generator);
+	row[20] = education(generator);
+	row[21] = income(generator);
+
+	//risk grows with blood pressure, cholesterol, BMI, poor general health, age and walking difficulty
+	double z = label_intercept + 0.75 * row[1] + 0.55 * row[2] + 0.06 * row[4] + 0.55 * row[14] + 0.14 * row[19]
+		+ 0.3 * row[17] + 0.25 * row[7] - 0.05 * row[21];
+	row[0] = (unit(generator) < 1.0 / (1.0 + exp(-z))) ? 1.0 : 0.0;
+}
+
+//real file style: every value printed as "<int>.0"
+static void append_row(string& out, const double* row) {
+	char buffer[16];
+	for (int j = 0; j < feature_size; j++) {
+		int value = (int)row[j];
+		int length = 0;
+		do {
+			buffer[length++] = (char)('0' + value % 10);
+			value /= 10;
+		} while (value > 0);
+		while (length > 0) out.push_back(buffer[--length]);
+		out.append(".0");
+		out.push_back(j == feature_size - 1 ? '\n' : ',');
+	}
+}
+
+//threads take the chunks of the wave round robin, every chunk has its own generator
+static void* generate_chunks(void* arg) {
+	GenerateParams* params = static_cast<GenerateParams*>(arg);
+	ColumnSampler genHlth(gen_hlth_values), mentHlth(ment_hlth_values), physHlth(phys_hlth_values);
+	ColumnSampler age(age_values), education(education_values), income(income_values);
+	uniform_real_distribution<double> unit(0.0, 1.0);
+
+	for (int c = params->thread_id; c < params->num_chunks; c += num_threads) {
+		long long chunk = params->first_chunk + c;
+		long long first_row = chunk * chunk_rows;
+		int rows = (int)min((long long)chunk_rows, params->total_rows - first_row);
+		seed_seq seeds{ (unsigned)(params->seed >> 32), (unsigned)params->seed, (unsigned)(chunk >> 32), (unsigned)chunk };
+		mt19937_64 generator(seeds);
+
+		double* block = &(*params->rows)[(size_t)c * chunk_rows * feature_size];
+		for (int i = 0; i < rows; i++) {
+			double* row = block + (size_t)i * feature_size;
+			if (i > 0 && unit(generator) < params->duplicate_rate) {
+				const double* earlier = block + (size_t)uniform_int_distribution<int>(0, i - 1)(generator) * feature_size;
+				copy(earlier, earlier + feature_size, row);
+			}
+			else {
+				generate_row(generator, row, genHlth, mentHlth, physHlth, age, education, income);
+			}
+		}
+
+		if (params->text != nullptr) {
+			string& out = (*params->text)[c];
+			out.clear();
+			out.reserve((size_t)rows * 64);
+			for (int i = 0; i < rows; i++) {
+				append_row(out, block + (size_t)i * feature_size);
+			}
+		}
+	}
+	return nullptr;
+}
+
+//chance duplicate share of a file of this many rows, interpolated in log(rows) between the measured sizes
+//(proportional to the row count below the smallest one, the last measured value above the largest one)
+double chance_duplicate_share(long long rows) {
+	if (rows <= chance_sizes[0]) return chance_shares[0] * rows / chance_sizes[0];
+	for (int i = 1; i < chance_points; i++) {
+		if (rows <= chance_sizes[i]) {
+			double t = log((double)rows / chance_sizes[i - 1]) / log((double)chance_sizes[i] / chance_sizes[i - 1]);
+			return chance_shares[i - 1] + t * (chance_shares[i] - chance_shares[i - 1]);
+		}
+	}
+	return chance_shares[chance_points - 1];
+}
+
+//planted rate p so that p + (1 - p) * chance share is the target, 0 once chance alone reaches it
+double planted_duplicate_rate(long long rows) {
+	double chance = chance_duplicate_share(rows);
+	return max(0.0, (target_duplicate_share - chance) / (1.0 - chance));
+}
+
+//DatasetGenerator <rows> <output> [--binary] [--seed N]
+int main(int argc, char* argv[]) {
+	if (argc < 3) {
+		cerr << "Usage: DatasetGenerator <rows> <output> [--binary] [--seed N]" << endl;
+		return 1;
+	}
+	long long total_rows = stoll(argv[1]);
+	string filename = argv[2];
+	bool binary = false;
+	unsigned long long seed = default_seed;
+	for (int i = 3; i < argc; i++) {
+		if (string(argv[i]) == "--binary") binary = true;
+		else if (string(argv[i]) == "--seed" && i + 1 < argc) seed = stoull(argv[++i]);
+	}
+
+	ofstream csv;
+	BinaryDatasetWriter writer;
+	if (binary) {
+		if (!writer.open(filename, feature_size)) {
+			cerr << "Error opening file: " << filename << endl;
+			return 1;
+		}
+	}
+	else {
+		csv.open(filename, ios::binary | ios::trunc);
+		if (!csv.is_open()) {
+			cerr << "Error opening file: " << filename << endl;
+			return 1;
+		}
+		csv << csv_header << "\n";
+	}
+
+	chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+	//one wave = a few chunks per thread, generated in parallel and written in order
+	const int wave_chunks = num_threads * 2;
+	long long total_chunks = (total_rows + chunk_rows - 1) / chunk_rows;
+	vector<double> rows((size_t)wave_chunks * chunk_rows * feature_size);
+	vector<string> text(wave_chunks);
+	long long positives = 0;
+	double duplicate_rate = planted_duplicate_rate(total_rows);
+
+	for (long long first_chunk = 0; first_chunk < total_chunks; first_chunk += wave_chunks) {
+		int num_chunks = (int)min((long long)wave_chunks, total_chunks - first_chunk);
+
+		pthread_t threads[num_threads];
+		GenerateParams params[num_threads];
+		for (int i = 0; i < num_threads; i++) {
+			params[i] = { seed, first_chunk, total_rows, num_chunks, i, duplicate_rate, &rows, binary ? nullptr : &text };
+			pthread_create(&threads[i], nullptr, generate_chunks, &params[i]);
+		}
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], nullptr);
+		}
+
+		for (int c = 0; c < num_chunks; c++) {
+			long long first_row = (first_chunk + c) * chunk_rows;
+			int chunk_size = (int)min((long long)chunk_rows, total_rows - first_row);
+			const double* block = &rows[(size_t)c * chunk_rows * feature_size];
+			for (int i = 0; i < chunk_size; i++) {
+				positives += (block[(size_t)i * feature_size] == 1.0);
+			}
+			if (binary) writer.write_rows(block, chunk_size);
+			else csv.write(text[c].data(), (streamsize)text[c].size());
+		}
+	}
+
+	bool ok = binary ? writer.close() : csv.good();
+	if (!binary) csv.close();
+	if (!ok) {
+		cerr << "Error writing file: " << filename << endl;
+		return 1;
+	}
+
+	chrono::steady_clock::time_point end = chrono::steady_clock::now();
+	double seconds = chrono::duration_cast<chrono::microseconds>(end - begin).count() / 1e6;
+	cout << "Rows written: " << total_rows << " (" << (binary ? "binary" : "CSV") << ", seed " << seed << ")" << endl;
+	cout << "Positive rows: " << (total_rows > 0 ? 100.0 * positives / total_rows : 0.0) << "%" << endl;
+	cout << "Planted duplicate rows: " << 100.0 * duplicate_rate << "%" << endl;
+	if (duplicate_rate == 0.0 && chance_duplicate_share(total_rows) > target_duplicate_share) {
+		cout << "Note: chance duplicates alone pass " << 100.0 * target_duplicate_share << "% at this size, this file has more duplicate rows than the real one" << endl;
+	}
+	cout << "Generation Time = " << chrono::duration_cast<chrono::microseconds>(end - begin).count() << "[s], "
+		<< total_rows / max(seconds, 1e-9) << " rows/s" << endl;
+	return 0;
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+//how every feature column is rescaled before the dataset is stored
+enum class ScalingMode {
+	None,	//keep the raw values
+	ZScore,	//(x - mean) / standard deviation
+	MinMax	//(x - min) / (max - min)
+};
+
+//features are standardised once at load time so BMI and MentHlth/PhysHlth do not dominate the binary flags
+const ScalingMode default_scaling_mode = ScalingMode::ZScore;
+
+//running statistics of the feature columns, column 0 (the label) is skipped
+//each thread fills its own FeatureStats over a range of rows, then the partial results are merged
+struct FeatureStats {
+	long long count = 0;
+	std::vector<double> mean;
+	std::vector<double> m2; //sum of squared differences from the mean
+	std::vector<double> min;
+	std::vector<double> max;
+
+	explicit FeatureStats(int feature_size = 0) { reset(feature_size); }
+
+	void reset(int feature_size) {
+		count = 0;
+		mean.assign(feature_size, 0.0);
+		m2.assign(feature_size, 0.0);
+		min.assign(feature_size, std::numeric_limits<double>::max());
+		max.assign(feature_size, std::numeric_limits<double>::lowest());
+	}
+
+	//Welford update, one row at a time
+	void accumulate(const double* row) {
+		count++;
+		for (int j = 1; j < (int)mean.size(); j++) {
+			double delta = row[j] - mean[j];
+			mean[j] += delta / count;
+			m2[j] += delta * (row[j] - mean[j]);
+			if (row[j] < min[j]) min[j] = row[j];
+			if (row[j] > max[j]) max[j] = row[j];
+		}
+	}
+
+	//combine the statistics of another range of rows (Chan et al. parallel variance)
+	void merge(const FeatureStats& other) {
+		if (other.count == 0) return;
+		if (count == 0) {
+			*this = other;
+			return;
+		}
+		double total = (double)(count + other.count);
+		for (int j = 1; j < (int)mean.size(); j++) {
+			double delta = other.mean[j] - mean[j];
+			mean[j] += delta * other.count / total;
+			m2[j] += other.m2[j] + delta * delta * count * other.count / total;
+			min[j] = std::min(min[j], other.min[j]);
+			max[j] = std::max(max[j], other.max[j]);
+		}
+		count += other.count;
+	}
+
+	double variance(int j) const {
+		return (count > 1) ? m2[j] / count : 0.0;
+	}
+};
+
+//widest row the scaler can permute in place
+const int max_feature_size = 64;
+
+//bakes the scaling and the optional per-feature weights into the stored rows once at load time
+//stored value = (x - offset) * scale, where scale already contains sqrt(weight)
+//so the squared L2 distance on stored rows equals the weighted squared L2 distance on scaled features
+//the feature columns can also be stored in decreasing order of their scaled variance, so a distance loop that
+//stops early sees the largest terms first (label stays in column 0); under ZScore the scaled variance of a column
+//is its weight, so unweighted columns all tie and keep the file order
+class FeatureScaler {
+private:
+	std::vector<double> offset;
+	std::vector<double> scale;
+	std::vector<int> order; //order[j] = source column stored in column j
+
+public:
+	FeatureScaler() {}
+
+	//weights is optional, one entry per column (index 0 is ignored), nullptr means every feature weighs 1
+	//false (and nothing fitted) for rows wider than max_feature_size
+	bool fit(const FeatureStats& stats, ScalingMode mode, const double* weights = nullptr, bool reorder_by_variance = false) {
+		int feature_size = (int)stats.mean.size();
+		if (feature_size > max_feature_size) return false;
+		offset.assign(feature_size, 0.0);
+		scale.assign(feature_size, 1.0);
+		order.resize(feature_size);
+		for (int j = 0; j < feature_size; j++) {
+			order[j] = j;
+		}
+
+		for (int j = 1; j < feature_size; j++) {
+			double range = 1.0;
+			if (mode == ScalingMode::ZScore) {
+				offset[j] = stats.mean[j];
+				range = std::sqrt(stats.variance(j));
+			}
+			else if (mode == ScalingMode::MinMax) {
+				offset[j] = stats.min[j];
+				range = stats.max[j] - stats.min[j];
+			}
+			//constant column carries no information, leave it at zero instead of dividing by zero
+			scale[j] = (range > 0.0) ? 1.0 / range : 0.0;
+			if (weights != nullptr) {
+				scale[j] *= std::sqrt(weights[j]);
+			}
+		}
+
+		if (reorder_by_variance) {
+			//variance after scaling is what each column adds to the distance on average, stable so equal
+			//columns keep their order
+			std::vector<double> scaled_variance(feature_size, 0.0);
+			for (int j = 1; j < feature_size; j++) {
+				if (mode == ScalingMode::ZScore) {
+					//exactly the weight, variance * (1 / variance) would only be close to it
+					scaled_variance[j] = (scale[j] > 0.0) ? ((weights != nullptr) ? weights[j] : 1.0) : 0.0;
+				}
+				else {
+					scaled_variance[j] = stats.variance(j) * scale[j] * scale[j];
+				}
+			}
+			std::stable_sort(order.begin() + 1, order.end(), [&](int a, int b) {
+				return scaled_variance[a] > scaled_variance[b];
+			});
+		}
+		return true;
+	}
+
+	//source column of stored column j
+	int source_column(int j) const { return order[j]; }
+
+	int feature_size() const { return (int)scale.size(); }
+
+	//the fitted transform as plain arrays, so it can travel with the scaled rows (shared segment header)
+	void export_transform(double* offsets, double* scales, int* columns) const {
+		for (int j = 0; j < (int)scale.size(); j++) {
+			offsets[j] = offset[j];
+			scales[j] = scale[j];
+			columns[j] = order[j];
+		}
+	}
+
+	bool import_transform(const double* offsets, const double* scales, const int* columns, int feature_size) {
+		if (feature_size > max_feature_size) return false;
+		offset.assign(offsets, offsets + feature_size);
+		scale.assign(scales, scales + feature_size);
+		order.assign(columns, columns + feature_size);
+		return true;
+	}
+
+	//rescale the stored rows in place, the label in column 0 is untouched
+	void apply(double* dataset[], int start, int end) const {
+		for (int i = start; i < end; i++) {
+			apply_row(dataset[i]);
+		}
+	}
+
+	void apply_row(double* row) const {
+		//fit() and import_transform() refuse wider rows, an unfitted scaler leaves the row as it is
+		if ((int)scale.size() > max_feature_size) return;
+		double scaled[max_feature_size];
+		transform_query(row, scaled);
+		for (int j = 1; j < (int)scale.size(); j++) {
+			row[j] = scaled[j];
+		}
+	}
+
+	//the same transform for an incoming query, written to out so the caller's vector is kept intact
+	void transform_query(const double* query, double* out) const {
+		out[0] = query[0];
+		for (int j = 1; j < (int)scale.size(); j++) {
+			int c = order[j];
+			out[j] = (query[c] - offset[c]) * scale[c];
+		}
+	}
+};
@@ -0,0 +1,100 @@
+#pragma once
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLOAT_STORE_SSE
+#include <emmintrin.h>
+#endif
+
+//floats per SSE register, rows are padded to a multiple of it
+const int float_lanes = 4;
+//unit roundoff of float
+const double float_roundoff = 1.0 / (1 << 24);
+
+//the stored (scaled) rows as float32, contiguous and padded with zeros so a row is a whole number of registers
+//half the bytes of a double row and twice the lanes per register; the distance it gives is approximate,
+//candidate_threshold() says how far the approximation can be off, so an exact double re-rank of the
+//candidates gives the same top-K as a scan in double
+class FloatFeatureStore {
+private:
+	int rows = 0;
+	int width = 0;	//feature columns rounded up to float_lanes, the label is not stored
+	std::vector<float> features;
+	std::vector<double> column_abs_max;
+
+public:
+	struct Query {
+		std::vector<float> values;
+		double absolute_error;	//epsilon of the error bound, depends on the query magnitude
+	};
+
+	void build(const double* const dataset[], int dataset_size, int feature_size) {
+		rows = dataset_size;
+		width = (feature_size - 1 + float_lanes - 1) / float_lanes * float_lanes;
+		features.assign((size_t)rows * width, 0.0f);
+		column_abs_max.assign(width, 0.0);
+		for (int i = 0; i < rows; i++) {
+			float* row = &features[(size_t)i * width];
+			for (int j = 1; j < feature_size; j++) {
+				row[j - 1] = (float)dataset[i][j];
+				column_abs_max[j - 1] = std::fmax(column_abs_max[j - 1], std::fabs(dataset[i][j]));
+			}
+		}
+	}
+
+	//approximation error, for n = width terms and u = float_roundoff:
+	//each float value is off by at most u|v|, so a rounded difference is off by at most 4uM_j (M_j = largest |value|
+	//of column j, query included) and its square by at most 16uM_j^2 + O(u^2); the float products and sums add at
+	//most (n + 1)u relative error, so |approx - exact| <= relative_error() * exact + absolute_error,
+	//with room to spare in both (24uM^2 and 2(n + 2)u)
+	void encode_query(const double* target, int feature_size, Query& query) const {
+		query.values.assign(width, 0.0f);
+		double magnitude = 0.0;
+		for (int j = 1; j < feature_size; j++) {
+			query.values[j - 1] = (float)target[j];
+			double m = std::fmax(column_abs_max[j - 1], std::fabs(target[j]));
+			magnitude += m * m;
+		}
+		query.absolute_error = 24.0 * float_roundoff * magnitude;
+	}
+
+	double relative_error() const { return 2.0 * (width + 2) * float_roundoff; }
+
+	//approximate distance a row has to be within to possibly be among the K nearest in double,
+	//given the K-th best approximate distance seen so far (over rows with a non-zero distance):
+	//those K rows are all within (kth + eps) / (1 - delta) exactly, so the exact K-th best is too,
+	//and a row that beats it is within (1 + delta) of that plus eps in float
+	double candidate_threshold(double kth_approx, const Query& query) const {
+		double delta = relative_error();
+		double eps = query.absolute_error;
+		return (1.0 + delta) / (1.0 - delta) * (kth_approx + eps) + eps;
+	}
+
+	//squared L2 in float between the query and stored row i
+	float approx_distance(const Query& query, int i) const {
+		const float* row = &features[(size_t)i * width];
+		const float* q = query.values.data();
+#ifdef FLOAT_STORE_SSE
+		__m128 sum = _mm_setzero_ps();
+		for (int j = 0; j < width; j += float_lanes) {
+			__m128 diff = _mm_sub_ps(_mm_loadu_ps(q + j), _mm_loadu_ps(row + j));
+			sum = _mm_add_ps(sum, _mm_mul_ps(diff, diff));
+		}
+		__m128 high = _mm_movehl_ps(sum, sum);
+		sum = _mm_add_ps(sum, high);
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		return _mm_cvtss_f32(sum);
+#else
+		float l2 = 0.0f;
+		for (int j = 0; j < width; j++) {
+			float diff = q[j] - row[j];
+			l2 += diff * diff;
+		}
+		return l2;
+#endif
+	}
+
+	int size() const { return rows; }
+	size_t bytes() const { return features.size() * sizeof(float); }
+};
@@ -0,0 +1,114 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+//widest row an IntegerFeatureStore query can hold
+const int max_integer_features = 64;
+
+//every column of diabetes_binary.csv is a small non-negative integer (0/1 flags, BMI up to 98, days up to 30)
+//this store keeps the raw rows as one byte per feature, so the squared L2 distance is an exact integer
+//with a small bounded range, which lets the histogram selection replace sorting
+//it is built from the raw rows, before FeatureScaler turns them into non-integers
+class IntegerFeatureStore {
+private:
+	int rows = 0;
+	int width = 0; //number of feature columns, the label is kept apart
+	std::vector<uint8_t> features;
+	std::vector<uint8_t> labels;
+	std::vector<int> column_min;
+	std::vector<int> column_max;
+
+	static bool to_byte(double value, uint8_t& out) {
+		if (value < 0.0 || value > 255.0 || value != std::floor(value)) {
+			return false;
+		}
+		out = (uint8_t)value;
+		return true;
+	}
+
+public:
+	//query encoded the same way as a stored row
+	struct Query {
+		uint8_t values[max_integer_features];
+	};
+
+	//false when a value is not an integer in [0, 255], the store is then left empty
+	bool build(const double* const dataset[], int dataset_size, int feature_size) {
+		rows = dataset_size;
+		width = feature_size - 1;
+		if (width > max_integer_features) {
+			clear();
+			return false;
+		}
+		features.assign((size_t)rows * width, 0);
+		labels.assign(rows, 0);
+		column_min.assign(width, 255);
+		column_max.assign(width, 0);
+
+		for (int i = 0; i < rows; i++) {
+			uint8_t* row = &features[(size_t)i * width];
+			if (!to_byte(dataset[i][0], labels[i])) {
+				clear();
+				return false;
+			}
+			for (int j = 0; j < width; j++) {
+				if (!to_byte(dataset[i][j + 1], row[j])) {
+					clear();
+					return false;
+				}
+				if (row[j] < column_min[j]) column_min[j] = row[j];
+				if (row[j] > column_max[j]) column_max[j] = row[j];
+			}
+		}
+		return true;
+	}
+
+	void clear() {
+		rows = 0;
+		features.clear();
+		labels.clear();
+	}
+
+	//query in the same layout as a dataset row (column 0 ignored), false when it is not integer
+	bool encode_query(const double* query, Query& out) const {
+		for (int j = 0; j < width; j++) {
+			if (!to_byte(query[j + 1], out.values[j])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//largest squared distance any stored row can have to this query, the histogram needs that many bins + 1
+	uint32_t max_squared_distance(const Query& query) const {
+		uint32_t bound = 0;
+		for (int j = 0; j < width; j++) {
+			int low = query.values[j] - column_min[j];
+			int high = column_max[j] - query.values[j];
+			int far = (low > high) ? low : high;
+			bound += (uint32_t)(far * far);
+		}
+		return bound;
+	}
+
+	uint32_t distance(const Query& query, int i) const {
+		return squared_distance(query.values, row(i), width);
+	}
+
+	static uint32_t squared_distance(const uint8_t* x, const uint8_t* y, int width) {
+		uint32_t l2 = 0;
+		for (int j = 0; j < width; j++) {
+			int diff = (int)x[j] - (int)y[j];
+			l2 += (uint32_t)(diff * diff);
+		}
+		return l2;
+	}
+
+	int size() const { return rows; }
+	int feature_width() const { return width; }
+	const uint8_t* row(int i) const { return &features[(size_t)i * width]; }
+	int label(int i) const { return labels[i]; }
+	int min_value(int j) const { return column_min[j]; }
+	int max_value(int j) const { return column_max[j]; }
+};
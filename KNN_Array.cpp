@@ -8,6 +8,7 @@
 #include <vector>
 #define HAVE_STRUCT_TIMESPEC
 #include <pthread.h>
+#include "KnnScratch.h"
 using namespace std;
 
 const int num_threads = 8;
@@ -22,15 +23,16 @@ private:
 public:
 	Knn(int k) : neighbours_number(k) {}
 
-	int predict_class(double* dataset[], const double* target, int dataset_size, int feature_size) {
+	int predict_class(const double* const dataset[], const double* target, int dataset_size, int feature_size) {
 		double* distances[3];
 		int zeros_count = 0;
 		int ones_count = 0;
 
-		// Allocate memory for distances and index order
-		distances[0] = new double[dataset_size];
-		distances[1] = new double[dataset_size];
-		distances[2] = new double[dataset_size];
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		distances[0] = scratch.allocate<double>(dataset_size);
+		distances[1] = scratch.allocate<double>(dataset_size);
+		distances[2] = scratch.allocate<double>(dataset_size);
 
 		get_knn(dataset, target, distances, dataset_size, feature_size);
 
@@ -63,12 +65,6 @@ public:
 		}
 
 		int prediction = (zeros_count > ones_count) ? 0 : 1;
-
-		// Clean up memory
-		delete[] distances[0];
-		delete[] distances[1];
-		delete[] distances[2];
-
 		return prediction;
 	}
 
@@ -101,7 +97,7 @@ private:
 		return sqrt(l2);
 	}
 
-	void get_knn(double* x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
+	void get_knn(const double* const x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
 		int count = 0;
 		for (int i = 0; i < dataset_size; i++) {
 			if (x[i] == y) continue; // do not use the same point
@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//tuned parallel settings of the KNN engines, measured once on this machine and dataset size and kept in a
+//profile file so the next run starts with them; ChunkTuner keeps refining the chunk count while parallel
+//single queries run (the only path whose speed depends on it)
+const int tuning_profile_version = 2;
+//every explore_every-th query tries another chunk count instead of the best one so far
+const int autotune_explore_every = 16;
+//weight of the newest sample in the running average of a chunk count
+const double autotune_average_weight = 0.2;
+//most chunk counts a ChunkTuner compares (half, calibrated, double), an engine can build one graph for each up front
+const int chunk_tuner_candidates = 3;
+
+enum class PartitionerKind { Guided = 0, Static = 1 };
+
+struct TuningProfile {
+	int hardware_threads;
+	int dataset_size;
+	int feature_size;
+	int threads;				//1 = scan on the calling thread, no workers involved
+	int scan_chunks;			//tasks a single query is split into
+	PartitionerKind partitioner;
+	bool batch_pipeline;		//true: queries of a batch overlap (inter-query), false: one parallel query after another (intra-query)
+	double micros_per_query;	//measured with the settings above, 0 when not measured
+};
+
+inline int hardware_threads() {
+	unsigned threads = std::thread::hardware_concurrency();
+	return threads > 0 ? (int)threads : 1;
+}
+
+//settings used before anything is measured
+inline TuningProfile default_tuning_profile(int dataset_size, int feature_size, int scan_chunks) {
+	return TuningProfile{ hardware_threads(), dataset_size, feature_size, hardware_threads(), scan_chunks, PartitionerKind::Guided, true, 0.0 };
+}
+
+//a profile only carries over to the same machine, the same row width and a dataset of about the same size
+//(within a factor of 2)
+inline bool profile_matches(const TuningProfile& profile, int dataset_size, int feature_size) {
+	return profile.hardware_threads == hardware_threads() && profile.feature_size == feature_size
+		&& profile.dataset_size <= 2 * dataset_size && dataset_size <= 2 * profile.dataset_size;
+}
+
+//key=value lines, easy to read and to edit by hand
+inline bool save_tuning_profile(const std::string& filename, const TuningProfile& profile) {
+	std::ofstream file(filename, std::ios::trunc);
+	if (!file.is_open()) return false;
+	file << "version=" << tuning_profile_version << "\n"
+		<< "hardware_threads=" << profile.hardware_threads << "\n"
+		<< "dataset_size=" << profile.dataset_size << "\n"
+		<< "feature_size=" << profile.feature_size << "\n"
+		<< "threads=" << profile.threads << "\n"
+		<< "scan_chunks=" << profile.scan_chunks << "\n"
+		<< "partitioner=" << (profile.partitioner == PartitionerKind::Static ? "static" : "guided") << "\n"
+		<< "batch_pipeline=" << (profile.batch_pipeline ? 1 : 0) << "\n"
+		<< "micros_per_query=" << profile.micros_per_query << "\n";
+	return file.good();
+}
+
+//false when the file is missing, from another version or incomplete
+//the thread count is clamped to this machine, an edited or copied file cannot oversubscribe it
+inline bool load_tuning_profile(const std::string& filename, TuningProfile& profile) {
+	std::ifstream file(filename);
+	if (!file.is_open()) return false;
+	TuningProfile loaded = default_tuning_profile(0, 0, 1);
+	int version = 0;
+	int fields = 0;
+	std::string line;
+	while (std::getline(file, line)) {
+		size_t equals = line.find('=');
+		if (equals == std::string::npos) continue;
+		std::string key = line.substr(0, equals);
+		std::string value = line.substr(equals + 1);
+		try {
+			if (key == "version") version = std::stoi(value);
+			else if (key == "hardware_threads") { loaded.hardware_threads = std::stoi(value); fields++; }
+			else if (key == "dataset_size") { loaded.dataset_size = std::stoi(value); fields++; }
+			else if (key == "feature_size") { loaded.feature_size = std::stoi(value); fields++; }
+			else if (key == "threads") { loaded.threads = std::stoi(value); fields++; }
+			else if (key == "scan_chunks") { loaded.scan_chunks = std::stoi(value); fields++; }
+			else if (key == "partitioner") { loaded.partitioner = (value == "static") ? PartitionerKind::Static : PartitionerKind::Guided; fields++; }
+			else if (key == "batch_pipeline") { loaded.batch_pipeline = (std::stoi(value) != 0); fields++; }
+			else if (key == "micros_per_query") loaded.micros_per_query = std::stod(value);
+		}
+		catch (...) {
+			return false;
+		}
+	}
+	if (version != tuning_profile_version || fields != 7 || loaded.threads < 1 || loaded.scan_chunks < 1) return false;
+	loaded.threads = std::min(loaded.threads, hardware_threads());
+	profile = loaded;
+	return true;
+}
+
+//online refinement: the calibrated chunk count and its half and double compete on the running average
+//time of the queries that used them, the fastest one is used for all but the exploring queries
+//only queries that are split into chunks report to it: a pipelined batch scans each query on one line and
+//a calling-thread scan has no chunks, neither depends on the chunk count
+class ChunkTuner {
+private:
+	std::vector<int> candidates;
+	std::vector<double> average;
+	std::vector<int> samples;
+	int current = 0;
+	int best = 0;
+	long long queries = 0;
+
+public:
+	ChunkTuner() {}
+	explicit ChunkTuner(int chunks) {
+		if (chunks > 1) candidates.push_back(chunks / 2);
+		best = (int)candidates.size();
+		candidates.push_back(chunks);
+		candidates.push_back(chunks * 2);
+		average.assign(candidates.size(), 0.0);
+		samples.assign(candidates.size(), 0);
+	}
+
+	//candidate of the next query, an index below candidate_count()
+	int next() {
+		queries++;
+		current = best;
+		if (queries % autotune_explore_every == 0) {
+			int others = (int)candidates.size() - 1;
+			current = (best + 1 + (int)((queries / autotune_explore_every) % others)) % (int)candidates.size();
+		}
+		return current;
+	}
+
+	//time of the query that used the last next()
+	void report(double micros) {
+		average[current] = (samples[current] == 0) ? micros
+			: (1.0 - autotune_average_weight) * average[current] + autotune_average_weight * micros;
+		samples[current]++;
+		for (int i = 0; i < (int)candidates.size(); i++) {
+			if (samples[i] > 0 && average[i] < average[best]) best = i;
+		}
+	}
+
+	int candidate_count() const { return (int)candidates.size(); }
+	int chunks(int candidate) const { return candidates[candidate]; }
+	int largest_chunks() const { return candidates.back(); }
+	int best_chunks() const { return candidates[best]; }
+	//every candidate has been timed, so best_chunks() is a measured choice and worth saving
+	bool refined() const {
+		for (int count : samples) {
+			if (count == 0) return false;
+		}
+		return !samples.empty();
+	}
+	double best_average() const { return average[best]; }
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+//feature columns summed between two checks of the bound in bounded_squared_distance
+const int distance_check_block = 4;
+
+//squared euclidean distance over the feature columns (column 0 is the label)
+//scaling and weights are already baked into the stored rows, and sqrt does not change the ranking,
+//so it is only taken when a neighbour is printed
+inline double squared_distance(const double* x, const double* y, int feature_size) {
+	double l2 = 0.0;
+	for (int i = 1; i < feature_size; i++) {
+		double diff = x[i] - y[i];
+		l2 += diff * diff;
+	}
+	return l2;
+}
+
+//squared distance that gives up once the running sum passes bound, checked every distance_check_block features
+//the result is only exact when it is <= bound, anything larger just means the row cannot be a neighbour
+//features are stored in decreasing variance order, so the large terms come first and most rows stop early
+inline double bounded_squared_distance(const double* x, const double* y, int feature_size, double bound) {
+	double l2 = 0.0;
+	int i = 1;
+	while (i < feature_size) {
+		int block_end = (i + distance_check_block < feature_size) ? i + distance_check_block : feature_size;
+		for (; i < block_end; i++) {
+			double diff = x[i] - y[i];
+			l2 += diff * diff;
+		}
+		if (l2 > bound) {
+			return l2;
+		}
+	}
+	return l2;
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "KnnTopK.h"
+
+//precomputed K_max nearest neighbours of the dataset rows (the graph nodes), on the stored rows
+//neighbours are found over the whole dataset with the same rule as every scan: exact duplicates (distance 0)
+//are not neighbours, so a query equal to a node has exactly the node's list as its own K nearest
+//a query is matched to a node by a hash of its features and confirmed against the stored row
+const char knn_graph_magic[8] = { 'K', 'N', 'N', 'G', 'R', 'P', 'H', '1' };
+
+struct KnnGraphHeader {
+	char magic[8];
+	uint32_t k_max;
+	uint32_t feature_size;
+	uint64_t nodes;
+	uint64_t dataset_rows;
+	uint64_t fingerprint; //hash of the whole dataset the graph was built on
+};
+
+//FNV-1a over the feature columns (column 0 is the label), -0.0 and 0.0 hash the same
+inline uint64_t row_hash(const double* row, int feature_size) {
+	uint64_t hash = 1469598103934665603ULL;
+	for (int j = 1; j < feature_size; j++) {
+		double value = (row[j] == 0.0) ? 0.0 : row[j];
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		for (int b = 0; b < 8; b++) {
+			hash ^= (bits >> (8 * b)) & 0xFF;
+			hash *= 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+//order dependent hash of every row and label, a graph is only used with the dataset it was built on
+inline uint64_t dataset_fingerprint(const double* const dataset[], int dataset_size, int feature_size) {
+	uint64_t fingerprint = 0;
+	for (int i = 0; i < dataset_size; i++) {
+		fingerprint = fingerprint * 1099511628211ULL ^ row_hash(dataset[i], feature_size) ^ (uint64_t)dataset[i][0];
+	}
+	return fingerprint;
+}
+
+class KnnGraph {
+private:
+	KnnGraphHeader header;
+	std::vector<uint64_t> hashes;		//row_hash of every node
+	std::vector<Neighbour> neighbours;	//nodes * k_max, ascending, unused slots have index -1
+	std::unordered_multimap<uint64_t, int> lookup;
+
+public:
+	KnnGraph() { std::memset(&header, 0, sizeof(header)); }
+
+	//empty graph over the first nodes rows of the dataset, the lists are filled with fill_node/copy_node
+	void reset(const double* const dataset[], int nodes, int dataset_size, int feature_size, int k_max) {
+		std::memcpy(header.magic, knn_graph_magic, sizeof(header.magic));
+		header.k_max = (uint32_t)k_max;
+		header.feature_size = (uint32_t)feature_size;
+		header.nodes = (uint64_t)nodes;
+		header.dataset_rows = (uint64_t)dataset_size;
+		header.fingerprint = dataset_fingerprint(dataset, dataset_size, feature_size);
+		hashes.resize(nodes);
+		for (int i = 0; i < nodes; i++) {
+			hashes[i] = row_hash(dataset[i], feature_size);
+		}
+		neighbours.assign((size_t)nodes * k_max, Neighbour{ 0.0, -1, -1 });
+		build_lookup();
+	}
+
+	//top-K buffer of a node, a builder thread offers rows to it and sorts it
+	TopK node_list(int node) {
+		return TopK(&neighbours[(size_t)node * header.k_max], (int)header.k_max);
+	}
+
+	void copy_node(int from, int to) {
+		std::copy(&neighbours[(size_t)from * header.k_max], &neighbours[(size_t)(from + 1) * header.k_max], &neighbours[(size_t)to * header.k_max]);
+	}
+
+	//first node with identical features, every row of a group of duplicates has the same list
+	int find_duplicate(const double* const dataset[], int node) const {
+		return find(dataset, dataset[node]);
+	}
+
+	//node whose features equal the query, -1 when the query is not a known record
+	int find(const double* const dataset[], const double* query) const {
+		auto range = lookup.equal_range(row_hash(query, (int)header.feature_size));
+		int found = -1;
+		for (auto it = range.first; it != range.second; ++it) {
+			const double* row = dataset[it->second];
+			bool equal = true;
+			for (int j = 1; j < (int)header.feature_size && equal; j++) {
+				equal = (row[j] == query[j]);
+			}
+			if (equal && (found < 0 || it->second < found)) found = it->second;
+		}
+		return found;
+	}
+
+	const Neighbour* neighbours_of(int node) const { return &neighbours[(size_t)node * header.k_max]; }
+	int k_max() const { return (int)header.k_max; }
+	int nodes() const { return (int)header.nodes; }
+
+	bool save(const std::string& filename) const {
+		std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) return false;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(hashes.data()), (std::streamsize)(hashes.size() * sizeof(uint64_t)));
+		file.write(reinterpret_cast<const char*>(neighbours.data()), (std::streamsize)(neighbours.size() * sizeof(Neighbour)));
+		return file.good();
+	}
+
+	//false when the file is missing, damaged or was built on a different dataset
+	//k_max_limit is the longest list the caller builds, a header above it (or with empty lists) is damaged
+	bool load(const std::string& filename, const double* const dataset[], int dataset_size, int feature_size, int k_max_limit) {
+		std::ifstream file(filename, std::ios::binary | std::ios::ate);
+		if (!file.is_open()) return false;
+		uint64_t file_size = (uint64_t)file.tellg();
+		file.seekg(0);
+		KnnGraphHeader loaded;
+		file.read(reinterpret_cast<char*>(&loaded), sizeof(loaded));
+		if (!file.good() || std::memcmp(loaded.magic, knn_graph_magic, sizeof(loaded.magic)) != 0
+			|| loaded.feature_size != (uint32_t)feature_size || loaded.dataset_rows != (uint64_t)dataset_size
+			|| loaded.nodes > loaded.dataset_rows || loaded.k_max == 0 || loaded.k_max > (uint32_t)k_max_limit) {
+			return false;
+		}
+		//the payload the header describes must be exactly what the file holds, before anything is sized from it
+		uint64_t payload = loaded.nodes * sizeof(uint64_t) + loaded.nodes * loaded.k_max * sizeof(Neighbour);
+		if (file_size != sizeof(loaded) + payload
+			|| loaded.fingerprint != dataset_fingerprint(dataset, dataset_size, feature_size)) {
+			return false;
+		}
+		header = loaded;
+		hashes.resize(header.nodes);
+		neighbours.resize((size_t)header.nodes * header.k_max);
+		file.read(reinterpret_cast<char*>(hashes.data()), (std::streamsize)(hashes.size() * sizeof(uint64_t)));
+		file.read(reinterpret_cast<char*>(neighbours.data()), (std::streamsize)(neighbours.size() * sizeof(Neighbour)));
+		if (!file.good()) {
+			header.nodes = 0;
+			return false;
+		}
+		build_lookup();
+		return true;
+	}
+
+private:
+	void build_lookup() {
+		lookup.clear();
+		lookup.reserve(hashes.size());
+		for (int i = 0; i < (int)hashes.size(); i++) {
+			lookup.emplace(hashes[i], i);
+		}
+	}
+};
@@ -0,0 +1,170 @@
+#pragma once
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KNN_METRIC_SSE2
+#include <emmintrin.h>
+#endif
+
+//distance metrics as policy types for the KNN engines, the metric is a template parameter so the
+//inner loop is compiled for exactly one metric and switching costs nothing at run time
+//every policy returns a rank distance: a monotone transform of the real distance that orders rows the
+//same way and is cheaper to compute (squared L2 without sqrt); display() turns it back for printing
+//rank() gives up once the running value passes bound, like bounded_squared_distance,
+//the result is only exact when it is <= bound
+//column 0 is the label, the features are columns 1 .. feature_size - 1
+//the kernels work on two doubles per SSE2 register and check the bound every metric_check_block features
+const int metric_check_block = 4;
+
+#ifdef KNN_METRIC_SSE2
+inline double horizontal_sum(__m128d v) {
+	return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+inline double horizontal_max(__m128d v) {
+	return _mm_cvtsd_f64(_mm_max_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+inline __m128d absolute(__m128d v) {
+	return _mm_andnot_pd(_mm_set1_pd(-0.0), v);
+}
+#endif
+
+//sum of (x - y)^2, ranks like euclidean distance
+struct SquaredL2 {
+	static const char* name() { return "Euclidean"; }
+	static double display(double rank) { return std::sqrt(rank); }
+
+	double rank(const double* x, const double* y, int feature_size, double bound) const {
+		int j = 1;
+		double l2 = 0.0;
+#ifdef KNN_METRIC_SSE2
+		__m128d sum = _mm_setzero_pd();
+		for (; j + metric_check_block <= feature_size; j += metric_check_block) {
+			__m128d d0 = _mm_sub_pd(_mm_loadu_pd(x + j), _mm_loadu_pd(y + j));
+			__m128d d1 = _mm_sub_pd(_mm_loadu_pd(x + j + 2), _mm_loadu_pd(y + j + 2));
+			sum = _mm_add_pd(sum, _mm_add_pd(_mm_mul_pd(d0, d0), _mm_mul_pd(d1, d1)));
+			if (horizontal_sum(sum) > bound) return horizontal_sum(sum);
+		}
+		l2 = horizontal_sum(sum);
+#endif
+		for (; j < feature_size; j++) {
+			double diff = x[j] - y[j];
+			l2 += diff * diff;
+		}
+		return l2;
+	}
+};
+
+//sum of |x - y|, the sign bit is masked off instead of calling fabs
+struct Manhattan {
+	static const char* name() { return "Manhattan"; }
+	static double display(double rank) { return rank; }
+
+	double rank(const double* x, const double* y, int feature_size, double bound) const {
+		int j = 1;
+		double l1 = 0.0;
+#ifdef KNN_METRIC_SSE2
+		__m128d sum = _mm_setzero_pd();
+		for (; j + metric_check_block <= feature_size; j += metric_check_block) {
+			__m128d d0 = absolute(_mm_sub_pd(_mm_loadu_pd(x + j), _mm_loadu_pd(y + j)));
+			__m128d d1 = absolute(_mm_sub_pd(_mm_loadu_pd(x + j + 2), _mm_loadu_pd(y + j + 2)));
+			sum = _mm_add_pd(sum, _mm_add_pd(d0, d1));
+			if (horizontal_sum(sum) > bound) return horizontal_sum(sum);
+		}
+		l1 = horizontal_sum(sum);
+#endif
+		for (; j < feature_size; j++) {
+			l1 += std::fabs(x[j] - y[j]);
+		}
+		return l1;
+	}
+};
+
+//largest |x - y| over the features
+struct Chebyshev {
+	static const char* name() { return "Chebyshev"; }
+	static double display(double rank) { return rank; }
+
+	double rank(const double* x, const double* y, int feature_size, double bound) const {
+		int j = 1;
+		double largest = 0.0;
+#ifdef KNN_METRIC_SSE2
+		__m128d top = _mm_setzero_pd();
+		for (; j + metric_check_block <= feature_size; j += metric_check_block) {
+			__m128d d0 = absolute(_mm_sub_pd(_mm_loadu_pd(x + j), _mm_loadu_pd(y + j)));
+			__m128d d1 = absolute(_mm_sub_pd(_mm_loadu_pd(x + j + 2), _mm_loadu_pd(y + j + 2)));
+			top = _mm_max_pd(top, _mm_max_pd(d0, d1));
+			if (horizontal_max(top) > bound) return horizontal_max(top);
+		}
+		largest = horizontal_max(top);
+#endif
+		for (; j < feature_size; j++) {
+			double diff = std::fabs(x[j] - y[j]);
+			if (diff > largest) largest = diff;
+		}
+		return largest;
+	}
+};
+
+//number of features that differ, for the 0/1 flags it is the squared L2 of the raw rows;
+//the scaling is one affine map per column, so scaled values differ exactly when the raw ones do
+struct Hamming {
+	static const char* name() { return "Hamming"; }
+	static double display(double rank) { return rank; }
+
+	double rank(const double* x, const double* y, int feature_size, double bound) const {
+		int j = 1;
+		double count = 0.0;
+#ifdef KNN_METRIC_SSE2
+		const __m128d one = _mm_set1_pd(1.0);
+		__m128d sum = _mm_setzero_pd();
+		for (; j + metric_check_block <= feature_size; j += metric_check_block) {
+			__m128d n0 = _mm_and_pd(_mm_cmpneq_pd(_mm_loadu_pd(x + j), _mm_loadu_pd(y + j)), one);
+			__m128d n1 = _mm_and_pd(_mm_cmpneq_pd(_mm_loadu_pd(x + j + 2), _mm_loadu_pd(y + j + 2)), one);
+			sum = _mm_add_pd(sum, _mm_add_pd(n0, n1));
+			if (horizontal_sum(sum) > bound) return horizontal_sum(sum);
+		}
+		count = horizontal_sum(sum);
+#endif
+		for (; j < feature_size; j++) {
+			count += (x[j] != y[j]) ? 1.0 : 0.0;
+		}
+		return count;
+	}
+};
+
+//sum of w_j (x_j - y_j)^2 with weights chosen at run time, weights[j] belongs to stored column j
+//(FeatureScaler can also bake fixed weights into the rows, then plain SquaredL2 is enough)
+struct WeightedL2 {
+	std::vector<double> weights;
+
+	WeightedL2() {}
+	WeightedL2(const double* w, int feature_size) : weights(w, w + feature_size) {}
+
+	static const char* name() { return "Weighted Euclidean"; }
+	static double display(double rank) { return std::sqrt(rank); }
+
+	double rank(const double* x, const double* y, int feature_size, double bound) const {
+		const double* w = weights.data();
+		int j = 1;
+		double l2 = 0.0;
+#ifdef KNN_METRIC_SSE2
+		__m128d sum = _mm_setzero_pd();
+		for (; j + metric_check_block <= feature_size; j += metric_check_block) {
+			__m128d d0 = _mm_sub_pd(_mm_loadu_pd(x + j), _mm_loadu_pd(y + j));
+			__m128d d1 = _mm_sub_pd(_mm_loadu_pd(x + j + 2), _mm_loadu_pd(y + j + 2));
+			sum = _mm_add_pd(sum, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(w + j), _mm_mul_pd(d0, d0)),
+				_mm_mul_pd(_mm_loadu_pd(w + j + 2), _mm_mul_pd(d1, d1))));
+			if (horizontal_sum(sum) > bound) return horizontal_sum(sum);
+		}
+		l2 = horizontal_sum(sum);
+#endif
+		for (; j < feature_size; j++) {
+			double diff = x[j] - y[j];
+			l2 += w[j] * diff * diff;
+		}
+		return l2;
+	}
+};
@@ -0,0 +1,127 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+//bump allocator that owns every per-query buffer (distances, labels, indexes, merge buffers)
+//memory is handed out by moving a pointer forward and is given back all at once by rewind() or reset()
+//every query takes its buffers from the calling thread's arena (thread_scratch()) inside a ScratchScope,
+//so the first query sizes the arena and after that a steady stream of queries does no heap allocation
+class ScratchArena {
+private:
+	static const size_t alignment = 64; //cache line, also enough for any SIMD load
+
+	char* buffer = nullptr;
+	size_t capacity = 0;
+	size_t used = 0;
+	//blocks taken when a query needed more than the current capacity, folded into buffer once the arena is empty
+	std::vector<void*> overflow;
+	std::vector<size_t> overflow_sizes;
+	size_t overflow_bytes = 0;
+	size_t peak = 0; //most bytes in use since the buffer was last sized
+
+	static size_t round_up(size_t bytes) {
+		return (bytes + alignment - 1) & ~(alignment - 1);
+	}
+
+	static void* allocate_block(size_t bytes) {
+		void* block = ::operator new(bytes, std::align_val_t(alignment));
+		return block;
+	}
+
+	static void free_block(void* block) {
+		::operator delete(block, std::align_val_t(alignment));
+	}
+
+public:
+	ScratchArena() {}
+	explicit ScratchArena(size_t bytes) { reserve(bytes); }
+	ScratchArena(const ScratchArena&) = delete;
+	ScratchArena& operator=(const ScratchArena&) = delete;
+
+	~ScratchArena() {
+		for (void* block : overflow) {
+			free_block(block);
+		}
+		if (buffer != nullptr) free_block(buffer);
+	}
+
+	//position of the arena, rewind() to it gives back everything allocated after it
+	struct Mark {
+		size_t used;
+		size_t overflow_blocks;
+	};
+
+	//grow the arena up front, only valid between queries
+	void reserve(size_t bytes) {
+		bytes = round_up(bytes);
+		if (bytes <= capacity) return;
+		if (buffer != nullptr) free_block(buffer);
+		buffer = static_cast<char*>(allocate_block(bytes));
+		capacity = bytes;
+		used = 0;
+	}
+
+	template <typename T>
+	T* allocate(size_t count) {
+		size_t bytes = round_up(count * sizeof(T));
+		if (used + bytes <= capacity) {
+			T* ptr = reinterpret_cast<T*>(buffer + used);
+			used += bytes;
+			return ptr;
+		}
+		//out of room during a query, earlier pointers must stay valid so take a side block
+		void* block = allocate_block(bytes);
+		overflow.push_back(block);
+		overflow_sizes.push_back(bytes);
+		overflow_bytes += bytes;
+		return static_cast<T*>(block);
+	}
+
+	Mark mark() const { return { used, overflow.size() }; }
+
+	//release every buffer allocated since the mark, the ones allocated before it stay valid
+	//once the arena is empty again it is regrown to the peak size if a query overflowed, so the next one fits
+	void rewind(const Mark& position) {
+		peak = std::max(peak, used + overflow_bytes);
+		while (overflow.size() > position.overflow_blocks) {
+			free_block(overflow.back());
+			overflow_bytes -= overflow_sizes.back();
+			overflow.pop_back();
+			overflow_sizes.pop_back();
+		}
+		used = position.used;
+		if (used == 0 && overflow.empty() && peak > capacity) {
+			reserve(peak);
+			peak = 0;
+		}
+	}
+
+	//release every buffer, only for the owner of the whole arena (no scope of a caller is open)
+	void reset() { rewind(Mark{ 0, 0 }); }
+
+	size_t bytes_used() const { return used + overflow_bytes; }
+	size_t bytes_reserved() const { return capacity; }
+};
+
+//every calling thread owns one arena, so a Knn object can be shared by several threads
+inline ScratchArena& thread_scratch() {
+	thread_local ScratchArena arena;
+	return arena;
+}
+
+//gives back what was allocated from the arena while it was open; a query opens one instead of calling
+//reset(), so buffers its caller already holds in the same arena (an engine calling another) stay valid
+class ScratchScope {
+private:
+	ScratchArena& arena;
+	ScratchArena::Mark start;
+
+public:
+	explicit ScratchScope(ScratchArena& arena) : arena(arena), start(arena.mark()) {}
+	~ScratchScope() { arena.rewind(start); }
+	ScratchScope(const ScratchScope&) = delete;
+	ScratchScope& operator=(const ScratchScope&) = delete;
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+
+//one candidate neighbour of a query, distance is the squared L2 distance on the stored rows
+struct Neighbour {
+	double distance;
+	int index;
+	int label;
+};
+
+//strict ordering used everywhere a neighbour list is ranked, equal distances fall back to the row index
+//so every backend and every chunking picks the same K rows
+inline bool closer(const Neighbour& a, const Neighbour& b) {
+	return (a.distance < b.distance) || (a.distance == b.distance && a.index < b.index);
+}
+
+//bounded max-heap that keeps the K closest neighbours seen so far
+//storage is owned by the caller (scratch arena or a prebuilt buffer), so offering a row never allocates
+class TopK {
+private:
+	Neighbour* items;
+	int capacity;
+	int count;
+
+public:
+	TopK() : items(nullptr), capacity(0), count(0) {}
+	TopK(Neighbour* storage, int k) : items(storage), capacity(k), count(0) {}
+
+	void clear() { count = 0; }
+	int size() const { return count; }
+	bool full() const { return count == capacity; }
+	const Neighbour& operator[](int i) const { return items[i]; }
+	const Neighbour* data() const { return items; }
+
+	//the distance a new row has to beat to get in, infinity until K rows are kept
+	double bound() const {
+		return full() ? items[0].distance : std::numeric_limits<double>::infinity();
+	}
+
+	void offer(double distance, int index, int label) {
+		offer(Neighbour{ distance, index, label });
+	}
+
+	void offer(const Neighbour& candidate) {
+		if (count < capacity) {
+			items[count++] = candidate;
+			std::push_heap(items, items + count, closer);
+		}
+		else if (capacity > 0 && closer(candidate, items[0])) {
+			std::pop_heap(items, items + count, closer);
+			items[count - 1] = candidate;
+			std::push_heap(items, items + count, closer);
+		}
+	}
+
+	void merge(const TopK& other) {
+		for (int i = 0; i < other.count; i++) {
+			offer(other.items[i]);
+		}
+	}
+
+	//turn the heap into an ascending list, no more offers after this
+	void sort() {
+		std::sort_heap(items, items + count, closer);
+	}
+};
+
+//majority vote of the first k neighbours of an ascending list, ties go to class 1 like the original vote
+inline int vote(const Neighbour* neighbours, int k) {
+	int zeros_count = 0;
+	int ones_count = 0;
+	for (int i = 0; i < k; i++) {
+		if (neighbours[i].label == 0) zeros_count++;
+		else if (neighbours[i].label == 1) ones_count++;
+	}
+	return (zeros_count > ones_count) ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+typedef SOCKET socket_t;
+const socket_t invalid_socket = INVALID_SOCKET;
+inline void close_socket(socket_t s) { closesocket(s); }
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+typedef int socket_t;
+const socket_t invalid_socket = -1;
+inline void close_socket(socket_t s) { close(s); }
+#endif
+
+//binary wire protocol between the sharded KNN coordinator and its workers
+//every message is a fixed 20 byte header followed by a payload, all fields little-endian
+//
+//request:  header { magic 'KNQ2', request_id, k, feature_size, num_queries, 0, 0 }
+//          num_queries * feature_size doubles (raw rows, column 0 ignored)
+//response: header { magic 'KNR2', request_id, k, feature_size, num_queries, shard_id, shard_count }
+//          num_queries uint32 neighbour counts, then num_queries * k entries of
+//          { double squared distance, int32 global row index, int32 label }
+//the response names the worker's shard, so a coordinator can spot a worker started for another shard or split;
+//version 2 of the protocol, the 16 byte 'KNNQ'/'KNNR' headers had no shard fields and are rejected by the magic
+const uint32_t knn_request_magic = 0x32514E4B;	//"KNQ2"
+const uint32_t knn_response_magic = 0x32524E4B;	//"KNR2"
+const size_t wire_header_size = 20;
+const size_t wire_neighbour_size = 16;
+//largest batch and K a peer accepts, a header above them closes the connection instead of sizing buffers from it
+const uint32_t wire_max_queries = 4096;
+const uint16_t wire_max_k = 1024;
+
+struct WireHeader {
+	uint32_t magic;
+	uint32_t request_id;
+	uint16_t k;
+	uint16_t feature_size;
+	uint32_t num_queries;
+	uint16_t shard_id;	//responses only, 0 in requests
+	uint16_t shard_count;
+};
+
+inline void put_u16(uint8_t* p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+inline void put_u32(uint8_t* p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i)); }
+inline void put_u64(uint8_t* p, uint64_t v) { for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i)); }
+inline uint16_t get_u16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+inline uint32_t get_u32(const uint8_t* p) { uint32_t v = 0; for (int i = 3; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+inline uint64_t get_u64(const uint8_t* p) { uint64_t v = 0; for (int i = 7; i >= 0; i--) v = (v << 8) | p[i]; return v; }
+
+inline void put_f64(uint8_t* p, double v) { uint64_t bits; std::memcpy(&bits, &v, 8); put_u64(p, bits); }
+inline double get_f64(const uint8_t* p) { uint64_t bits = get_u64(p); double v; std::memcpy(&v, &bits, 8); return v; }
+
+inline void encode_header(uint8_t* p, const WireHeader& h) {
+	put_u32(p, h.magic);
+	put_u32(p + 4, h.request_id);
+	put_u16(p + 8, h.k);
+	put_u16(p + 10, h.feature_size);
+	put_u32(p + 12, h.num_queries);
+	put_u16(p + 16, h.shard_id);
+	put_u16(p + 18, h.shard_count);
+}
+
+inline WireHeader decode_header(const uint8_t* p) {
+	WireHeader h;
+	h.magic = get_u32(p);
+	h.request_id = get_u32(p + 4);
+	h.k = get_u16(p + 8);
+	h.feature_size = get_u16(p + 10);
+	h.num_queries = get_u32(p + 12);
+	h.shard_id = get_u16(p + 16);
+	h.shard_count = get_u16(p + 18);
+	return h;
+}
+
+//blocking send/receive of exactly len bytes, false when the peer went away
+inline bool send_all(socket_t s, const uint8_t* data, size_t len) {
+	while (len > 0) {
+		int sent = send(s, reinterpret_cast<const char*>(data), (int)len, 0);
+		if (sent <= 0) return false;
+		data += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+inline bool recv_all(socket_t s, uint8_t* data, size_t len) {
+	while (len > 0) {
+		int got = recv(s, reinterpret_cast<char*>(data), (int)len, 0);
+		if (got <= 0) return false;
+		data += got;
+		len -= got;
+	}
+	return true;
+}
+
+//one call per process before any socket is used
+inline bool init_sockets() {
+#ifdef _WIN32
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+	return true;
+#endif
+}
+
+inline void set_no_delay(socket_t s) {
+	int flag = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&flag), sizeof(flag));
+}
+
+inline socket_t listen_on(uint16_t port) {
+	socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s == invalid_socket) return invalid_socket;
+	int reuse = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+	sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(s, 16) != 0) {
+		close_socket(s);
+		return invalid_socket;
+	}
+	return s;
+}
+
+inline socket_t connect_to(const std::string& host, uint16_t port) {
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* result = nullptr;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+		return invalid_socket;
+	}
+	socket_t s = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	if (s != invalid_socket && connect(s, result->ai_addr, (int)result->ai_addrlen) != 0) {
+		close_socket(s);
+		s = invalid_socket;
+	}
+	freeaddrinfo(result);
+	if (s != invalid_socket) set_no_delay(s);
+	return s;
+}
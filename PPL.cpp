@@ -7,10 +7,12 @@
 #include <string>
 #include <chrono>
 #include <vector>
+#include <atomic>
 #include <ppl.h>
 #include <concurrent_vector.h>
 #include <concurrent_unordered_set.h>
 #include <ppltasks.h>
+#include "KnnScratch.h"
 
 using namespace std;
 using namespace concurrency;
@@ -34,61 +36,71 @@ private:
 public:
 	Knn(int k) : neighbours_number(k) {}
 	//parallel nth element
-	void compare(concurrent_vector<double> sortingTarget, int startingNum, concurrent_vector<double>* smallerGroup, concurrent_vector<double>* largerGroup) {
+	//the groups are arena buffers filled through atomic cursors, so a partition pass allocates nothing
+	void compare(const double* sortingTarget, int maxIterations, int startingNum, double* smallerGroup, atomic<int>& smallerCount, double* largerGroup, atomic<int>& largerCount) {
 
-		int maxIterations = sortingTarget.size();
 		parallel_for(startingNum + 1, maxIterations, [&](int i) {
-			if (sortingTarget.at(i) < sortingTarget.at(startingNum)) {
-				(*smallerGroup).push_back(sortingTarget.at(i));
+			if (sortingTarget[i] < sortingTarget[startingNum]) {
+				smallerGroup[smallerCount.fetch_add(1)] = sortingTarget[i];
 			}
 			else {
-				(*largerGroup).push_back(sortingTarget.at(i));
+				largerGroup[largerCount.fetch_add(1)] = sortingTarget[i];
 			}
 			});
-		if ((*smallerGroup).size() == 0)
+		if (smallerCount == 0)
 		{
-			(*smallerGroup).push_back(sortingTarget.at(startingNum));
+			smallerGroup[smallerCount++] = sortingTarget[startingNum];
 		}
 		else {
-			(*largerGroup).push_back(sortingTarget.at(startingNum));
+			largerGroup[largerCount++] = sortingTarget[startingNum];
 		}
 		return;
 	}
-	concurrent_vector<double> parallelNthElement(concurrent_vector<double> sortingTarget) {
-		concurrent_vector<double> reduced = sortingTarget;
-		concurrent_vector<double> smallerGroup, largerGroup;
-		concurrent_vector<double> temp;
+	//the neighbours_number smallest values of sortingTarget (unordered) written to output
+	//its buffers come from this thread's scratch arena, the caller's ScratchScope gives them back
+	void parallelNthElement(const double* sortingTarget, int size, double* output) {
+		ScratchArena& scratch = thread_scratch();
+		double* reduced = scratch.allocate<double>(size);
+		double* smallerGroup = scratch.allocate<double>(size);
+		double* largerGroup = scratch.allocate<double>(size);
+		double* temp = scratch.allocate<double>(neighbours_number);
+		copy(sortingTarget, sortingTarget + size, reduced);
+		int reducedCount = size;
+		int tempCount = 0;
 
 		do {
 			// Partition into smaller and larger
-			smallerGroup.clear();
-			largerGroup.clear();
-			compare(reduced, 0, &smallerGroup, &largerGroup);
+			atomic<int> smallerCount(0), largerCount(0);
+			compare(reduced, reducedCount, 0, smallerGroup, smallerCount, largerGroup, largerCount);
 
 			// Append previous smaller grp into current smaller grp
-			for (int i = 0; i < temp.size(); i++) {
-				smallerGroup.push_back(temp.at(i));
-			}
-			temp.clear();
+			int smallerSize = smallerCount;
+			copy(temp, temp + tempCount, smallerGroup + smallerSize);
+			smallerSize += tempCount;
+			tempCount = 0;
 			// If smaller.size == N, return
-			if (smallerGroup.size() == neighbours_number) {
-				return smallerGroup;
+			if (smallerSize == neighbours_number) {
+				copy(smallerGroup, smallerGroup + smallerSize, output);
+				return;
 			}
 			// If smaller.size > N, continue partition smaller grp
-			else if (smallerGroup.size() > neighbours_number) {
-				reduced = smallerGroup;
+			else if (smallerSize > neighbours_number) {
+				swap(reduced, smallerGroup);
+				reducedCount = smallerSize;
 			}
 			// If smaller.size < N, save smaller grp and continue partition larger grp
 			else {
-				reduced = largerGroup;
-				temp = smallerGroup;
+				copy(smallerGroup, smallerGroup + smallerSize, temp);
+				tempCount = smallerSize;
+				swap(reduced, largerGroup);
+				reducedCount = largerCount;
 			}
 
 		} while (true);
 	}
 
 	//KNN source code
-	int predict_class_serial(vector<vector<double>> dataset, vector<double> target, int dataset_size, int feature_size) {
+	int predict_class_serial(const vector<vector<double>>& dataset, const vector<double>& target, int dataset_size, int feature_size) {
 		vector<double> euclideanDistance;
 		int zeros_count = 0;
 		int ones_count = 0;
@@ -124,15 +136,19 @@ public:
 		cout << "Time difference of serial KNN= " << chrono::duration_cast<chrono::microseconds>(endTime - beginTime).count() << "[s]" << endl;
 		return prediction;
 	}
-	Output predict_class_parallel_for(concurrent_vector<vector<double>> dataset, concurrent_vector<double> target, int dataset_size, int feature_size) {
-		concurrent_vector<double> euclideanDistance;
-		concurrent_vector<double> kNearestNeighbour;
+	//only the K results returned are heap allocated
+	Output predict_class_parallel_for(const concurrent_vector<vector<double>>& dataset, const concurrent_vector<double>& target, int dataset_size, int feature_size) {
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		double* euclideanDistance = scratch.allocate<double>(dataset_size);
+		double* kNearestNeighbour = scratch.allocate<double>(neighbours_number);
+		atomic<int> distanceCount(0);
 		int zeros_count = 0;
 		int ones_count = 0;
 		chrono::steady_clock::time_point beginTime = chrono::steady_clock::now();
 
 		//calculate all euclidean distance
-		parallel_for(0, dataset_size, [&dataset, &target, &euclideanDistance, feature_size](int value) {
+		parallel_for(0, dataset_size, [&dataset, &target, euclideanDistance, &distanceCount, feature_size](int value) {
 			double l2 = 0.0;
 			double distance;
 			char str[20];
@@ -146,12 +162,12 @@ public:
 			if (distance > 0)
 			{
 				// compress euclidean distance and label of point
-				euclideanDistance.push_back(distance + (dataset.at(value).at(0) / 1000000 + 0.000001));
+				euclideanDistance[distanceCount.fetch_add(1)] = distance + (dataset.at(value).at(0) / 1000000 + 0.000001);
 			}
 			});
 
 		//sort euclidean distance
-		kNearestNeighbour = parallelNthElement(euclideanDistance);
+		parallelNthElement(euclideanDistance, distanceCount, kNearestNeighbour);
 
 		
 		// Count label occurrences in the K nearest neighbors
@@ -166,7 +182,7 @@ public:
 		int prediction = (zeros_count > ones_count) ? 0 : 1;
 		chrono::steady_clock::time_point endTime = chrono::steady_clock::now();
 		cout << "Time used by program = " << chrono::duration_cast<chrono::microseconds>(endTime - beginTime).count() << "[s]" << endl;
-		return { kNearestNeighbour, prediction };
+		return { concurrent_vector<double>(kNearestNeighbour, kNearestNeighbour + neighbours_number), prediction };
 	}
 };
 
@@ -0,0 +1,144 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "IntegerFeatureStore.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PACKED_STORE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//number of 0/1 columns that fit in the bit mask and of small ordinal columns kept as bytes
+const int packed_binary_capacity = 16;
+const int packed_ordinal_capacity = 8;
+
+//one dataset row in 12 bytes instead of 22 doubles (176 bytes)
+//the 0/1 flags (HighBP, HighChol, CholCheck, Smoker, Stroke, ...) are bits of binary_bits,
+//the ordinal columns (BMI, GenHlth, MentHlth, PhysHlth, Age, Education, Income) are one byte each
+struct PackedRow {
+	uint16_t binary_bits;
+	uint8_t label;
+	uint8_t ordinals[packed_ordinal_capacity];
+};
+static_assert(sizeof(PackedRow) < 16, "packed row must stay under 16 bytes");
+
+inline int popcount16(uint16_t bits) {
+#if defined(_MSC_VER)
+	return (int)__popcnt16(bits);
+#else
+	return __builtin_popcount(bits);
+#endif
+}
+
+//hybrid row storage for the exact integer path, built from an IntegerFeatureStore
+//for a 0/1 column (x - y)^2 is x XOR y, so the binary part of the squared distance is one popcount,
+//the ordinal part is a short SIMD sum of squared byte differences
+//the distance is exactly the one IntegerFeatureStore computes, so both feed the same histogram KNN
+class PackedFeatureStore {
+private:
+	std::vector<PackedRow> packed;
+	std::vector<int> binary_columns;	//feature column of every bit
+	std::vector<int> ordinal_columns;	//feature column of every ordinal byte
+	std::vector<int> ordinal_min;
+	std::vector<int> ordinal_max;
+
+public:
+	struct Query {
+		uint16_t binary_bits;
+		int16_t ordinals[packed_ordinal_capacity]; //widened once so the kernel does not unpack the query per row
+	};
+
+	//false when the dataset has more 0/1 or ordinal columns than a packed row can hold
+	bool build(const IntegerFeatureStore& store) {
+		binary_columns.clear();
+		ordinal_columns.clear();
+		ordinal_min.clear();
+		ordinal_max.clear();
+		for (int j = 0; j < store.feature_width(); j++) {
+			if (store.max_value(j) <= 1) {
+				binary_columns.push_back(j);
+			}
+			else {
+				ordinal_columns.push_back(j);
+				ordinal_min.push_back(store.min_value(j));
+				ordinal_max.push_back(store.max_value(j));
+			}
+		}
+		if ((int)binary_columns.size() > packed_binary_capacity || (int)ordinal_columns.size() > packed_ordinal_capacity) {
+			packed.clear();
+			return false;
+		}
+
+		packed.assign(store.size(), PackedRow{});
+		for (int i = 0; i < store.size(); i++) {
+			const uint8_t* row = store.row(i);
+			PackedRow& out = packed[i];
+			out.label = (uint8_t)store.label(i);
+			for (int b = 0; b < (int)binary_columns.size(); b++) {
+				out.binary_bits |= (uint16_t)(row[binary_columns[b]] << b);
+			}
+			for (int o = 0; o < (int)ordinal_columns.size(); o++) {
+				out.ordinals[o] = row[ordinal_columns[o]];
+			}
+		}
+		return true;
+	}
+
+	//query from a raw row of doubles (column 0 ignored), false when it is not integer
+	bool encode_query(const double* target, Query& out) const {
+		std::memset(&out, 0, sizeof(out));
+		for (int b = 0; b < (int)binary_columns.size(); b++) {
+			double value = target[binary_columns[b] + 1];
+			if (value != 0.0 && value != 1.0) return false;
+			out.binary_bits |= (uint16_t)((int)value << b);
+		}
+		for (int o = 0; o < (int)ordinal_columns.size(); o++) {
+			double value = target[ordinal_columns[o] + 1];
+			if (value < 0.0 || value > 255.0 || value != (double)(int)value) return false;
+			out.ordinals[o] = (int16_t)value;
+		}
+		return true;
+	}
+
+	uint32_t max_squared_distance(const Query& query) const {
+		uint32_t bound = (uint32_t)binary_columns.size();
+		for (int o = 0; o < (int)ordinal_columns.size(); o++) {
+			int low = query.ordinals[o] - ordinal_min[o];
+			int high = ordinal_max[o] - query.ordinals[o];
+			int far = (low > high) ? low : high;
+			bound += (uint32_t)(far * far);
+		}
+		return bound;
+	}
+
+	uint32_t distance(const Query& query, int i) const {
+		const PackedRow& row = packed[i];
+		uint32_t l2 = (uint32_t)popcount16((uint16_t)(query.binary_bits ^ row.binary_bits));
+#ifdef PACKED_STORE_SSE2
+		//8 ordinal bytes -> 8 int16, then madd gives 4 sums of two squared differences
+		__m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(row.ordinals)), _mm_setzero_si128());
+		__m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query.ordinals));
+		__m128i diff = _mm_sub_epi16(q, r);
+		__m128i sq = _mm_madd_epi16(diff, diff);
+		sq = _mm_add_epi32(sq, _mm_shuffle_epi32(sq, _MM_SHUFFLE(1, 0, 3, 2)));
+		sq = _mm_add_epi32(sq, _mm_shuffle_epi32(sq, _MM_SHUFFLE(2, 3, 0, 1)));
+		l2 += (uint32_t)_mm_cvtsi128_si32(sq);
+#else
+		for (int o = 0; o < packed_ordinal_capacity; o++) {
+			int diff = query.ordinals[o] - row.ordinals[o];
+			l2 += (uint32_t)(diff * diff);
+		}
+#endif
+		return l2;
+	}
+
+	int size() const { return (int)packed.size(); }
+	int label(int i) const { return packed[i].label; }
+	int binary_count() const { return (int)binary_columns.size(); }
+	int ordinal_count() const { return (int)ordinal_columns.size(); }
+};
@@ -0,0 +1,178 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+//relative slack on the projected bound, covers the rounding of the projection and of the eigenvectors
+const double pca_bound_slack = 1e-9;
+//Jacobi sweeps stop once the off-diagonal mass is this small relative to the diagonal
+const double jacobi_tolerance = 1e-14;
+const int jacobi_max_sweeps = 100;
+
+//eigen-decomposition of the symmetric n x n matrix a (row-major, destroyed) by cyclic Jacobi rotations
+//values[i] is the eigenvalue of the eigenvector in column i of vectors (row-major n x n)
+inline void jacobi_eigen(std::vector<double>& a, int n, std::vector<double>& values, std::vector<double>& vectors) {
+	vectors.assign((size_t)n * n, 0.0);
+	for (int i = 0; i < n; i++) vectors[(size_t)i * n + i] = 1.0;
+
+	for (int sweep = 0; sweep < jacobi_max_sweeps; sweep++) {
+		double off = 0.0, diagonal = 0.0;
+		for (int i = 0; i < n; i++) {
+			diagonal += a[(size_t)i * n + i] * a[(size_t)i * n + i];
+			for (int j = i + 1; j < n; j++) off += a[(size_t)i * n + j] * a[(size_t)i * n + j];
+		}
+		if (off <= jacobi_tolerance * jacobi_tolerance * diagonal) break;
+
+		for (int p = 0; p < n; p++) {
+			for (int q = p + 1; q < n; q++) {
+				double apq = a[(size_t)p * n + q];
+				if (apq == 0.0) continue;
+				//rotation angle that zeroes a[p][q]
+				double theta = (a[(size_t)q * n + q] - a[(size_t)p * n + p]) / (2.0 * apq);
+				double t = ((theta >= 0.0) ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+				double c = 1.0 / std::sqrt(t * t + 1.0);
+				double s = t * c;
+				for (int k = 0; k < n; k++) {
+					double akp = a[(size_t)k * n + p], akq = a[(size_t)k * n + q];
+					a[(size_t)k * n + p] = c * akp - s * akq;
+					a[(size_t)k * n + q] = s * akp + c * akq;
+				}
+				for (int k = 0; k < n; k++) {
+					double apk = a[(size_t)p * n + k], aqk = a[(size_t)q * n + k];
+					a[(size_t)p * n + k] = c * apk - s * aqk;
+					a[(size_t)q * n + k] = s * apk + c * aqk;
+				}
+				for (int k = 0; k < n; k++) {
+					double vkp = vectors[(size_t)k * n + p], vkq = vectors[(size_t)k * n + q];
+					vectors[(size_t)k * n + p] = c * vkp - s * vkq;
+					vectors[(size_t)k * n + q] = s * vkp + c * vkq;
+				}
+			}
+		}
+	}
+	values.resize(n);
+	for (int i = 0; i < n; i++) values[i] = a[(size_t)i * n + i];
+}
+
+//PCA side table: every row projected on the top principal components of the stored rows, a few floats per row
+//the components are orthonormal, so the projected distance never exceeds the real one (Bessel's inequality)
+//and a row whose projected distance already passes the K-th best is rejected without reading its features
+class PcaTable {
+private:
+	int feature_size = 0;
+	int width = 0;		//feature columns, the label is not projected
+	int dims = 0;
+	int rows = 0;
+	std::vector<double> mean;
+	std::vector<double> components;	//dims * width, strongest component first
+	std::vector<float> table;		//rows * dims
+	double explained = 0.0;
+	double float_error = 0.0;		//largest distance between a stored float projection and the exact one
+
+public:
+	void setup(int feature_size, int dimensions, int dataset_size) {
+		this->feature_size = feature_size;
+		width = feature_size - 1;
+		dims = std::min(dimensions, width);
+		rows = dataset_size;
+		table.assign((size_t)rows * dims, 0.0f);
+	}
+
+	//sums (width) and cross products (width * width, upper triangle) of rows [start, end) for the covariance,
+	//every thread sums its own range and the parts are added before solve()
+	void accumulate(const double* const dataset[], int start, int end, double* sums, double* cross) const {
+		for (int i = start; i < end; i++) {
+			const double* x = dataset[i] + 1;
+			for (int a = 0; a < width; a++) {
+				sums[a] += x[a];
+				for (int b = a; b < width; b++) cross[(size_t)a * width + b] += x[a] * x[b];
+			}
+		}
+	}
+
+	//covariance from the summed parts, then its eigenvectors; keeps the dims strongest
+	void solve(const double* sums, const double* cross) {
+		mean.assign(width, 0.0);
+		for (int a = 0; a < width; a++) mean[a] = sums[a] / rows;
+		std::vector<double> covariance((size_t)width * width);
+		for (int a = 0; a < width; a++) {
+			for (int b = a; b < width; b++) {
+				double value = cross[(size_t)a * width + b] / rows - mean[a] * mean[b];
+				covariance[(size_t)a * width + b] = value;
+				covariance[(size_t)b * width + a] = value;
+			}
+		}
+
+		std::vector<double> values, vectors;
+		jacobi_eigen(covariance, width, values, vectors);
+		std::vector<int> order(width);
+		for (int i = 0; i < width; i++) order[i] = i;
+		std::sort(order.begin(), order.end(), [&values](int x, int y) { return values[x] > values[y]; });
+
+		double total = 0.0, kept = 0.0;
+		for (int i = 0; i < width; i++) total += std::max(values[i], 0.0);
+		components.assign((size_t)dims * width, 0.0);
+		for (int d = 0; d < dims; d++) {
+			kept += std::max(values[order[d]], 0.0);
+			for (int a = 0; a < width; a++) components[(size_t)d * width + a] = vectors[(size_t)a * width + order[d]];
+		}
+		explained = (total > 0.0) ? kept / total : 1.0;
+	}
+
+	//projections of rows [start, end), returns the largest projected norm of the range for finish()
+	double fill(const double* const dataset[], int start, int end) {
+		double largest = 0.0;
+		double projected[64];
+		for (int i = start; i < end; i++) {
+			project(dataset[i], projected);
+			float* out = &table[(size_t)i * dims];
+			double norm = 0.0;
+			for (int d = 0; d < dims; d++) {
+				out[d] = (float)projected[d];
+				norm += projected[d] * projected[d];
+			}
+			largest = std::max(largest, std::sqrt(norm));
+		}
+		return largest;
+	}
+
+	//a float coordinate is off by at most 2^-24 of its value, so a stored projection is off by at most
+	//2^-24 of the largest projected norm
+	void finish(double largest_norm) {
+		float_error = largest_norm * (1.0 / (1 << 24)) * (1.0 + 1e-3) + 1e-12;
+	}
+
+	//(x - mean) on the components, out gets dims values (at most 64)
+	void project(const double* x, double* out) const {
+		for (int d = 0; d < dims; d++) {
+			const double* component = &components[(size_t)d * width];
+			double value = 0.0;
+			for (int a = 0; a < width; a++) value += (x[a + 1] - mean[a]) * component[a];
+			out[d] = value;
+		}
+	}
+
+	//squared distance between a projected query and the stored projection of row i
+	double projected_distance(const double* query, int i) const {
+		const float* row = &table[(size_t)i * dims];
+		double l2 = 0.0;
+		for (int d = 0; d < dims; d++) {
+			double diff = query[d] - row[d];
+			l2 += diff * diff;
+		}
+		return l2;
+	}
+
+	//a row whose projected_distance is above this cannot have a squared distance <= bound,
+	//the float error of the stored projection and the rounding slack are added to the bound
+	double reject_threshold(double bound) const {
+		if (bound == std::numeric_limits<double>::infinity()) return bound;
+		double limit = std::sqrt(bound) * (1.0 + pca_bound_slack) + float_error;
+		return limit * limit;
+	}
+
+	int dimensions() const { return dims; }
+	double explained_variance() const { return explained; }
+	size_t table_bytes() const { return table.size() * sizeof(float); }
+};
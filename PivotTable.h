@@ -0,0 +1,94 @@
+#pragma once
+#include <cmath>
+#include <random>
+#include <vector>
+#include "KnnDistance.h"
+
+//relative slack taken off every pivot lower bound, covers the float rounding of the side table
+const double pivot_bound_slack = 1e-6;
+
+//LAESA-style pivot side table: for a few pivot rows p the real (non-squared) distance d(x, p) of every row
+//is stored as a float, P floats per row instead of a full row of doubles
+//by the triangle inequality |d(q, p) - d(x, p)| <= d(q, x), so a row whose largest pivot gap already passes
+//the K-th best distance is rejected without reading its feature vector
+class PivotTable {
+private:
+	int num_pivots = 0;
+	int feature_size = 0;
+	int rows = 0;
+	std::vector<double> pivots;	//num_pivots * feature_size, copies of the chosen rows
+	std::vector<float> table;	//rows * num_pivots, row-major so one row's gaps sit in one cache line
+
+public:
+	//farthest-first traversal: every new pivot is the row farthest from the pivots chosen so far,
+	//spread out pivots give tighter bounds than random ones
+	void select_pivots(const double* const dataset[], int dataset_size, int feature_size, int pivot_count, unsigned seed) {
+		this->feature_size = feature_size;
+		rows = dataset_size;
+		num_pivots = (pivot_count < dataset_size) ? pivot_count : dataset_size;
+		pivots.assign((size_t)num_pivots * feature_size, 0.0);
+		table.assign((size_t)rows * num_pivots, 0.0f);
+		if (num_pivots == 0) return;
+
+		std::vector<double> nearest_pivot(dataset_size, INFINITY);
+		std::mt19937 generator(seed);
+		const double* start = dataset[std::uniform_int_distribution<int>(0, dataset_size - 1)(generator)];
+		int farthest = farthest_row(dataset, dataset_size, start, nearest_pivot, false);
+
+		for (int p = 0; p < num_pivots; p++) {
+			const double* row = dataset[farthest];
+			std::copy(row, row + feature_size, pivots.begin() + (size_t)p * feature_size);
+			farthest = farthest_row(dataset, dataset_size, pivot(p), nearest_pivot, true);
+		}
+	}
+
+	//distances of rows [start, end) to every pivot, ranges of different threads do not overlap
+	void fill(const double* const dataset[], int start, int end) {
+		for (int i = start; i < end; i++) {
+			float* gaps = &table[(size_t)i * num_pivots];
+			for (int p = 0; p < num_pivots; p++) {
+				gaps[p] = (float)std::sqrt(squared_distance(dataset[i], pivot(p), feature_size));
+			}
+		}
+	}
+
+	//d(q, p) for every pivot, computed once per query
+	void query_distances(const double* target, double* out) const {
+		for (int p = 0; p < num_pivots; p++) {
+			out[p] = std::sqrt(squared_distance(target, pivot(p), feature_size));
+		}
+	}
+
+	//squared lower bound of the distance between the query and row i
+	double lower_bound(const double* query_distances, int i) const {
+		const float* gaps = &table[(size_t)i * num_pivots];
+		double bound = 0.0;
+		for (int p = 0; p < num_pivots; p++) {
+			double gap = std::fabs(query_distances[p] - gaps[p]) - pivot_bound_slack * (query_distances[p] + gaps[p] + 1.0);
+			if (gap > bound) bound = gap;
+		}
+		return bound * bound;
+	}
+
+	int pivot_count() const { return num_pivots; }
+	size_t table_bytes() const { return table.size() * sizeof(float); }
+
+private:
+	const double* pivot(int p) const { return &pivots[(size_t)p * feature_size]; }
+
+	//row with the largest distance to its nearest pivot, nearest_pivot is updated with from when update is set
+	int farthest_row(const double* const dataset[], int dataset_size, const double* from, std::vector<double>& nearest_pivot, bool update) const {
+		int farthest = 0;
+		double farthest_distance = -1.0;
+		for (int i = 0; i < dataset_size; i++) {
+			double distance = squared_distance(dataset[i], from, feature_size);
+			if (update && distance < nearest_pivot[i]) nearest_pivot[i] = distance;
+			double score = update ? nearest_pivot[i] : distance;
+			if (score > farthest_distance) {
+				farthest_distance = score;
+				farthest = i;
+			}
+		}
+		return farthest;
+	}
+};
@@ -0,0 +1,226 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <vector>
+
+//the pshufb scan is compiled on every x86 build, whatever ISA the project enables, and used when the CPU has SSSE3
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PQ_INDEX_SSSE3
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PQ_TARGET_SSSE3
+#else
+#include <cpuid.h>
+#define PQ_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+//product quantisation: the features are split into pq_subspaces groups, every group of a row is replaced by
+//the nearest of pq_centroids centroids, so a row becomes pq_subspaces 4-bit codes (4 bytes for 21 features)
+//a query turns into one 16-entry table of distances per sub-space (asymmetric distance: the query is not
+//quantised), the approximate distance of a row is the sum of its codes' entries
+const int pq_subspaces = 7;
+const int pq_centroids = 16;
+//two codes per byte
+const int pq_code_bytes = (pq_subspaces + 1) / 2;
+//rows per code block, one SSE register of codes per byte of the row
+const int pq_block_rows = 16;
+const int pq_kmeans_iterations = 12;
+
+//runtime check, the build may target plain SSE2
+inline bool pq_cpu_has_ssse3() {
+#if !defined(PQ_INDEX_SSSE3)
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 9)) != 0;
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	return (ecx & bit_SSSE3) != 0;
+#endif
+}
+
+//codes are stored per block of pq_block_rows rows, byte b of all 16 rows next to each other (low nibble:
+//sub-space 2b, high nibble: sub-space 2b + 1), so pshufb looks up 16 rows of a sub-space in one instruction;
+//the tables are quantised to bytes and the sums kept in 16 bits
+class ProductQuantizer {
+private:
+	int feature_size = 0;
+	int rows = 0;
+	std::vector<std::vector<int>> columns;		//stored columns of every sub-space, interleaved so the sub-spaces get similar variance
+	std::vector<std::vector<double>> codebooks;	//sub-space m: pq_centroids * columns[m].size()
+	std::vector<uint8_t> codes;					//blocks * pq_code_bytes * pq_block_rows
+	bool use_ssse3 = pq_cpu_has_ssse3();
+
+public:
+	struct Query {
+		uint8_t tables[pq_code_bytes * 2][pq_centroids];	//quantised, the unused last sub-space is all zero
+		double scale;	//table units per squared distance unit
+		double offset;	//sum of the per sub-space minimum removed before quantising
+	};
+
+	//sub-space m holds the feature columns m + 1, m + 1 + pq_subspaces, ...
+	void setup(int feature_size, int dataset_size) {
+		this->feature_size = feature_size;
+		rows = dataset_size;
+		columns.assign(pq_subspaces, std::vector<int>());
+		for (int j = 1; j < feature_size; j++) {
+			columns[(j - 1) % pq_subspaces].push_back(j);
+		}
+		codebooks.assign(pq_subspaces, std::vector<double>());
+		codes.assign((size_t)blocks() * pq_code_bytes * pq_block_rows, 0);
+	}
+
+	//k-means of sub-space m on the sample rows, sub-spaces are independent and can be trained in parallel
+	void train_subspace(int m, const double* const dataset[], const std::vector<int>& sample, unsigned seed) {
+		const std::vector<int>& cols = columns[m];
+		int dims = (int)cols.size();
+		std::vector<double>& centroids = codebooks[m];
+		centroids.assign((size_t)pq_centroids * dims, 0.0);
+		if (dims == 0 || sample.empty()) return;
+
+		std::mt19937 generator(seed + m);
+		std::uniform_int_distribution<int> pick(0, (int)sample.size() - 1);
+		for (int c = 0; c < pq_centroids; c++) {
+			const double* row = dataset[sample[pick(generator)]];
+			for (int d = 0; d < dims; d++) centroids[(size_t)c * dims + d] = row[cols[d]];
+		}
+
+		std::vector<double> sums((size_t)pq_centroids * dims);
+		std::vector<int> counts(pq_centroids);
+		for (int iteration = 0; iteration < pq_kmeans_iterations; iteration++) {
+			std::fill(sums.begin(), sums.end(), 0.0);
+			std::fill(counts.begin(), counts.end(), 0);
+			for (int i : sample) {
+				int c = nearest_centroid(m, dataset[i]);
+				counts[c]++;
+				for (int d = 0; d < dims; d++) sums[(size_t)c * dims + d] += dataset[i][cols[d]];
+			}
+			//an empty centroid keeps its place, the few sub-space values repeat a lot
+			for (int c = 0; c < pq_centroids; c++) {
+				if (counts[c] == 0) continue;
+				for (int d = 0; d < dims; d++) centroids[(size_t)c * dims + d] = sums[(size_t)c * dims + d] / counts[c];
+			}
+		}
+	}
+
+	//codes of the rows of blocks [first_block, end_block), blocks are disjoint so ranges can be encoded in parallel
+	void encode_blocks(const double* const dataset[], int first_block, int end_block) {
+		for (int b = first_block; b < end_block; b++) {
+			uint8_t* block = &codes[(size_t)b * pq_code_bytes * pq_block_rows];
+			for (int r = 0; r < pq_block_rows; r++) {
+				int i = b * pq_block_rows + r;
+				if (i >= rows) break;
+				for (int m = 0; m < pq_subspaces; m++) {
+					uint8_t code = (uint8_t)nearest_centroid(m, dataset[i]);
+					block[(m / 2) * pq_block_rows + r] |= (m % 2 == 0) ? code : (uint8_t)(code << 4);
+				}
+			}
+		}
+	}
+
+	void prepare_query(const double* target, Query& query) const {
+		double table[pq_subspaces][pq_centroids];
+		double widest = 0.0;
+		query.offset = 0.0;
+		for (int m = 0; m < pq_subspaces; m++) {
+			double low = std::numeric_limits<double>::infinity();
+			double high = 0.0;
+			for (int c = 0; c < pq_centroids; c++) {
+				table[m][c] = centroid_distance(m, c, target);
+				low = std::min(low, table[m][c]);
+				high = std::max(high, table[m][c]);
+			}
+			for (int c = 0; c < pq_centroids; c++) table[m][c] -= low;
+			query.offset += low;
+			widest = std::max(widest, high - low);
+		}
+		query.scale = (widest > 0.0) ? 255.0 / widest : 1.0;
+		for (int t = 0; t < pq_code_bytes * 2; t++) {
+			for (int c = 0; c < pq_centroids; c++) {
+				query.tables[t][c] = (t < pq_subspaces) ? (uint8_t)std::lround(table[t][c] * query.scale) : 0;
+			}
+		}
+	}
+
+	//quantised approximate distances of the 16 rows of block b (rows past the end get garbage, skip them)
+	void scan_block(const Query& query, int b, uint16_t out[pq_block_rows]) const {
+		const uint8_t* block = &codes[(size_t)b * pq_code_bytes * pq_block_rows];
+#ifdef PQ_INDEX_SSSE3
+		if (use_ssse3) {
+			scan_block_ssse3(query, block, out);
+			return;
+		}
+#endif
+		for (int r = 0; r < pq_block_rows; r++) {
+			int sum = 0;
+			for (int byte = 0; byte < pq_code_bytes; byte++) {
+				uint8_t packed = block[byte * pq_block_rows + r];
+				sum += query.tables[2 * byte][packed & 0x0F] + query.tables[2 * byte + 1][packed >> 4];
+			}
+			out[r] = (uint16_t)sum;
+		}
+	}
+
+	//quantised table sum back to a squared distance
+	double approx_distance(const Query& query, uint16_t sum) const { return sum / query.scale + query.offset; }
+
+	int blocks() const { return (rows + pq_block_rows - 1) / pq_block_rows; }
+	int size() const { return rows; }
+	size_t bytes() const { return codes.size(); }
+	bool simd() const { return use_ssse3; }
+
+private:
+#ifdef PQ_INDEX_SSSE3
+	PQ_TARGET_SSSE3 void scan_block_ssse3(const Query& query, const uint8_t* block, uint16_t out[pq_block_rows]) const {
+		const __m128i low_mask = _mm_set1_epi8(0x0F);
+		const __m128i zero = _mm_setzero_si128();
+		__m128i sum_low = _mm_setzero_si128();	//rows 0..7
+		__m128i sum_high = _mm_setzero_si128();	//rows 8..15
+		for (int byte = 0; byte < pq_code_bytes; byte++) {
+			__m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + byte * pq_block_rows));
+			__m128i low_codes = _mm_and_si128(packed, low_mask);
+			__m128i high_codes = _mm_and_si128(_mm_srli_epi16(packed, 4), low_mask);
+			__m128i low_table = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query.tables[2 * byte]));
+			__m128i high_table = _mm_loadu_si128(reinterpret_cast<const __m128i*>(query.tables[2 * byte + 1]));
+			__m128i first = _mm_shuffle_epi8(low_table, low_codes);
+			__m128i second = _mm_shuffle_epi8(high_table, high_codes);
+			sum_low = _mm_add_epi16(sum_low, _mm_add_epi16(_mm_unpacklo_epi8(first, zero), _mm_unpacklo_epi8(second, zero)));
+			sum_high = _mm_add_epi16(sum_high, _mm_add_epi16(_mm_unpackhi_epi8(first, zero), _mm_unpackhi_epi8(second, zero)));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), sum_low);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), sum_high);
+	}
+#endif
+
+	double centroid_distance(int m, int c, const double* row) const {
+		const std::vector<int>& cols = columns[m];
+		int dims = (int)cols.size();
+		const double* centroid = &codebooks[m][(size_t)c * dims];
+		double l2 = 0.0;
+		for (int d = 0; d < dims; d++) {
+			double diff = row[cols[d]] - centroid[d];
+			l2 += diff * diff;
+		}
+		return l2;
+	}
+
+	int nearest_centroid(int m, const double* row) const {
+		int best = 0;
+		double best_distance = std::numeric_limits<double>::infinity();
+		for (int c = 0; c < pq_centroids; c++) {
+			double distance = centroid_distance(m, c, row);
+			if (distance < best_distance) {
+				best_distance = distance;
+				best = c;
+			}
+		}
+		return best;
+	}
+};
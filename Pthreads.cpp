@@ -6,17 +6,58 @@
 #include <string>
 #include <chrono>
 #include <vector>
+#include <cstring>
+#include <atomic>
+#include <random>
 #define HAVE_STRUCT_TIMESPEC
 #include <pthread.h>
+#include "FeatureScaler.h"
+#include "KnnScratch.h"
+#include "KnnTopK.h"
+#include "IntegerFeatureStore.h"
+#include "PackedFeatureStore.h"
+#include "KnnDistance.h"
+#include "BinaryDataset.h"
+#include "SharedFeatureStore.h"
+#include "PivotTable.h"
+#include "KnnGraph.h"
+#include "ResultCache.h"
+#include "TraceRecorder.h"
+#include "FloatFeatureStore.h"
+#include "PqIndex.h"
+#include "PcaTable.h"
 using namespace std;
 
 const int num_threads = 8;
 const int best_record_each_thread = 5;
 const int num_record_to_sort = num_threads * best_record_each_thread;
 const int k_value = 3;
+//rows per block in out-of-core mode, two blocks are in memory at any time
+const int out_of_core_block_rows = 1 << 16;
+//pivots of the LAESA side table, each costs 4 bytes per row and one distance per query
+const int num_pivots = 8;
+const unsigned pivot_seed = 42;
+//entries kept by the result cache, a few MB for the default
+const size_t result_cache_capacity = 1 << 16;
+//ranked retrieval: 8 bit digits, so a 64-bit key takes at most 8 counting passes
+const int radix_bits = 8;
+const int radix_buckets = 1 << radix_bits;
+//all-kNN graph: neighbours kept per row (the largest K it can answer) and where it is persisted
+const int graph_k_max = 16;
+const string graph_filename = "knn_graph.bin";
+//anytime KNN: rows a thread takes at a time, and how often it looks at the clock within a block
+const int anytime_block_rows = 1024;
+const int anytime_clock_rows = 256;
+const unsigned anytime_seed = 42;
+//product quantisation: rows the codebooks are trained on, approximate candidates re-ranked exactly per query
+const int pq_train_rows = 1 << 16;
+const int pq_rerank = 64;
+const unsigned pq_seed = 42;
+//principal components kept in the PCA side table
+const int pca_dimensions = 6;
 
 struct PthreadParams {
-	double** dataset;
+	const double* const* dataset;
 	const double* target;
 	double** distances;
 	int dataset_size;
@@ -26,6 +67,180 @@ struct PthreadParams {
 	int thread_id;
 };
 
+struct ScalingParams {
+	double** dataset;
+	FeatureStats* stats;
+	const FeatureScaler* scaler;
+	int start;
+	int end;
+};
+
+//Store is IntegerFeatureStore or PackedFeatureStore, both give the same exact integer distance
+template <typename Store>
+struct HistogramParams {
+	const Store* store;
+	const typename Store::Query* query;
+	uint32_t* distances; //distance of every row, each thread writes its own range
+	uint32_t* histogram; //this thread's histogram
+	uint32_t bins;
+	uint32_t threshold;
+	Neighbour* output; //where this thread writes its rows at or below the threshold
+	int start;
+	int end;
+};
+
+struct BlockReadParams {
+	BinaryDatasetReader* reader;
+	double* buffer;
+	int max_rows;
+	int rows_read;
+};
+
+struct BlockScanParams {
+	double* block;
+	const double* target;
+	const FeatureScaler* scaler;
+	long long first_row; //index of the first row of the block in the file
+	int start;
+	int end;
+	int feature_size;
+	TopK best;	//indices are rows of the block, the file row is first_row + index
+};
+
+//neighbour of the out-of-core scan, the file can hold more rows than an int counts
+struct FileNeighbour {
+	double distance;
+	long long row;
+	int label;
+};
+
+struct PivotFillParams {
+	const double* const* dataset;
+	PivotTable* table;
+	int start;
+	int end;
+};
+
+struct PivotScanParams {
+	const double* const* dataset;
+	const PivotTable* table;
+	const double* target;
+	const double* query_distances; //d(target, pivot) of every pivot
+	int feature_size;
+	int start;
+	int end;
+	int rows_touched; //rows whose feature vector had to be read
+	TopK best;
+};
+
+struct AnytimeScanParams {
+	const double* const* dataset;
+	const int* order;		//random permutation of the rows
+	const double* target;
+	int feature_size;
+	int dataset_size;
+	atomic<int>* next_block;	//next block of order to hand out, shared by all threads
+	chrono::steady_clock::time_point deadline;
+	int rows_scanned;
+	TopK best;
+};
+
+struct FloatScanParams {
+	const double* const* dataset;
+	const FloatFeatureStore* store;
+	const FloatFeatureStore::Query* query;
+	const double* target;
+	int start;
+	int end;
+	TopK approx_best;		//K best approximate distances, they set the candidate threshold
+	vector<int>* candidates;	//rows to re-rank in double
+};
+
+struct PqTrainParams {
+	ProductQuantizer* pq;
+	const double* const* dataset;
+	const vector<int>* sample;
+	int subspace;
+};
+
+struct PqEncodeParams {
+	ProductQuantizer* pq;
+	const double* const* dataset;
+	int first_block;
+	int end_block;
+};
+
+struct PqScanParams {
+	const ProductQuantizer* pq;
+	const ProductQuantizer::Query* query;
+	const double* const* dataset;
+	const double* target;
+	int feature_size;
+	int start;	//blocks of the index, not rows
+	int end;
+	TopK best;	//pq_rerank best approximate rows of the range
+};
+
+struct PcaCovarianceParams {
+	const double* const* dataset;
+	const PcaTable* table;
+	int start;
+	int end;
+	double* sums;	//this thread's part of the column sums
+	double* cross;	//and of the cross products
+};
+
+struct PcaFillParams {
+	const double* const* dataset;
+	PcaTable* table;
+	int start;
+	int end;
+	double largest_norm;
+};
+
+struct PcaScanParams {
+	const double* const* dataset;
+	const PcaTable* table;
+	const double* target;
+	const double* projected_target;
+	int feature_size;
+	int start;
+	int end;
+	int rows_touched; //rows whose feature vector had to be read
+	TopK best;
+};
+
+struct GraphParams {
+	const double* const* dataset;
+	KnnGraph* graph;
+	const int* nodes; //nodes this build computes, duplicates are copied afterwards
+	int dataset_size;
+	int feature_size;
+	int start;
+	int end;
+};
+
+struct RankKeyParams {
+	const double* const* dataset;
+	const double* target;
+	uint64_t* keys;
+	int* rows;
+	int feature_size;
+	int start;
+	int end;
+};
+
+struct RadixParams {
+	const uint64_t* keys_in;
+	const int* rows_in;
+	uint64_t* keys_out;
+	int* rows_out;
+	size_t* offsets; //this thread's radix_buckets counters, then its first output slot per bucket
+	int shift;
+	int start;
+	int end;
+};
+
 struct quickSortParams {
 	double** distances;
 	int low;
@@ -39,15 +254,16 @@ private:
 public:
 	PthreadKnn(int k) : neighbours_number(k) {}
 
-	int predict_class(double* dataset[], const double* target, int dataset_size, int feature_size) {
+	int predict_class(const double* const dataset[], const double* target, int dataset_size, int feature_size) {
 		double* distances[3];
 		int zeros_count = 0;
 		int ones_count = 0;
 
-		// Allocate memory for distances and index order
-		distances[0] = new double[dataset_size];
-		distances[1] = new double[dataset_size];
-		distances[2] = new double[dataset_size];
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		distances[0] = scratch.allocate<double>(dataset_size);
+		distances[1] = scratch.allocate<double>(dataset_size);
+		distances[2] = scratch.allocate<double>(dataset_size);
 
 		//chrono::steady_clock::time_point knnBegin = chrono::steady_clock::now();
 		get_knn(dataset, target, distances, dataset_size, feature_size);
@@ -78,9 +294,9 @@ public:
 		}
 
 		double* finalSortedDistances[3];
-		finalSortedDistances[0] = new double[num_record_to_sort];
-		finalSortedDistances[1] = new double[num_record_to_sort];
-		finalSortedDistances[2] = new double[num_record_to_sort];
+		finalSortedDistances[0] = scratch.allocate<double>(num_record_to_sort);
+		finalSortedDistances[1] = scratch.allocate<double>(num_record_to_sort);
+		finalSortedDistances[2] = scratch.allocate<double>(num_record_to_sort);
 
 		//extract first 5 from each thread (shortest distance for each thread)
 		//i < 3 because distance is 2d array and distance[3][i] is largest
@@ -101,7 +317,10 @@ public:
 
 		//sort again
 		//the number of record need to serial sort is rapidly decreased
-		quick_sort(finalSortedDistances, 0, num_record_to_sort - 1);
+		{
+			TraceSpan span("merge", "pthreads", trace_process_pthreads);
+			quick_sort(finalSortedDistances, 0, num_record_to_sort - 1);
+		}
 
 		//for (int i = 0; i < num_record_to_sort; i++) {
 		//	cout << finalSortedDistances[0][i] << "," << finalSortedDistances[1][i] << "," << finalSortedDistances[2][i] << endl;
@@ -116,13 +335,13 @@ public:
 		for (int i = 0; count < neighbours_number; i++) {
 			if (finalSortedDistances[1][i] == 0 && finalSortedDistances[0][i] > 0) {
 				zeros_count += 1;
-				cout << "0: " << finalSortedDistances[0][i] << endl;
+				cout << "0: " << sqrt(finalSortedDistances[0][i]) << endl;
 				//cout << "0: " << distances[0][i] << "," << distances[2][i] << endl;
 				count++;
 			}
 			else if (finalSortedDistances[1][i] == 1 && finalSortedDistances[0][i] > 0) {
 				ones_count += 1;
-				cout << "1: " << finalSortedDistances[0][i] << endl;
+				cout << "1: " << sqrt(finalSortedDistances[0][i]) << endl;
 				//cout << "1: " << distances[0][i] << "," << distances[2][i] << endl;
 				count++;
 			}
@@ -130,14 +349,6 @@ public:
 
 		//return prediction
 		int prediction = (zeros_count > ones_count) ? 0 : 1;
-
-		// Clean up memory
-		delete[] distances[0];
-		delete[] distances[1];
-		delete[] distances[2];
-		delete[] finalSortedDistances[0];
-		delete[] finalSortedDistances[1];
-		delete[] finalSortedDistances[2];
 		return prediction;
 	}
 
@@ -148,6 +359,7 @@ private:
 		quickSortParams* params = static_cast<quickSortParams*>(arg);
 
 		//call sort
+		TraceSpan span("selection", "pthreads", trace_process_pthreads);
 		quick_sort(params->distances, params->low, params->high - 1);
 
 		return nullptr;
@@ -187,26 +399,29 @@ private:
 		}
 	}
 
-	//to calculate euclidean distance
-	static double euclidean_distance(const double* x, const double* y, int feature_size) {
+	//to calculate squared euclidean distance, sqrt is only taken when a neighbour is printed
+	//scaling and weights are already baked into the stored rows, so this stays a plain squared L2
+	static double squared_distance(const double* x, const double* y, int feature_size) {
 		double l2 = 0.0;
 		//loop through each label in a row to calculate distance
 		for (int i = 1; i < feature_size; i++) {
-			l2 += pow((x[i] - y[i]), 2);
+			double diff = x[i] - y[i];
+			l2 += diff * diff;
 		}
-		return sqrt(l2);
+		return l2;
 	}
 
 	//function to be parse to pthread for multi-threading
 	static void* compute_distances(void* arg) {
 		//recieve parameters
 		PthreadParams* params = static_cast<PthreadParams*>(arg);
+		TraceSpan span("distance", "pthreads", trace_process_pthreads);
 		int count = 0;
 
 		//different thread is accessing different index range, so no race condition
 		for (int i = params->start; i < params->end; i++) {
 			if (params->dataset[i] == params->target) continue; // do not use the same point
-			params->distances[0][i] = euclidean_distance(params->target, params->dataset[i], params->feature_size);
+			params->distances[0][i] = squared_distance(params->target, params->dataset[i], params->feature_size);
 			params->distances[1][i] = params->dataset[i][0]; // Store outcome label
 			params->distances[2][i] = i; // Store index
 			count++;
@@ -217,7 +432,7 @@ private:
 	}
 
 	//the function to be call to get KNN 
-	void get_knn(double* x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
+	void get_knn(const double* const x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
 		//create parameters to be parse to compute_distance function
 		PthreadParams knnParams[num_threads];
 		pthread_t knnThreads[num_threads];
@@ -243,192 +458,1471 @@ private:
 	}
 };
 
-class Knn {
+//exact integer KNN on the raw features: squared distances are counted into per-thread histograms
+//the K-th smallest distance is read off the merged histogram and only rows at or below it are collected,
+//so selecting the neighbours is O(n) with no comparison sort
+//works on one byte per feature (IntegerFeatureStore) or on bit-packed rows (PackedFeatureStore)
+class PthreadHistogramKnn {
 private:
 	int neighbours_number;
+	//a query whose distance range needs more bins than this is refused
+	static const uint32_t max_histogram_bins = 1 << 20;
 
 public:
-	Knn(int k) : neighbours_number(k) {}
+	PthreadHistogramKnn(int k) : neighbours_number(k) {}
+
+	template <typename Store>
+	int predict_class(const Store& store, const double* target) {
+		typename Store::Query query;
+		if (!store.encode_query(target, query)) {
+			cerr << "Histogram KNN needs a query of raw integer features" << endl;
+			return -1;
+		}
+		uint32_t bins = store.max_squared_distance(query) + 1;
+		if (bins > max_histogram_bins) {
+			cerr << "Distance range too large for histogram KNN: " << bins << endl;
+			return -1;
+		}
 
-	int predict_class(double* dataset[], const double* target, int dataset_size, int feature_size) {
-		double* distances[3];
-		int zeros_count = 0;
-		int ones_count = 0;
+		int dataset_size = store.size();
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		uint32_t* distances = scratch.allocate<uint32_t>(dataset_size);
+		uint32_t* histograms = scratch.allocate<uint32_t>((size_t)num_threads * bins);
 
-		// Allocate memory for distances and index order
-		distances[0] = new double[dataset_size];
-		distances[1] = new double[dataset_size];
-		distances[2] = new double[dataset_size];
+		HistogramParams<Store> params[num_threads];
+		pthread_t threads[num_threads];
 
-		get_knn(dataset, target, distances, dataset_size, feature_size);
+		//pass 1: distance of every row and one histogram per thread
+		int rows_per_thread = dataset_size / num_threads;
+		for (int i = 0; i < num_threads; i++) {
+			int start = i * rows_per_thread;
+			int end = (i == num_threads - 1) ? dataset_size : (i + 1) * rows_per_thread;
+			params[i] = { &store, &query, distances, histograms + (size_t)i * bins, bins, 0, nullptr, start, end };
+			pthread_create(&threads[i], nullptr, count_distances<Store>, &params[i]);
+		}
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], nullptr);
+		}
 
-		//for (int i = 0; i < 100; i++) {
-		//	cout << i + 1 << ") " << distances[0][i] << ", " << distances[1][i] << ", " << distances[2][i] << endl;
-		//}
+		//merge the histograms bin by bin until K rows are covered
+		//bin 0 holds exact duplicates of the query, which are not used as neighbours
+		uint32_t threshold = 0;
+		long long below = 0; //rows strictly closer than the threshold
+		long long covered = 0;
+		for (uint32_t d = 1; d < bins && covered < neighbours_number; d++) {
+			below = covered;
+			for (int t = 0; t < num_threads; t++) {
+				covered += params[t].histogram[d];
+			}
+			threshold = d;
+		}
+		if (covered == 0) {
+			return -1;
+		}
 
-		quick_sort(distances, 0, dataset_size - 1);
+		//each thread knows from its own histogram how many of its rows qualify, so it can write
+		//them at a fixed offset and the candidates stay in row index order
+		Neighbour* candidates = scratch.allocate<Neighbour>((size_t)covered);
+		long long offset = 0;
+		for (int t = 0; t < num_threads; t++) {
+			params[t].threshold = threshold;
+			params[t].output = candidates + offset;
+			for (uint32_t d = 1; d <= threshold; d++) {
+				offset += params[t].histogram[d];
+			}
+		}
 
-		/*for (int i = 0; i < num_record_to_sort; i++) {
-			cout << distances[0][i] << "," << distances[1][i] << "," << distances[2][i] << endl;
-		}*/
+		//pass 2: collect the rows at or below the threshold
+		for (int i = 0; i < num_threads; i++) {
+			pthread_create(&threads[i], nullptr, collect_candidates<Store>, &params[i]);
+		}
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], nullptr);
+		}
 
-		cout << "First K(" << k_value << ") value: " << endl;
-		//Count label occurrences in the K nearest neighbors
+		//every row below the threshold is in, ties at the threshold are taken in row order
+		int k = (covered < neighbours_number) ? (int)covered : neighbours_number;
+		Neighbour* nearest = scratch.allocate<Neighbour>(k);
 		int count = 0;
-		for (int i = 0; count < neighbours_number; i++) {
-			if (distances[1][i] == 0 && distances[0][i] > 0) {
-				zeros_count += 1;
-				cout << "0: " << distances[0][i] << endl;
-				//cout << "0: " << distances[0][i] << "," << distances[2][i] << endl;
-				count++;
+		int ties_needed = k - (int)below;
+		for (long long i = 0; i < covered && count < k; i++) {
+			if (candidates[i].distance < threshold) {
+				nearest[count++] = candidates[i];
 			}
-			else if (distances[1][i] == 1 && distances[0][i] > 0) {
-				ones_count += 1;
-				cout << "1: " << distances[0][i] << endl;
-				//cout << "1: " << distances[0][i] << "," << distances[2][i] << endl;
-				count++;
+			else if (ties_needed > 0) {
+				nearest[count++] = candidates[i];
+				ties_needed--;
 			}
 		}
+		//only k rows are left, ordering them is just for the printout
+		sort(nearest, nearest + k, closer);
 
-		int prediction = (zeros_count > ones_count) ? 0 : 1;
-
-		// Clean up memory
-		delete[] distances[0];
-		delete[] distances[1];
-		delete[] distances[2];
+		cout << "First K(" << k_value << ") value: " << endl;
+		for (int i = 0; i < k; i++) {
+			cout << nearest[i].label << ": " << sqrt(nearest[i].distance) << endl;
+		}
 
+		int prediction = vote(nearest, k);
 		return prediction;
 	}
 
 private:
-	// Function to partition the array into two sub-arrays and return the index of the pivot element
-	static int partition(double** distances, int low, int high) {
-		// Choose the last element as the pivot
-		double pivot = distances[0][high];
-		// Index of the smaller element
-		int i = low - 1;
-		//check if value of distance[0] is lesser than pivot value, if yes swap
-		//to move shorter distance to left
-		for (int j = low; j < high; j++) {
-			if (distances[0][j] <= pivot) {
-				i++;
-				swap(distances, i, j);
-			}
-		}
-		//placing the pivot in the correct position
-		swap(distances, i + 1, high);
-		return i + 1;
-	}
-
-	static void swap(double** distances, int i, int j) {
-		std::swap(distances[0][i], distances[0][j]);
-		std::swap(distances[1][i], distances[1][j]);
-		std::swap(distances[2][i], distances[2][j]);
-	}
-
-	static void quick_sort(double** distances, int low, int high) {
-		if (low < high) {
-			int pivotIndex = partition(distances, low, high);
-			// Recursively sort the sub-arrays
-			quick_sort(distances, low, pivotIndex - 1);
-			quick_sort(distances, pivotIndex + 1, high);
-		}
-	}
+	template <typename Store>
+	static void* count_distances(void* arg) {
+		HistogramParams<Store>* params = static_cast<HistogramParams<Store>*>(arg);
+		const Store& store = *params->store;
+		TraceSpan span("histogram count", "pthreads", trace_process_pthreads);
 
-	double euclidean_distance(const double* x, const double* y, int feature_size) {
-		double l2 = 0.0;
-		for (int i = 1; i < feature_size; i++) {
-			l2 += pow((x[i] - y[i]), 2);
+		fill(params->histogram, params->histogram + params->bins, 0u);
+		for (int i = params->start; i < params->end; i++) {
+			uint32_t distance = store.distance(*params->query, i);
+			params->distances[i] = distance;
+			params->histogram[distance]++;
 		}
-		return sqrt(l2);
+		return nullptr;
 	}
 
-	void get_knn(double* x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
+	template <typename Store>
+	static void* collect_candidates(void* arg) {
+		HistogramParams<Store>* params = static_cast<HistogramParams<Store>*>(arg);
+		TraceSpan span("histogram collect", "pthreads", trace_process_pthreads);
 		int count = 0;
-		for (int i = 0; i < dataset_size; i++) {
-			if (x[i] == y) continue; // do not use the same point
-			distances[0][count] = this->euclidean_distance(y, x[i], feature_size);
-			distances[1][count] = x[i][0]; // Store outcome label
-			distances[2][count] = i; // Store index
-			count++;
+		for (int i = params->start; i < params->end; i++) {
+			uint32_t distance = params->distances[i];
+			if (distance > 0 && distance <= params->threshold) {
+				params->output[count++] = { (double)distance, i, params->store->label(i) };
+			}
 		}
-		//cout << "Number of euclidean run:" << count << endl;
+		return nullptr;
 	}
 };
 
-vector<double> parseLine(const string& line) {
-	vector<double> row;
-	istringstream iss(line);
-	string value;
+//out-of-core KNN over a binary dataset file that does not have to fit in memory
+//the file is read in large blocks into two aligned buffers: while the worker threads score one block,
+//a prefetch thread reads the next one, and a running top-K is kept across blocks
+//memory stays at two blocks however large the file is
+class OutOfCoreKnn {
+private:
+	int neighbours_number;
 
-	while (getline(iss, value, ',')) {
-		try {
-			double num = stod(value);
-			row.push_back(num);
+public:
+	OutOfCoreKnn(int k) : neighbours_number(k) {}
+
+	//target is a raw row of feature_size values, scaler is optional and is applied to every block as it arrives
+	int predict_class(const string& filename, const double* target, int feature_size, const FeatureScaler* scaler) {
+		BinaryDatasetReader reader;
+		if (!reader.open(filename)) {
+			cerr << "Error opening binary dataset: " << filename << endl;
+			return -1;
 		}
-		catch (const invalid_argument&) {
-			cerr << "Invalid data in CSV: " << value << endl;
+		if (reader.feature_size() != feature_size || feature_size > max_feature_size) {
+			cerr << "Binary dataset has " << reader.feature_size() << " columns, expected " << feature_size << endl;
+			return -1;
 		}
-	}
+		const int k = neighbours_number;
 
-	return row;
-}
+		double query[max_feature_size];
+		if (scaler != nullptr) {
+			scaler->transform_query(target, query);
+		}
+		else {
+			copy(target, target + feature_size, query);
+		}
 
-int main() {
-	string filename = "diabetes_binary.csv";
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		size_t block_doubles = (size_t)out_of_core_block_rows * feature_size;
+		double* buffers[2] = { scratch.allocate<double>(block_doubles), scratch.allocate<double>(block_doubles) };
+		Neighbour* thread_storage = scratch.allocate<Neighbour>((size_t)num_threads * k);
+		Neighbour* block_storage = scratch.allocate<Neighbour>(k);
+		FileNeighbour* running = scratch.allocate<FileNeighbour>(k);
+		int running_count = 0;
+
+		BlockReadParams readParams = { &reader, nullptr, out_of_core_block_rows, 0 };
+		BlockScanParams scanParams[num_threads];
+		pthread_t scanThreads[num_threads];
+		pthread_t readThread;
+
+		chrono::steady_clock::time_point scanBegin = chrono::steady_clock::now();
+
+		//first block is read up front, every later one is prefetched during the scan of the previous
+		int current = 0;
+		int rows = reader.read_block(buffers[current], out_of_core_block_rows);
+		long long first_row = 0;
+		while (rows > 0) {
+			readParams.buffer = buffers[1 - current];
+			pthread_create(&readThread, nullptr, read_block, &readParams);
+
+			int rows_per_thread = rows / num_threads;
+			for (int i = 0; i < num_threads; i++) {
+				int start = i * rows_per_thread;
+				int end = (i == num_threads - 1) ? rows : (i + 1) * rows_per_thread;
+				scanParams[i] = { buffers[current], query, scaler, first_row, start, end, feature_size, TopK(thread_storage + (size_t)i * k, k) };
+				pthread_create(&scanThreads[i], nullptr, scan_block, &scanParams[i]);
+			}
+			TopK blockBest(block_storage, k);
+			for (int i = 0; i < num_threads; i++) {
+				pthread_join(scanThreads[i], nullptr);
+				blockBest.merge(scanParams[i].best);
+			}
+			blockBest.sort();
+			running_count = fold_block(running, running_count, blockBest, first_row);
 
-	//const int dataset_size = 30000;
-	//const int dataset_size = 100000;
-	const int dataset_size = 250000;
-	const int feature_size = 22;
+			pthread_join(readThread, nullptr);
+			first_row += rows;
+			rows = readParams.rows_read;
+			current = 1 - current;
+		}
 
-	double** dataset = new double* [dataset_size];
-	double target[feature_size] = { 0.0, 0.0, 0.0, 1.0, 24.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 3.0, 0.0, 0.0, 0.0, 2.0, 5.0, 3.0 };
-	//double target[feature_size] = { 1.0, 1.0, 1.0, 1.0, 30.0, 1.0, 0.0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 5.0, 30.0, 30.0, 1.0, 0.0, 9.0, 5.0, 1.0 };
-	//double target[feature_size] = { 1.0, 0.0, 0.0, 1.0, 25.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 3.0, 0.0, 0.0, 0.0, 1.0, 13.0, 6.0, 8.0 };
-	//double target[feature_size] = { 0.0, 1.0, 1.0, 1.0, 28.0, 0.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 4.0, 0.0, 10.0, 1.0, 0.0, 12.0, 6.0, 2.0 };
+		chrono::steady_clock::time_point scanEnd = chrono::steady_clock::now();
+		double seconds = chrono::duration_cast<chrono::microseconds>(scanEnd - scanBegin).count() / 1e6;
+		double megabytes = first_row * feature_size * sizeof(double) / (1024.0 * 1024.0);
+		cout << "Rows scanned: " << first_row << " (" << megabytes << " MB, " << (seconds > 0 ? megabytes / seconds : 0) << " MB/s)" << endl;
 
-	// Allocate memory for dataset and target
-	for (int i = 0; i < dataset_size; i++) {
-		dataset[i] = new double[feature_size];
+		cout << "First K(" << k_value << ") value: " << endl;
+		Neighbour* nearest = block_storage;
+		for (int i = 0; i < running_count; i++) {
+			cout << running[i].label << ": " << sqrt(running[i].distance) << " (row " << running[i].row << ")" << endl;
+			nearest[i] = Neighbour{ running[i].distance, 0, running[i].label };
+		}
+		int prediction = (running_count > 0) ? vote(nearest, running_count) : -1;
+		return prediction;
 	}
 
-	// Read data from CSV and populate dataset and target
-	ifstream file(filename);
-	if (!file.is_open()) {
-		cerr << "Error opening file: " << filename << endl;
-		return 1;
+private:
+	//merge the ascending top-K of a block into the ascending running list, ties go to the earlier file row
+	//like closer() does; returns the new length of the list
+	int fold_block(FileNeighbour* running, int count, const TopK& block, long long first_row) const {
+		for (int b = 0; b < block.size(); b++) {
+			FileNeighbour candidate = { block[b].distance, first_row + block[b].index, block[b].label };
+			int position = count;
+			while (position > 0 && (candidate.distance < running[position - 1].distance
+				|| (candidate.distance == running[position - 1].distance && candidate.row < running[position - 1].row))) {
+				position--;
+			}
+			if (position >= neighbours_number) break; //the rest of the block is even farther
+			if (count < neighbours_number) count++;
+			for (int i = count - 1; i > position; i--) {
+				running[i] = running[i - 1];
+			}
+			running[position] = candidate;
+		}
+		return count;
 	}
 
-	string header;
-	//to eliminate first line which is the header
-	getline(file, header);
+	static void* read_block(void* arg) {
+		BlockReadParams* params = static_cast<BlockReadParams*>(arg);
+		TraceSpan span("block read", "pthreads", trace_process_pthreads);
+		params->rows_read = params->reader->read_block(params->buffer, params->max_rows);
+		return nullptr;
+	}
 
-	string line;
-	int index = 0;
-	while (getline(file, line) && index < dataset_size) {
-		vector<double> row = parseLine(line);
-		for (int j = 0; j < feature_size; j++) {
-			dataset[index][j] = row[j];
+	static void* scan_block(void* arg) {
+		BlockScanParams* params = static_cast<BlockScanParams*>(arg);
+		TraceSpan span("block scan", "pthreads", trace_process_pthreads);
+		for (int r = params->start; r < params->end; r++) {
+			double* row = params->block + (size_t)r * params->feature_size;
+			if (params->scaler != nullptr) {
+				params->scaler->apply_row(row);
+			}
+			double distance = bounded_squared_distance(params->target, row, params->feature_size, params->best.bound());
+			if (distance > 0) {
+				params->best.offer(distance, r, (int)row[0]);
+			}
 		}
-		index++;
+		return nullptr;
 	}
+};
 
-	cout << "Number of records: " << index << endl;
-
-	//Pthread Knn
-#pragma region PthreadKnn
-	cout << "\nPthread KNN  + Quick Sort: " << endl;
-	chrono::steady_clock::time_point pthreadBegin = chrono::steady_clock::now();
+//the engines below share one shape: predict_class() prints the K nearest and votes, nearest() writes the
+//K nearest rows in ascending order to output (room for K) and returns how many were found; nearest() takes
+//its buffers from this thread's scratch arena and the caller's ScratchScope gives them back
 
-	PthreadKnn pthreadknn(k_value); // Use K=3
-	int pthreadPrediction = pthreadknn.predict_class(dataset, target, dataset_size, feature_size);
-	cout << "Pthread Prediction: " << pthreadPrediction << endl;
+//print the K nearest like the other Pthread engines and vote on them, -1 when no neighbour was found
+int print_and_vote(const Neighbour* nearest, int count) {
+	cout << "First K(" << k_value << ") value: " << endl;
+	for (int i = 0; i < count; i++) {
+		cout << nearest[i].label << ": " << sqrt(nearest[i].distance) << endl;
+	}
+	return (count > 0) ? vote(nearest, count) : -1;
+}
 
-	if (pthreadPrediction == 0) {
-		cout << "Predicted class: Negative" << endl;
+//split [0, total) into one range per thread, run routine on every params[i] with its range in start/end and
+//wait for all of them; the rest of params[i] is filled by the caller
+template <typename Params>
+void scan_ranges(Params params[num_threads], int total, void* (*routine)(void*)) {
+	pthread_t threads[num_threads];
+	int per_thread = total / num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		params[i].start = i * per_thread;
+		params[i].end = (i == num_threads - 1) ? total : (i + 1) * per_thread;
+		pthread_create(&threads[i], nullptr, routine, &params[i]);
 	}
-	else if (pthreadPrediction == 1) {
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], nullptr);
+	}
+}
+
+//exact KNN that screens every row with the pivot side table before reading its features
+//each thread keeps its own top-K, so its K-th best tightens the bound for the rest of its range
+class PthreadPivotKnn {
+private:
+	int neighbours_number;
+	int rows_touched = 0;
+
+public:
+	PthreadPivotKnn(int k) : neighbours_number(k) {}
+
+	int predict_class(const double* const dataset[], const PivotTable& table, const double* target, int dataset_size, int feature_size) {
+		ScratchScope scope(thread_scratch());
+		Neighbour* merged = thread_scratch().allocate<Neighbour>(neighbours_number);
+		return print_and_vote(merged, nearest(dataset, table, target, dataset_size, feature_size, merged));
+	}
+
+	int nearest(const double* const dataset[], const PivotTable& table, const double* target, int dataset_size, int feature_size, Neighbour* output) {
+		ScratchArena& scratch = thread_scratch();
+		double* query_distances = scratch.allocate<double>(table.pivot_count());
+		Neighbour* thread_storage = scratch.allocate<Neighbour>(num_threads * neighbours_number);
+		table.query_distances(target, query_distances);
+
+		PivotScanParams scanParams[num_threads];
+		for (int i = 0; i < num_threads; i++) {
+			scanParams[i] = { dataset, &table, target, query_distances, feature_size, 0, 0, 0, TopK(&thread_storage[i * neighbours_number], neighbours_number) };
+		}
+		scan_ranges(scanParams, dataset_size, scan_rows);
+
+		TopK merged(output, neighbours_number);
+		rows_touched = 0;
+		for (int i = 0; i < num_threads; i++) {
+			merged.merge(scanParams[i].best);
+			rows_touched += scanParams[i].rows_touched;
+		}
+		merged.sort();
+		return merged.size();
+	}
+
+	int last_rows_touched() const { return rows_touched; }
+
+private:
+	static void* scan_rows(void* arg) {
+		PivotScanParams* params = static_cast<PivotScanParams*>(arg);
+		TraceSpan span("pivot scan", "pthreads", trace_process_pthreads);
+		TopK& best = params->best;
+		for (int i = params->start; i < params->end; i++) {
+			if (params->dataset[i] == params->target) continue; // do not use the same point
+			//rejected on 4 bytes per pivot, the row itself is never loaded
+			if (params->table->lower_bound(params->query_distances, i) > best.bound()) continue;
+			params->rows_touched++;
+			double distance = bounded_squared_distance(params->target, params->dataset[i], params->feature_size, best.bound());
+			if (distance > 0) {
+				best.offer(distance, i, (int)params->dataset[i][0]);
+			}
+		}
+		return nullptr;
+	}
+};
+
+//deadline-bounded KNN: the rows are visited in a fixed random order, threads take the next block of it
+//from a shared counter and look at the clock every anytime_clock_rows rows, so a query overruns its budget
+//by at most that many rows per thread; what was scanned is a random sample of the dataset, so the partial
+//top-K and vote are representative; with enough budget the whole dataset is scanned and the result is exact
+//the scan threads are started with the object and wait between queries, so a query pays a wake-up
+//instead of num_threads thread creations inside its budget; one query at a time per object
+class PthreadAnytimeKnn {
+private:
+	struct Worker {
+		PthreadAnytimeKnn* owner;
+		int id;
+	};
+
+	int neighbours_number;
+	vector<int> order;
+	int rows_scanned = 0;
+
+	pthread_t workers[num_threads];
+	Worker worker_args[num_threads];
+	AnytimeScanParams scanParams[num_threads];
+	atomic<int> next_block{ 0 };
+	pthread_mutex_t lock;
+	pthread_cond_t query_ready;
+	pthread_cond_t query_done;
+	long long query_generation = 0;
+	int workers_done = 0;
+	bool stopping = false;
+
+public:
+	PthreadAnytimeKnn(int k, int dataset_size) : neighbours_number(k), order(dataset_size) {
+		for (int i = 0; i < dataset_size; i++) order[i] = i;
+		mt19937 generator(anytime_seed);
+		shuffle(order.begin(), order.end(), generator);
+
+		pthread_mutex_init(&lock, nullptr);
+		pthread_cond_init(&query_ready, nullptr);
+		pthread_cond_init(&query_done, nullptr);
+		for (int i = 0; i < num_threads; i++) {
+			worker_args[i] = { this, i };
+			pthread_create(&workers[i], nullptr, run_worker, &worker_args[i]);
+		}
+	}
+
+	~PthreadAnytimeKnn() {
+		pthread_mutex_lock(&lock);
+		stopping = true;
+		pthread_cond_broadcast(&query_ready);
+		pthread_mutex_unlock(&lock);
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(workers[i], nullptr);
+		}
+		pthread_cond_destroy(&query_done);
+		pthread_cond_destroy(&query_ready);
+		pthread_mutex_destroy(&lock);
+	}
+
+	PthreadAnytimeKnn(const PthreadAnytimeKnn&) = delete;
+	PthreadAnytimeKnn& operator=(const PthreadAnytimeKnn&) = delete;
+
+	//the rows scanned are the dataset_size rows the visiting order was drawn for in the constructor
+	int predict_class(const double* const dataset[], const double* target, int feature_size, long long budget_us) {
+		ScratchScope scope(thread_scratch());
+		Neighbour* merged = thread_scratch().allocate<Neighbour>(neighbours_number);
+		return print_and_vote(merged, nearest(dataset, target, feature_size, budget_us, merged));
+	}
+
+	//best-so-far K nearest rows when the deadline passes
+	int nearest(const double* const dataset[], const double* target, int feature_size, long long budget_us, Neighbour* output) {
+		Neighbour* thread_storage = thread_scratch().allocate<Neighbour>(num_threads * neighbours_number);
+		chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::microseconds(budget_us);
+		next_block = 0;
+		for (int i = 0; i < num_threads; i++) {
+			scanParams[i] = { dataset, order.data(), target, feature_size, (int)order.size(), &next_block, deadline, 0, TopK(&thread_storage[i * neighbours_number], neighbours_number) };
+		}
+
+		//wake the workers and wait until every one of them has stopped
+		pthread_mutex_lock(&lock);
+		workers_done = 0;
+		query_generation++;
+		pthread_cond_broadcast(&query_ready);
+		while (workers_done < num_threads) {
+			pthread_cond_wait(&query_done, &lock);
+		}
+		pthread_mutex_unlock(&lock);
+
+		TopK merged(output, neighbours_number);
+		rows_scanned = 0;
+		for (int i = 0; i < num_threads; i++) {
+			merged.merge(scanParams[i].best);
+			rows_scanned += scanParams[i].rows_scanned;
+		}
+		merged.sort();
+		return merged.size();
+	}
+
+	//share of the dataset the last query examined, 1 when it finished before the deadline
+	double last_fraction_examined() const { return order.empty() ? 1.0 : (double)rows_scanned / order.size(); }
+	bool last_complete() const { return rows_scanned == (int)order.size(); }
+
+private:
+	//scan once per query generation until the object is destroyed
+	static void* run_worker(void* arg) {
+		Worker* worker = static_cast<Worker*>(arg);
+		PthreadAnytimeKnn* owner = worker->owner;
+		long long seen = 0;
+		pthread_mutex_lock(&owner->lock);
+		while (true) {
+			while (owner->query_generation == seen && !owner->stopping) {
+				pthread_cond_wait(&owner->query_ready, &owner->lock);
+			}
+			if (owner->stopping) break;
+			seen = owner->query_generation;
+			pthread_mutex_unlock(&owner->lock);
+
+			scan_blocks(&owner->scanParams[worker->id]);
+
+			pthread_mutex_lock(&owner->lock);
+			if (++owner->workers_done == num_threads) {
+				pthread_cond_signal(&owner->query_done);
+			}
+		}
+		pthread_mutex_unlock(&owner->lock);
+		return nullptr;
+	}
+
+	static void scan_blocks(AnytimeScanParams* params) {
+		TraceSpan span("anytime scan", "pthreads", trace_process_pthreads);
+		TopK& best = params->best;
+		while (true) {
+			int start = params->next_block->fetch_add(1, memory_order_relaxed) * anytime_block_rows;
+			if (start >= params->dataset_size) return;
+			int end = min(params->dataset_size, start + anytime_block_rows);
+			for (int first = start; first < end; first += anytime_clock_rows) {
+				if (chrono::steady_clock::now() >= params->deadline) return;
+				int last = min(end, first + anytime_clock_rows);
+				for (int p = first; p < last; p++) {
+					int i = params->order[p];
+					if (params->dataset[i] == params->target) continue; // do not use the same point
+					double distance = bounded_squared_distance(params->target, params->dataset[i], params->feature_size, best.bound());
+					if (distance > 0) {
+						best.offer(distance, i, (int)params->dataset[i][0]);
+					}
+				}
+				params->rows_scanned += last - first;
+			}
+		}
+	}
+};
+
+//mixed precision KNN: the threads scan the float32 copy of the rows and keep every row that could still be
+//among the K nearest given the float error bound, then the candidates are re-ranked with the exact double
+//distance, so the result is the same top-K (same distances, same ties) as the double scans
+class PthreadMixedPrecisionKnn {
+private:
+	int neighbours_number;
+	vector<vector<int>> thread_candidates; //kept between queries, a query does not allocate once they have grown
+	int candidate_count = 0;
+
+public:
+	PthreadMixedPrecisionKnn(int k) : neighbours_number(k), thread_candidates(num_threads) {}
+
+	int predict_class(const double* const dataset[], const FloatFeatureStore& store, const double* target, int dataset_size, int feature_size) {
+		ScratchScope scope(thread_scratch());
+		Neighbour* merged = thread_scratch().allocate<Neighbour>(neighbours_number);
+		return print_and_vote(merged, nearest(dataset, store, target, dataset_size, feature_size, merged));
+	}
+
+	int nearest(const double* const dataset[], const FloatFeatureStore& store, const double* target, int dataset_size, int feature_size, Neighbour* output) {
+		Neighbour* thread_storage = thread_scratch().allocate<Neighbour>(num_threads * neighbours_number);
+		FloatFeatureStore::Query query;
+		store.encode_query(target, feature_size, query);
+
+		FloatScanParams scanParams[num_threads];
+		for (int i = 0; i < num_threads; i++) {
+			thread_candidates[i].clear();
+			scanParams[i] = { dataset, &store, &query, target, 0, 0, TopK(&thread_storage[i * neighbours_number], neighbours_number), &thread_candidates[i] };
+		}
+		scan_ranges(scanParams, dataset_size, scan_rows);
+
+		//exact re-rank, squared_distance sums in the same order as the double scans
+		TopK merged(output, neighbours_number);
+		candidate_count = 0;
+		for (int i = 0; i < num_threads; i++) {
+			candidate_count += (int)thread_candidates[i].size();
+			for (int row : thread_candidates[i]) {
+				double distance = squared_distance(target, dataset[row], feature_size);
+				if (distance > 0) {
+					merged.offer(distance, row, (int)dataset[row][0]);
+				}
+			}
+		}
+		merged.sort();
+		return merged.size();
+	}
+
+	int last_candidates() const { return candidate_count; }
+
+private:
+	static void* scan_rows(void* arg) {
+		FloatScanParams* params = static_cast<FloatScanParams*>(arg);
+		TraceSpan span("float scan", "pthreads", trace_process_pthreads);
+		TopK& approx_best = params->approx_best;
+		double threshold = numeric_limits<double>::infinity();
+		for (int i = params->start; i < params->end; i++) {
+			if (params->dataset[i] == params->target) continue; // do not use the same point
+			double approx = params->store->approx_distance(*params->query, i);
+			if (approx > threshold) continue;
+			params->candidates->push_back(i);
+			//a float distance of 0 may still be an exact 0 (a duplicate of the query), which is never a neighbour,
+			//so only rows that surely differ tighten the threshold
+			if (approx > 0) {
+				approx_best.offer(approx, i, 0);
+				if (approx_best.full()) {
+					threshold = params->store->candidate_threshold(approx_best.bound(), *params->query);
+				}
+			}
+		}
+		return nullptr;
+	}
+};
+
+//KNN on the product quantised codes: the threads score 16 rows at a time with the per-query tables and keep
+//the pq_rerank best approximate rows, these are re-ranked with the exact double distance on the stored rows
+//approximate: a true neighbour whose code distance is not among the best candidates is missed
+class PthreadPqKnn {
+private:
+	int neighbours_number;
+
+public:
+	PthreadPqKnn(int k) : neighbours_number(k) {}
+
+	//the rows scanned are the pq.size() rows the index was built on
+	int predict_class(const double* const dataset[], const ProductQuantizer& pq, const double* target, int feature_size) {
+		ScratchScope scope(thread_scratch());
+		Neighbour* merged = thread_scratch().allocate<Neighbour>(neighbours_number);
+		return print_and_vote(merged, nearest(dataset, pq, target, feature_size, merged));
+	}
+
+	int nearest(const double* const dataset[], const ProductQuantizer& pq, const double* target, int feature_size, Neighbour* output) {
+		ScratchArena& scratch = thread_scratch();
+		Neighbour* thread_storage = scratch.allocate<Neighbour>(num_threads * pq_rerank);
+		Neighbour* candidate_storage = scratch.allocate<Neighbour>(pq_rerank);
+		ProductQuantizer::Query query;
+		pq.prepare_query(target, query);
+
+		//the threads split the code blocks, not the rows
+		PqScanParams scanParams[num_threads];
+		for (int i = 0; i < num_threads; i++) {
+			scanParams[i] = { &pq, &query, dataset, target, feature_size, 0, 0, TopK(&thread_storage[i * pq_rerank], pq_rerank) };
+		}
+		scan_ranges(scanParams, pq.blocks(), scan_blocks);
+
+		TopK candidates(candidate_storage, pq_rerank);
+		for (int i = 0; i < num_threads; i++) {
+			candidates.merge(scanParams[i].best);
+		}
+
+		//exact re-rank against the stored rows
+		TopK merged(output, neighbours_number);
+		for (int c = 0; c < candidates.size(); c++) {
+			int row = candidates[c].index;
+			double distance = squared_distance(target, dataset[row], feature_size);
+			if (distance > 0) {
+				merged.offer(distance, row, (int)dataset[row][0]);
+			}
+		}
+		merged.sort();
+		return merged.size();
+	}
+
+private:
+	static void* scan_blocks(void* arg) {
+		PqScanParams* params = static_cast<PqScanParams*>(arg);
+		TraceSpan span("pq scan", "pthreads", trace_process_pthreads);
+		TopK& best = params->best;
+		uint16_t sums[pq_block_rows];
+		for (int b = params->start; b < params->end; b++) {
+			params->pq->scan_block(*params->query, b, sums);
+			int first_row = b * pq_block_rows;
+			int rows = min(pq_block_rows, params->pq->size() - first_row);
+			for (int r = 0; r < rows; r++) {
+				//the integer sum ranks like the approximate distance, it is only turned back for the re-rank order
+				if (sums[r] < best.bound()) {
+					int i = first_row + r;
+					if (params->dataset[i] == params->target) continue; // do not use the same point
+					//exact duplicates of the query share its codes and would fill the pool with rows the
+					//re-rank drops, only the few rows that enter the pool pay for this exact check
+					if (squared_distance(params->target, params->dataset[i], params->feature_size) == 0) continue;
+					best.offer((double)sums[r], i, 0);
+				}
+			}
+		}
+		return nullptr;
+	}
+};
+
+//exact KNN that screens every row in the PCA space before reading its features
+//the projected distance is a lower bound of the real one, so only rows that pass it are refined exactly
+class PthreadPcaKnn {
+private:
+	int neighbours_number;
+	int rows_touched = 0;
+
+public:
+	PthreadPcaKnn(int k) : neighbours_number(k) {}
+
+	int predict_class(const double* const dataset[], const PcaTable& table, const double* target, int dataset_size, int feature_size) {
+		ScratchScope scope(thread_scratch());
+		Neighbour* merged = thread_scratch().allocate<Neighbour>(neighbours_number);
+		return print_and_vote(merged, nearest(dataset, table, target, dataset_size, feature_size, merged));
+	}
+
+	int nearest(const double* const dataset[], const PcaTable& table, const double* target, int dataset_size, int feature_size, Neighbour* output) {
+		ScratchArena& scratch = thread_scratch();
+		double* projected_target = scratch.allocate<double>(table.dimensions());
+		Neighbour* thread_storage = scratch.allocate<Neighbour>(num_threads * neighbours_number);
+		table.project(target, projected_target);
+
+		PcaScanParams scanParams[num_threads];
+		for (int i = 0; i < num_threads; i++) {
+			scanParams[i] = { dataset, &table, target, projected_target, feature_size, 0, 0, 0, TopK(&thread_storage[i * neighbours_number], neighbours_number) };
+		}
+		scan_ranges(scanParams, dataset_size, scan_rows);
+
+		TopK merged(output, neighbours_number);
+		rows_touched = 0;
+		for (int i = 0; i < num_threads; i++) {
+			merged.merge(scanParams[i].best);
+			rows_touched += scanParams[i].rows_touched;
+		}
+		merged.sort();
+		return merged.size();
+	}
+
+	int last_rows_touched() const { return rows_touched; }
+
+private:
+	static void* scan_rows(void* arg) {
+		PcaScanParams* params = static_cast<PcaScanParams*>(arg);
+		TraceSpan span("pca scan", "pthreads", trace_process_pthreads);
+		TopK& best = params->best;
+		double bound = best.bound();
+		double threshold = params->table->reject_threshold(bound);
+		for (int i = params->start; i < params->end; i++) {
+			if (params->dataset[i] == params->target) continue; // do not use the same point
+			//rejected on a few floats, the row itself is never loaded
+			if (params->table->projected_distance(params->projected_target, i) > threshold) continue;
+			params->rows_touched++;
+			double distance = bounded_squared_distance(params->target, params->dataset[i], params->feature_size, bound);
+			if (distance > 0) {
+				best.offer(distance, i, (int)params->dataset[i][0]);
+				if (best.bound() != bound) {
+					bound = best.bound();
+					threshold = params->table->reject_threshold(bound);
+				}
+			}
+		}
+		return nullptr;
+	}
+};
+
+//pivot KNN behind a result cache keyed on the raw integer query, repeated patients skip the scan
+//the stored rows are scaled, the key is taken from the raw query so no floating point rounding is involved
+//an entry holds at most result_cache_max_k neighbours, a larger K bypasses the cache and always scans
+class CachedPivotKnn {
+private:
+	int neighbours_number;
+	const double* const* dataset;
+	int dataset_size;
+	int feature_size;
+	const PivotTable& table;
+	const FeatureScaler& scaler;
+	const IntegerFeatureStore& keys;
+	PthreadPivotKnn scanner;
+	ResultCache cache;
+
+public:
+	CachedPivotKnn(int k, const double* const dataset[], int dataset_size, int feature_size, const PivotTable& table,
+		const FeatureScaler& scaler, const IntegerFeatureStore& keys, size_t capacity) :
+		neighbours_number(k), dataset(dataset), dataset_size(dataset_size), feature_size(feature_size),
+		table(table), scaler(scaler), keys(keys), scanner(neighbours_number), cache(capacity) {}
+
+	//target is the raw query
+	int predict_class(const double* target) {
+		QueryKey key;
+		CachedResult result;
+		bool cacheable = neighbours_number <= result_cache_max_k && ResultCache::make_key(keys, target, key);
+		if (cacheable && cache.lookup(key, result)) {
+			return result.prediction;
+		}
+
+		uint64_t generation = cache.generation();
+		double scaled_target[max_feature_size];
+		scaler.transform_query(target, scaled_target);
+		ScratchScope scope(thread_scratch());
+		Neighbour* nearest = (neighbours_number <= result_cache_max_k) ? result.nearest
+			: thread_scratch().allocate<Neighbour>(neighbours_number);
+		result.count = scanner.nearest(dataset, table, scaled_target, dataset_size, feature_size, nearest);
+		result.prediction = (result.count > 0) ? vote(nearest, result.count) : -1;
+		if (cacheable) {
+			cache.insert(key, generation, result.nearest, result.count, result.prediction);
+		}
+		return result.prediction;
+	}
+
+	//the dataset changed, no cached result may be served any more
+	void invalidate() { cache.invalidate(); }
+	const ResultCache& stats() const { return cache; }
+};
+
+//ranked retrieval of the K nearest rows for large K (thousands), nothing is printed
+//a non-negative double orders the same as its bit pattern read as an unsigned integer, so the squared
+//distances are ranked by a parallel LSD radix sort on those 64-bit keys; a pass whose digit is the same
+//for every key (the exponent bytes of most distances) is skipped
+//the sort is stable over the rows in index order, so equal distances rank by row index like everywhere else
+class PthreadRankedRetrieval {
+public:
+	//ranked neighbours written to output (room for k), returns how many were written
+	int retrieve(const double* const dataset[], const double* target, int dataset_size, int feature_size, int k, Neighbour* output) {
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		uint64_t* keys = scratch.allocate<uint64_t>(dataset_size);
+		int* rows = scratch.allocate<int>(dataset_size);
+		uint64_t* keys_swap = scratch.allocate<uint64_t>(dataset_size);
+		int* rows_swap = scratch.allocate<int>(dataset_size);
+		size_t* offsets = scratch.allocate<size_t>(num_threads * radix_buckets);
+
+		pthread_t threads[num_threads];
+		RankKeyParams keyParams[num_threads];
+		int rows_per_thread = dataset_size / num_threads;
+		for (int i = 0; i < num_threads; i++) {
+			int start = i * rows_per_thread;
+			int end = (i == num_threads - 1) ? dataset_size : (i + 1) * rows_per_thread;
+			keyParams[i] = { dataset, target, keys, rows, feature_size, start, end };
+			pthread_create(&threads[i], nullptr, compute_keys, &keyParams[i]);
+		}
+		for (int i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], nullptr);
+		}
+
+		RadixParams radixParams[num_threads];
+		for (int shift = 0; shift < 64; shift += radix_bits) {
+			for (int i = 0; i < num_threads; i++) {
+				int start = i * rows_per_thread;
+				int end = (i == num_threads - 1) ? dataset_size : (i + 1) * rows_per_thread;
+				radixParams[i] = { keys, rows, keys_swap, rows_swap, &offsets[i * radix_buckets], shift, start, end };
+				pthread_create(&threads[i], nullptr, count_digits, &radixParams[i]);
+			}
+			for (int i = 0; i < num_threads; i++) {
+				pthread_join(threads[i], nullptr);
+			}
+
+			//bucket-major, thread-minor prefix sum keeps the sort stable across threads
+			size_t position = 0;
+			bool one_bucket = false;
+			for (int b = 0; b < radix_buckets; b++) {
+				size_t bucket_total = 0;
+				for (int i = 0; i < num_threads; i++) {
+					size_t count = offsets[i * radix_buckets + b];
+					offsets[i * radix_buckets + b] = position;
+					position += count;
+					bucket_total += count;
+				}
+				if (bucket_total == (size_t)dataset_size) one_bucket = true;
+			}
+			if (one_bucket) continue;
+
+			for (int i = 0; i < num_threads; i++) {
+				pthread_create(&threads[i], nullptr, scatter_digits, &radixParams[i]);
+			}
+			for (int i = 0; i < num_threads; i++) {
+				pthread_join(threads[i], nullptr);
+			}
+			std::swap(keys, keys_swap);
+			std::swap(rows, rows_swap);
+		}
+
+		//skipped rows (the query itself, exact duplicates) carry the largest key and sort last
+		int written = 0;
+		for (int i = 0; i < dataset_size && written < k; i++) {
+			if (keys[i] == excluded_key) break;
+			double distance;
+			memcpy(&distance, &keys[i], sizeof(distance));
+			output[written++] = { distance, rows[i], (int)dataset[rows[i]][0] };
+		}
+		return written;
+	}
+
+private:
+	static const uint64_t excluded_key = ~0ULL;
+
+	static void* compute_keys(void* arg) {
+		RankKeyParams* params = static_cast<RankKeyParams*>(arg);
+		for (int i = params->start; i < params->end; i++) {
+			double distance = (params->dataset[i] == params->target) ? 0.0 : squared_distance(params->target, params->dataset[i], params->feature_size);
+			uint64_t key = excluded_key;
+			if (distance > 0) {
+				memcpy(&key, &distance, sizeof(key));
+			}
+			params->keys[i] = key;
+			params->rows[i] = i;
+		}
+		return nullptr;
+	}
+
+	static void* count_digits(void* arg) {
+		RadixParams* params = static_cast<RadixParams*>(arg);
+		for (int b = 0; b < radix_buckets; b++) {
+			params->offsets[b] = 0;
+		}
+		for (int i = params->start; i < params->end; i++) {
+			params->offsets[(params->keys_in[i] >> params->shift) & (radix_buckets - 1)]++;
+		}
+		return nullptr;
+	}
+
+	static void* scatter_digits(void* arg) {
+		RadixParams* params = static_cast<RadixParams*>(arg);
+		for (int i = params->start; i < params->end; i++) {
+			size_t slot = params->offsets[(params->keys_in[i] >> params->shift) & (radix_buckets - 1)]++;
+			params->keys_out[slot] = params->keys_in[i];
+			params->rows_out[slot] = params->rows_in[i];
+		}
+		return nullptr;
+	}
+};
+
+class Knn {
+private:
+	int neighbours_number;
+
+public:
+	Knn(int k) : neighbours_number(k) {}
+
+	int predict_class(const double* const dataset[], const double* target, int dataset_size, int feature_size) {
+		double* distances[3];
+		int zeros_count = 0;
+		int ones_count = 0;
+
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		distances[0] = scratch.allocate<double>(dataset_size);
+		distances[1] = scratch.allocate<double>(dataset_size);
+		distances[2] = scratch.allocate<double>(dataset_size);
+
+		get_knn(dataset, target, distances, dataset_size, feature_size);
+
+		//for (int i = 0; i < 100; i++) {
+		//	cout << i + 1 << ") " << distances[0][i] << ", " << distances[1][i] << ", " << distances[2][i] << endl;
+		//}
+
+		quick_sort(distances, 0, dataset_size - 1);
+
+		/*for (int i = 0; i < num_record_to_sort; i++) {
+			cout << distances[0][i] << "," << distances[1][i] << "," << distances[2][i] << endl;
+		}*/
+
+		cout << "First K(" << k_value << ") value: " << endl;
+		//Count label occurrences in the K nearest neighbors
+		int count = 0;
+		for (int i = 0; count < neighbours_number; i++) {
+			if (distances[1][i] == 0 && distances[0][i] > 0) {
+				zeros_count += 1;
+				cout << "0: " << distances[0][i] << endl;
+				//cout << "0: " << distances[0][i] << "," << distances[2][i] << endl;
+				count++;
+			}
+			else if (distances[1][i] == 1 && distances[0][i] > 0) {
+				ones_count += 1;
+				cout << "1: " << distances[0][i] << endl;
+				//cout << "1: " << distances[0][i] << "," << distances[2][i] << endl;
+				count++;
+			}
+		}
+
+		int prediction = (zeros_count > ones_count) ? 0 : 1;
+		return prediction;
+	}
+
+private:
+	// Function to partition the array into two sub-arrays and return the index of the pivot element
+	static int partition(double** distances, int low, int high) {
+		// Choose the last element as the pivot
+		double pivot = distances[0][high];
+		// Index of the smaller element
+		int i = low - 1;
+		//check if value of distance[0] is lesser than pivot value, if yes swap
+		//to move shorter distance to left
+		for (int j = low; j < high; j++) {
+			if (distances[0][j] <= pivot) {
+				i++;
+				swap(distances, i, j);
+			}
+		}
+		//placing the pivot in the correct position
+		swap(distances, i + 1, high);
+		return i + 1;
+	}
+
+	static void swap(double** distances, int i, int j) {
+		std::swap(distances[0][i], distances[0][j]);
+		std::swap(distances[1][i], distances[1][j]);
+		std::swap(distances[2][i], distances[2][j]);
+	}
+
+	static void quick_sort(double** distances, int low, int high) {
+		if (low < high) {
+			int pivotIndex = partition(distances, low, high);
+			// Recursively sort the sub-arrays
+			quick_sort(distances, low, pivotIndex - 1);
+			quick_sort(distances, pivotIndex + 1, high);
+		}
+	}
+
+	double euclidean_distance(const double* x, const double* y, int feature_size) {
+		double l2 = 0.0;
+		for (int i = 1; i < feature_size; i++) {
+			l2 += pow((x[i] - y[i]), 2);
+		}
+		return sqrt(l2);
+	}
+
+	void get_knn(const double* const x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
+		int count = 0;
+		for (int i = 0; i < dataset_size; i++) {
+			if (x[i] == y) continue; // do not use the same point
+			distances[0][count] = this->euclidean_distance(y, x[i], feature_size);
+			distances[1][count] = x[i][0]; // Store outcome label
+			distances[2][count] = i; // Store index
+			count++;
+		}
+		//cout << "Number of euclidean run:" << count << endl;
+	}
+};
+
+//first pass of the scaling stage, statistics of the rows handled by this thread
+static void* compute_feature_stats(void* arg) {
+	ScalingParams* params = static_cast<ScalingParams*>(arg);
+	for (int i = params->start; i < params->end; i++) {
+		params->stats->accumulate(params->dataset[i]);
+	}
+	return nullptr;
+}
+
+//bake the fitted scaling into the rows handled by this thread
+static void* apply_feature_scaling(void* arg) {
+	ScalingParams* params = static_cast<ScalingParams*>(arg);
+	params->scaler->apply(params->dataset, params->start, params->end);
+	return nullptr;
+}
+
+//fit the scaler over the whole dataset in one parallel pass and rescale the stored rows in place
+void scale_dataset(double** dataset, int dataset_size, int feature_size, ScalingMode mode, FeatureScaler& scaler) {
+	FeatureStats stats[num_threads];
+	ScalingParams params[num_threads];
+	pthread_t threads[num_threads];
+
+	int rows_per_thread = dataset_size / num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		int start = i * rows_per_thread;
+		int end = (i == num_threads - 1) ? dataset_size : (i + 1) * rows_per_thread;
+		stats[i].reset(feature_size);
+		params[i] = { dataset, &stats[i], &scaler, start, end };
+		pthread_create(&threads[i], nullptr, compute_feature_stats, &params[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], nullptr);
+	}
+
+	//merge the partial statistics of every thread
+	for (int i = 1; i < num_threads; i++) {
+		stats[0].merge(stats[i]);
+	}
+	if (!scaler.fit(stats[0], mode)) {
+		cerr << "Cannot scale rows wider than " << max_feature_size << " columns" << endl;
+		return;
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], nullptr, apply_feature_scaling, &params[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], nullptr);
+	}
+}
+
+vector<double> parseLine(const string& line);
+
+static void* accumulate_pca_covariance(void* arg) {
+	PcaCovarianceParams* params = static_cast<PcaCovarianceParams*>(arg);
+	params->table->accumulate(params->dataset, params->start, params->end, params->sums, params->cross);
+	return nullptr;
+}
+
+static void* fill_pca_table(void* arg) {
+	PcaFillParams* params = static_cast<PcaFillParams*>(arg);
+	params->largest_norm = params->table->fill(params->dataset, params->start, params->end);
+	return nullptr;
+}
+
+//covariance summed by one pthread per range of rows, eigen-decomposition, then the projections filled in parallel
+void build_pca_table(const double* const dataset[], int dataset_size, int feature_size, PcaTable& table) {
+	table.setup(feature_size, pca_dimensions, dataset_size);
+	int width = feature_size - 1;
+	vector<double> sums((size_t)num_threads * width, 0.0);
+	vector<double> cross((size_t)num_threads * width * width, 0.0);
+
+	PcaCovarianceParams covarianceParams[num_threads];
+	pthread_t covarianceThreads[num_threads];
+	int rows_per_thread = dataset_size / num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		int start = i * rows_per_thread;
+		int end = (i == num_threads - 1) ? dataset_size : (i + 1) * rows_per_thread;
+		covarianceParams[i] = { dataset, &table, start, end, &sums[(size_t)i * width], &cross[(size_t)i * width * width] };
+		pthread_create(&covarianceThreads[i], nullptr, accumulate_pca_covariance, &covarianceParams[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(covarianceThreads[i], nullptr);
+	}
+	for (int i = 1; i < num_threads; i++) {
+		for (int a = 0; a < width; a++) sums[a] += sums[(size_t)i * width + a];
+		for (int a = 0; a < width * width; a++) cross[a] += cross[(size_t)i * width * width + a];
+	}
+	table.solve(sums.data(), cross.data());
+
+	PcaFillParams fillParams[num_threads];
+	pthread_t fillThreads[num_threads];
+	for (int i = 0; i < num_threads; i++) {
+		int start = i * rows_per_thread;
+		int end = (i == num_threads - 1) ? dataset_size : (i + 1) * rows_per_thread;
+		fillParams[i] = { dataset, &table, start, end, 0.0 };
+		pthread_create(&fillThreads[i], nullptr, fill_pca_table, &fillParams[i]);
+	}
+	double largest_norm = 0.0;
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(fillThreads[i], nullptr);
+		largest_norm = max(largest_norm, fillParams[i].largest_norm);
+	}
+	table.finish(largest_norm);
+}
+
+static void* train_pq_subspace(void* arg) {
+	PqTrainParams* params = static_cast<PqTrainParams*>(arg);
+	TraceSpan span("pq train", "pthreads", trace_process_pthreads);
+	params->pq->train_subspace(params->subspace, params->dataset, *params->sample, pq_seed);
+	return nullptr;
+}
+
+static void* encode_pq_blocks(void* arg) {
+	PqEncodeParams* params = static_cast<PqEncodeParams*>(arg);
+	TraceSpan span("pq encode", "pthreads", trace_process_pthreads);
+	params->pq->encode_blocks(params->dataset, params->first_block, params->end_block);
+	return nullptr;
+}
+
+//train the codebooks on a random sample with one pthread per sub-space, then encode every row
+void build_pq_index(const double* const dataset[], int dataset_size, int feature_size, ProductQuantizer& pq) {
+	pq.setup(feature_size, dataset_size);
+
+	vector<int> sample(dataset_size);
+	for (int i = 0; i < dataset_size; i++) sample[i] = i;
+	if (dataset_size > pq_train_rows) {
+		mt19937 generator(pq_seed);
+		shuffle(sample.begin(), sample.end(), generator);
+		sample.resize(pq_train_rows);
+	}
+
+	PqTrainParams trainParams[pq_subspaces];
+	pthread_t trainThreads[pq_subspaces];
+	for (int m = 0; m < pq_subspaces; m++) {
+		trainParams[m] = { &pq, dataset, &sample, m };
+		pthread_create(&trainThreads[m], nullptr, train_pq_subspace, &trainParams[m]);
+	}
+	for (int m = 0; m < pq_subspaces; m++) {
+		pthread_join(trainThreads[m], nullptr);
+	}
+
+	PqEncodeParams encodeParams[num_threads];
+	pthread_t encodeThreads[num_threads];
+	int blocks_per_thread = pq.blocks() / num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		int first = i * blocks_per_thread;
+		int end = (i == num_threads - 1) ? pq.blocks() : (i + 1) * blocks_per_thread;
+		encodeParams[i] = { &pq, dataset, first, end };
+		pthread_create(&encodeThreads[i], nullptr, encode_pq_blocks, &encodeParams[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(encodeThreads[i], nullptr);
+	}
+}
+
+static void* fill_pivot_table(void* arg) {
+	PivotFillParams* params = static_cast<PivotFillParams*>(arg);
+	params->table->fill(params->dataset, params->start, params->end);
+	return nullptr;
+}
+
+//pick the pivots, then fill the side table with one pthread per range of rows
+void build_pivot_table(const double* const dataset[], int dataset_size, int feature_size, PivotTable& table) {
+	table.select_pivots(dataset, dataset_size, feature_size, num_pivots, pivot_seed);
+
+	PivotFillParams fillParams[num_threads];
+	pthread_t fillThreads[num_threads];
+	int rows_per_thread = dataset_size / num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		int start = i * rows_per_thread;
+		int end = (i == num_threads - 1) ? dataset_size : (i + 1) * rows_per_thread;
+		fillParams[i] = { dataset, &table, start, end };
+		pthread_create(&fillThreads[i], nullptr, fill_pivot_table, &fillParams[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(fillThreads[i], nullptr);
+	}
+}
+
+//every node is scanned against the whole dataset, nodes are split over the threads
+static void* build_graph_nodes(void* arg) {
+	GraphParams* params = static_cast<GraphParams*>(arg);
+	for (int n = params->start; n < params->end; n++) {
+		int node = params->nodes[n];
+		const double* row = params->dataset[node];
+		TopK best = params->graph->node_list(node);
+		for (int i = 0; i < params->dataset_size; i++) {
+			double distance = bounded_squared_distance(row, params->dataset[i], params->feature_size, best.bound());
+			if (distance > 0) {
+				best.offer(distance, i, (int)params->dataset[i][0]);
+			}
+		}
+		best.sort();
+	}
+	return nullptr;
+}
+
+//offline all-pairs stage: K_max nearest neighbours of the first `nodes` rows over the whole dataset
+//a row that duplicates an earlier one gets a copy of its list instead of another full scan
+void build_knn_graph(const double* const dataset[], int dataset_size, int feature_size, int nodes, KnnGraph& graph) {
+	graph.reset(dataset, nodes, dataset_size, feature_size, graph_k_max);
+
+	vector<int> unique_nodes;
+	for (int i = 0; i < nodes; i++) {
+		if (graph.find_duplicate(dataset, i) == i) unique_nodes.push_back(i);
+	}
+
+	GraphParams graphParams[num_threads];
+	pthread_t graphThreads[num_threads];
+	int nodes_per_thread = (int)unique_nodes.size() / num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		int start = i * nodes_per_thread;
+		int end = (i == num_threads - 1) ? (int)unique_nodes.size() : (i + 1) * nodes_per_thread;
+		graphParams[i] = { dataset, &graph, unique_nodes.data(), dataset_size, feature_size, start, end };
+		pthread_create(&graphThreads[i], nullptr, build_graph_nodes, &graphParams[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(graphThreads[i], nullptr);
+	}
+
+	for (int i = 0; i < nodes; i++) {
+		int first = graph.find_duplicate(dataset, i);
+		if (first != i) graph.copy_node(first, i);
+	}
+}
+
+//rewrite a CSV dataset as a binary dataset file block by block, without loading it
+long long convert_csv_to_binary(const string& csvName, const string& binaryName, int feature_size) {
+	ifstream file(csvName);
+	if (!file.is_open()) {
+		cerr << "Error opening file: " << csvName << endl;
+		return -1;
+	}
+	BinaryDatasetWriter writer;
+	if (!writer.open(binaryName, feature_size)) {
+		cerr << "Error opening file: " << binaryName << endl;
+		return -1;
+	}
+
+	string line;
+	//to eliminate first line which is the header
+	getline(file, line);
+
+	vector<double> block((size_t)out_of_core_block_rows * feature_size);
+	long long total = 0;
+	int rows = 0;
+	while (getline(file, line)) {
+		vector<double> row = parseLine(line);
+		if ((int)row.size() < feature_size) continue;
+		copy(row.begin(), row.begin() + feature_size, block.begin() + (size_t)rows * feature_size);
+		if (++rows == out_of_core_block_rows) {
+			writer.write_rows(block.data(), rows);
+			total += rows;
+			rows = 0;
+		}
+	}
+	writer.write_rows(block.data(), rows);
+	total += rows;
+	return writer.close() ? total : -1;
+}
+
+vector<double> parseLine(const string& line) {
+	vector<double> row;
+	istringstream iss(line);
+	string value;
+
+	while (getline(iss, value, ',')) {
+		try {
+			double num = stod(value);
+			row.push_back(num);
+		}
+		catch (const invalid_argument&) {
+			cerr << "Invalid data in CSV: " << value << endl;
+		}
+	}
+
+	return row;
+}
+
+int main(int argc, char* argv[]) {
+	string filename = "diabetes_binary.csv";
+
+	//const int dataset_size = 30000;
+	//const int dataset_size = 100000;
+	const int dataset_size = 250000;
+	const int feature_size = 22;
+
+	double target[feature_size] = { 0.0, 0.0, 0.0, 1.0, 24.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 3.0, 0.0, 0.0, 0.0, 2.0, 5.0, 3.0 };
+	//double target[feature_size] = { 1.0, 1.0, 1.0, 1.0, 30.0, 1.0, 0.0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 5.0, 30.0, 30.0, 1.0, 0.0, 9.0, 5.0, 1.0 };
+	//double target[feature_size] = { 1.0, 0.0, 0.0, 1.0, 25.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 3.0, 0.0, 0.0, 0.0, 1.0, 13.0, 6.0, 8.0 };
+	//double target[feature_size] = { 0.0, 1.0, 1.0, 1.0, 28.0, 0.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 4.0, 0.0, 10.0, 1.0, 0.0, 12.0, 6.0, 2.0 };
+
+	//--trace <file>: record a timeline of the pthread work and write it as Chrome trace JSON when main returns
+	string trace_filename;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (string(argv[i]) == "--trace") trace_filename = argv[i + 1];
+	}
+	TraceRecorder recorder;
+	TraceExport traceExport(recorder, trace_filename);
+
+#pragma region OutOfCoreKnn
+	//--convert <csv> <bin>: rewrite a CSV dataset as a binary dataset file
+	if (argc > 3 && string(argv[1]) == "--convert") {
+		long long rows = convert_csv_to_binary(argv[2], argv[3], feature_size);
+		if (rows < 0) {
+			return 1;
+		}
+		cout << "Rows written: " << rows << endl;
+		return 0;
+	}
+
+	//--out-of-core <bin>: scan a binary dataset of any size in blocks, nothing is loaded up front
+	//the scaler needs a full pass over the data, so this mode works on the raw features
+	if (argc > 2 && string(argv[1]) == "--out-of-core") {
+		cout << "Out-of-core Pthread KNN: " << endl;
+		chrono::steady_clock::time_point outOfCoreBegin = chrono::steady_clock::now();
+
+		OutOfCoreKnn outOfCoreKnn(k_value); // Use K=3
+		int outOfCorePrediction = outOfCoreKnn.predict_class(argv[2], target, feature_size, nullptr);
+		cout << "Out-of-core Prediction: " << outOfCorePrediction << endl;
+
+		chrono::steady_clock::time_point outOfCoreEnd = chrono::steady_clock::now();
+		cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(outOfCoreEnd - outOfCoreBegin).count() << "[s]" << endl;
+		return (outOfCorePrediction < 0) ? 1 : 0;
+	}
+#pragma endregion
+
+#pragma region SharedSegmentKnn
+	//--attach <name>: classify against a segment published by another process, nothing is loaded or scaled here
+	if (argc > 2 && string(argv[1]) == "--attach") {
+		cout << "Shared segment Pthread KNN: " << endl;
+		chrono::steady_clock::time_point attachBegin = chrono::steady_clock::now();
+
+		SharedFeatureStore shared;
+		if (!shared.attach(argv[2])) {
+			cerr << "Cannot attach shared segment: " << argv[2] << endl;
+			return 1;
+		}
+		chrono::steady_clock::time_point attachEnd = chrono::steady_clock::now();
+		cout << "Attached " << shared.rows() << " rows in " << chrono::duration_cast<chrono::microseconds>(attachEnd - attachBegin).count() << "[s]" << endl;
+
+		//the query has feature_size values, a segment of another width cannot be queried with it
+		FeatureScaler sharedScaler;
+		if (shared.feature_size() != feature_size || !shared.load_scaler(sharedScaler)) {
+			cerr << "Shared segment has " << shared.feature_size() << " columns, expected " << feature_size << endl;
+			return 1;
+		}
+		double shared_target[feature_size];
+		sharedScaler.transform_query(target, shared_target);
+
+		chrono::steady_clock::time_point sharedBegin = chrono::steady_clock::now();
+		PthreadKnn sharedKnn(k_value); // Use K=3
+		int sharedPrediction = sharedKnn.predict_class(shared.row_pointers(), shared_target, shared.rows(), shared.feature_size());
+		cout << "Shared segment Prediction: " << sharedPrediction << endl;
+
+		chrono::steady_clock::time_point sharedEnd = chrono::steady_clock::now();
+		cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(sharedEnd - sharedBegin).count() << "[s]" << endl;
+		return (sharedPrediction < 0) ? 1 : 0;
+	}
+#pragma endregion
+
+	double** dataset = new double* [dataset_size];
+
+	// Allocate memory for dataset and target
+	for (int i = 0; i < dataset_size; i++) {
+		dataset[i] = new double[feature_size];
+	}
+
+	// Read data from CSV and populate dataset and target
+	ifstream file(filename);
+	if (!file.is_open()) {
+		cerr << "Error opening file: " << filename << endl;
+		return 1;
+	}
+
+	string header;
+	//to eliminate first line which is the header
+	getline(file, header);
+
+	string line;
+	int index = 0;
+	while (getline(file, line) && index < dataset_size) {
+		vector<double> row = parseLine(line);
+		for (int j = 0; j < feature_size; j++) {
+			dataset[index][j] = row[j];
+		}
+		index++;
+	}
+
+	cout << "Number of records: " << index << endl;
+
+	//exact integer copy of the raw rows for the histogram KNN, taken before scaling
+	IntegerFeatureStore integerStore;
+	if (!integerStore.build(dataset, dataset_size, feature_size)) {
+		cerr << "Dataset has non-integer features, histogram KNN is skipped" << endl;
+	}
+	//same rows with the 0/1 columns packed into a bit mask
+	PackedFeatureStore packedStore;
+	if (integerStore.size() > 0 && !packedStore.build(integerStore)) {
+		cerr << "Too many columns to pack, packed histogram KNN is skipped" << endl;
+	}
+
+	//scale the stored rows once and apply the same transform to the query
+	FeatureScaler scaler;
+	scale_dataset(dataset, dataset_size, feature_size, default_scaling_mode, scaler);
+	double scaled_target[feature_size];
+	scaler.transform_query(target, scaled_target);
+
+	//--build-graph [nodes]: offline all-kNN graph of the first `nodes` rows (default every row), saved to graph_filename
+	if (argc > 1 && string(argv[1]) == "--build-graph") {
+		//the count is optional, "--build-graph --trace t.json" builds the whole graph
+		int nodes = (argc > 2 && string(argv[2]).rfind("--", 0) != 0) ? min(stoi(argv[2]), dataset_size) : dataset_size;
+		if (nodes <= 0) {
+			cerr << "Node count must be positive: " << argv[2] << endl;
+			return 1;
+		}
+		chrono::steady_clock::time_point graphBegin = chrono::steady_clock::now();
+		KnnGraph graph;
+		build_knn_graph(dataset, dataset_size, feature_size, nodes, graph);
+		chrono::steady_clock::time_point graphEnd = chrono::steady_clock::now();
+		if (!graph.save(graph_filename)) {
+			cerr << "Cannot write " << graph_filename << endl;
+			return 1;
+		}
+		cout << "KNN graph of " << nodes << " rows (K_max = " << graph_k_max << ") written to " << graph_filename << endl;
+		cout << "Build Time = " << chrono::duration_cast<chrono::microseconds>(graphEnd - graphBegin).count() << "[s]" << endl;
+		for (int i = 0; i < dataset_size; i++) {
+			delete[] dataset[i];
+		}
+		delete[] dataset;
+		return 0;
+	}
+
+	//--publish <name>: put the scaled rows in a shared segment for --attach processes and keep it until Enter
+	if (argc > 2 && string(argv[1]) == "--publish") {
+		SharedFeatureStore shared;
+		if (!shared.publish(argv[2], dataset, dataset_size, feature_size, scaler)) {
+			cerr << "Cannot publish shared segment: " << argv[2] << endl;
+			return 1;
+		}
+		cout << "Published " << dataset_size << " rows to " << argv[2] << ", press Enter to remove it" << endl;
+		cin.get();
+		shared.detach();
+		SharedFeatureStore::remove(argv[2]);
+		for (int i = 0; i < dataset_size; i++) {
+			delete[] dataset[i];
+		}
+		delete[] dataset;
+		return 0;
+	}
+
+	//Pthread Knn
+#pragma region PthreadKnn
+	cout << "\nPthread KNN  + Quick Sort: " << endl;
+	chrono::steady_clock::time_point pthreadBegin = chrono::steady_clock::now();
+
+	PthreadKnn pthreadknn(k_value); // Use K=3
+	int pthreadPrediction = pthreadknn.predict_class(dataset, scaled_target, dataset_size, feature_size);
+	cout << "Pthread Prediction: " << pthreadPrediction << endl;
+
+	if (pthreadPrediction == 0) {
+		cout << "Predicted class: Negative" << endl;
+	}
+	else if (pthreadPrediction == 1) {
 		cout << "Predicted class: Prediabetes or Diabetes" << endl;
 	}
 	else {
@@ -445,7 +1939,7 @@ int main() {
 	chrono::steady_clock::time_point knnBegin = chrono::steady_clock::now();
 	Knn knn(k_value); // Use K=3
 
-	int prediction = knn.predict_class(dataset, target, dataset_size, feature_size);
+	int prediction = knn.predict_class(dataset, scaled_target, dataset_size, feature_size);
 	cout << "KNN Prediction: " << prediction << endl;
 
 	if (prediction == 0) {
@@ -461,10 +1955,256 @@ int main() {
 	chrono::steady_clock::time_point knnEnd = chrono::steady_clock::now();
 	cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(knnEnd - knnBegin).count() << "[s]" << endl;
 
+#pragma endregion
+
+	//Pthread Pivot Knn
+#pragma region PthreadPivotKnn
+	cout << "\nPthread Pivot KNN (LAESA side table): " << endl;
+	chrono::steady_clock::time_point pivotBuildBegin = chrono::steady_clock::now();
+	PivotTable pivotTable;
+	build_pivot_table(dataset, dataset_size, feature_size, pivotTable);
+	chrono::steady_clock::time_point pivotBuildEnd = chrono::steady_clock::now();
+	cout << pivotTable.pivot_count() << " pivots, side table " << pivotTable.table_bytes() / 1024 << " KB, built in " << chrono::duration_cast<chrono::microseconds>(pivotBuildEnd - pivotBuildBegin).count() << "[s]" << endl;
+
+	chrono::steady_clock::time_point pivotBegin = chrono::steady_clock::now();
+	PthreadPivotKnn pivotKnn(k_value); // Use K=3
+	int pivotPrediction = pivotKnn.predict_class(dataset, pivotTable, scaled_target, dataset_size, feature_size);
+	cout << "Pivot Prediction: " << pivotPrediction << endl;
+	cout << "Rows read: " << pivotKnn.last_rows_touched() << " of " << dataset_size << endl;
+
+	if (pivotPrediction == 0) {
+		cout << "Predicted class: Negative" << endl;
+	}
+	else if (pivotPrediction == 1) {
+		cout << "Predicted class: Prediabetes or Diabetes" << endl;
+	}
+	else {
+		cout << "Prediction could not be made." << endl;
+	}
+
+	chrono::steady_clock::time_point pivotEnd = chrono::steady_clock::now();
+	cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(pivotEnd - pivotBegin).count() << "[s]" << endl;
+#pragma endregion
+
+	//PCA Knn
+#pragma region PcaKnn
+	{
+		cout << "\nPthread PCA KNN (" << pca_dimensions << " components, exact refinement): " << endl;
+		chrono::steady_clock::time_point pcaBuildBegin = chrono::steady_clock::now();
+		PcaTable pcaTable;
+		build_pca_table(dataset, dataset_size, feature_size, pcaTable);
+		chrono::steady_clock::time_point pcaBuildEnd = chrono::steady_clock::now();
+		cout << "Explained variance " << pcaTable.explained_variance() * 100 << "%, side table " << pcaTable.table_bytes() / 1024 << " KB, built in "
+			<< chrono::duration_cast<chrono::microseconds>(pcaBuildEnd - pcaBuildBegin).count() << "[s]" << endl;
+
+		chrono::steady_clock::time_point pcaBegin = chrono::steady_clock::now();
+		PthreadPcaKnn pcaKnn(k_value); // Use K=3
+		int pcaPrediction = pcaKnn.predict_class(dataset, pcaTable, scaled_target, dataset_size, feature_size);
+		chrono::steady_clock::time_point pcaEnd = chrono::steady_clock::now();
+		cout << "PCA Prediction: " << pcaPrediction << endl;
+		cout << "Rows read: " << pcaKnn.last_rows_touched() << " of " << dataset_size << endl;
+		cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(pcaEnd - pcaBegin).count() << "[s]" << endl;
+	}
+#pragma endregion
+
+	//Mixed precision Knn
+#pragma region MixedPrecisionKnn
+	{
+		cout << "\nPthread mixed precision KNN (float32 scan, double re-rank): " << endl;
+		chrono::steady_clock::time_point floatBuildBegin = chrono::steady_clock::now();
+		FloatFeatureStore floatStore;
+		floatStore.build(dataset, dataset_size, feature_size);
+		chrono::steady_clock::time_point floatBuildEnd = chrono::steady_clock::now();
+		cout << "Float store " << floatStore.bytes() / 1024 << " KB, built in " << chrono::duration_cast<chrono::microseconds>(floatBuildEnd - floatBuildBegin).count() << "[s]" << endl;
+
+		chrono::steady_clock::time_point floatBegin = chrono::steady_clock::now();
+		PthreadMixedPrecisionKnn floatKnn(k_value); // Use K=3
+		int floatPrediction = floatKnn.predict_class(dataset, floatStore, scaled_target, dataset_size, feature_size);
+		chrono::steady_clock::time_point floatEnd = chrono::steady_clock::now();
+		cout << "Mixed Precision Prediction: " << floatPrediction << endl;
+		cout << "Candidates re-ranked: " << floatKnn.last_candidates() << endl;
+		cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(floatEnd - floatBegin).count() << "[s]" << endl;
+	}
+#pragma endregion
+
+	//Product quantisation Knn
+#pragma region PqKnn
+	{
+		cout << "\nPthread PQ KNN (" << pq_subspaces << " x 4-bit codes, exact re-rank of " << pq_rerank << "): " << endl;
+		chrono::steady_clock::time_point pqBuildBegin = chrono::steady_clock::now();
+		ProductQuantizer pq;
+		build_pq_index(dataset, dataset_size, feature_size, pq);
+		chrono::steady_clock::time_point pqBuildEnd = chrono::steady_clock::now();
+		cout << "Codes " << pq.bytes() / 1024 << " KB, " << (pq.simd() ? "pshufb" : "scalar") << " scan, built in " << chrono::duration_cast<chrono::microseconds>(pqBuildEnd - pqBuildBegin).count() << "[s]" << endl;
+
+		chrono::steady_clock::time_point pqBegin = chrono::steady_clock::now();
+		PthreadPqKnn pqKnn(k_value); // Use K=3
+		int pqPrediction = pqKnn.predict_class(dataset, pq, scaled_target, feature_size);
+		chrono::steady_clock::time_point pqEnd = chrono::steady_clock::now();
+		cout << "PQ Prediction: " << pqPrediction << endl;
+		cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(pqEnd - pqBegin).count() << "[s]" << endl;
+	}
+#pragma endregion
+
+	//Anytime Knn
+#pragma region AnytimeKnn
+	//graceful degradation under a latency budget: the answer of a partial scan and how much of the data it saw
+	{
+		cout << "\nPthread Anytime KNN: " << endl;
+		const long long budgets_us[4] = { 200, 1000, 5000, 1000000 };
+		PthreadAnytimeKnn anytimeKnn(k_value, dataset_size); // Use K=3
+		for (long long budget : budgets_us) {
+			cout << "\nBudget " << budget << "[s]:" << endl;
+			chrono::steady_clock::time_point anytimeBegin = chrono::steady_clock::now();
+			int anytimePrediction = anytimeKnn.predict_class(dataset, scaled_target, feature_size, budget);
+			chrono::steady_clock::time_point anytimeEnd = chrono::steady_clock::now();
+			cout << "Anytime Prediction: " << anytimePrediction << endl;
+			cout << "Examined: " << anytimeKnn.last_fraction_examined() * 100 << "% of the dataset" << (anytimeKnn.last_complete() ? " (exact)" : "") << endl;
+			cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(anytimeEnd - anytimeBegin).count() << "[s]" << endl;
+		}
+	}
+#pragma endregion
+
+	//Cached Knn
+#pragma region CachedPivotKnn
+	//replay of repeated traffic: the sample patients come back again and again
+	if (integerStore.size() > 0) {
+		cout << "\nCached Pthread Pivot KNN: " << endl;
+		const int num_patients = 3;
+		const int replay_queries = 3000;
+		double patients[num_patients][feature_size] = {
+			{ 0.0, 0.0, 0.0, 1.0, 24.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 3.0, 0.0, 0.0, 0.0, 2.0, 5.0, 3.0 },
+			{ 1.0, 1.0, 1.0, 1.0, 30.0, 1.0, 0.0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 5.0, 30.0, 30.0, 1.0, 0.0, 9.0, 5.0, 1.0 },
+			{ 0.0, 1.0, 1.0, 1.0, 28.0, 0.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 4.0, 0.0, 10.0, 1.0, 0.0, 12.0, 6.0, 2.0 }
+		};
+
+		CachedPivotKnn cachedKnn(k_value, dataset, dataset_size, feature_size, pivotTable, scaler, integerStore, result_cache_capacity);
+		for (int q = 0; q < num_patients; q++) {
+			cout << "Patient " << q + 1 << " Prediction: " << cachedKnn.predict_class(patients[q]) << endl;
+		}
+
+		chrono::steady_clock::time_point cacheBegin = chrono::steady_clock::now();
+		for (int q = 0; q < replay_queries; q++) {
+			cachedKnn.predict_class(patients[q % num_patients]);
+		}
+		chrono::steady_clock::time_point cacheEnd = chrono::steady_clock::now();
+		cout << "Hit rate: " << cachedKnn.stats().hit_rate() * 100 << "% (" << cachedKnn.stats().hits() << " hits, " << cachedKnn.stats().misses() << " misses)" << endl;
+		cout << "Repeated query Time = " << chrono::duration_cast<chrono::nanoseconds>(cacheEnd - cacheBegin).count() / 1000.0 / replay_queries << "[s] per query" << endl;
+
+		cachedKnn.invalidate();
+		chrono::steady_clock::time_point missBegin = chrono::steady_clock::now();
+		cachedKnn.predict_class(patients[0]);
+		chrono::steady_clock::time_point missEnd = chrono::steady_clock::now();
+		cout << "After invalidation Time = " << chrono::duration_cast<chrono::microseconds>(missEnd - missBegin).count() << "[s] (" << cachedKnn.stats().misses() << " misses)" << endl;
+	}
+#pragma endregion
+
+	//Ranked retrieval
+#pragma region RankedRetrieval
+	//the analytics use case: thousands of nearest patients with their row and label, in ranked order
+	{
+		const int retrieval_sizes[2] = { 1000, 10000 };
+		PthreadRankedRetrieval retrieval;
+		vector<Neighbour> ranked(retrieval_sizes[1]);
+		for (int r = 0; r < 2; r++) {
+			int k = retrieval_sizes[r];
+			cout << "\nPthread ranked retrieval, K = " << k << ": " << endl;
+			chrono::steady_clock::time_point rankBegin = chrono::steady_clock::now();
+			int found = retrieval.retrieve(dataset, scaled_target, dataset_size, feature_size, k, ranked.data());
+			chrono::steady_clock::time_point rankEnd = chrono::steady_clock::now();
+
+			for (int i = 0; i < min(found, 3); i++) {
+				cout << "#" << i + 1 << " row " << ranked[i].index << ", label " << ranked[i].label << ": " << sqrt(ranked[i].distance) << endl;
+			}
+			if (found > 0) {
+				cout << "#" << found << " row " << ranked[found - 1].index << ", label " << ranked[found - 1].label << ": " << sqrt(ranked[found - 1].distance) << endl;
+			}
+			cout << "Retrieval Time = " << chrono::duration_cast<chrono::microseconds>(rankEnd - rankBegin).count() << "[s]" << endl;
+		}
+	}
+#pragma endregion
+
+	//Known record lookup
+#pragma region KnnGraphLookup
+	//a query that is a row of the dataset is answered from the precomputed graph, no scan at all
+	KnnGraph graph;
+	if (graph.load(graph_filename, dataset, dataset_size, feature_size, graph_k_max)) {
+		cout << "\nKNN graph lookup: " << endl;
+		chrono::steady_clock::time_point lookupBegin = chrono::steady_clock::now();
+
+		int node = graph.find(dataset, scaled_target);
+		if (node >= 0 && k_value <= graph.k_max()) {
+			const Neighbour* nearest = graph.neighbours_of(node);
+			cout << "Known record (row " << node << "), First K(" << k_value << ") value: " << endl;
+			for (int i = 0; i < k_value; i++) {
+				cout << nearest[i].label << ": " << sqrt(nearest[i].distance) << endl;
+			}
+			cout << "Graph Prediction: " << vote(nearest, k_value) << endl;
+		}
+		else {
+			cout << "Query is not a record of the graph, use a scan" << endl;
+		}
+
+		chrono::steady_clock::time_point lookupEnd = chrono::steady_clock::now();
+		cout << "Lookup Time = " << chrono::duration_cast<chrono::nanoseconds>(lookupEnd - lookupBegin).count() / 1000.0 << "[s]" << endl;
+	}
+#pragma endregion
+
+	//Pthread Histogram Knn
+#pragma region PthreadHistogramKnn
+	if (integerStore.size() > 0) {
+		cout << "\nPthread Histogram KNN (raw integer features): " << endl;
+		chrono::steady_clock::time_point histogramBegin = chrono::steady_clock::now();
+
+		PthreadHistogramKnn histogramKnn(k_value); // Use K=3
+		int histogramPrediction = histogramKnn.predict_class(integerStore, target);
+		cout << "Histogram Prediction: " << histogramPrediction << endl;
+
+		if (histogramPrediction == 0) {
+			cout << "Predicted class: Negative" << endl;
+		}
+		else if (histogramPrediction == 1) {
+			cout << "Predicted class: Prediabetes or Diabetes" << endl;
+		}
+		else {
+			cout << "Prediction could not be made." << endl;
+		}
+
+		chrono::steady_clock::time_point histogramEnd = chrono::steady_clock::now();
+		cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(histogramEnd - histogramBegin).count() << "[s]" << endl;
+	}
+#pragma endregion
+
+	//Pthread Packed Histogram Knn
+#pragma region PthreadPackedHistogramKnn
+	if (packedStore.size() > 0) {
+		cout << "\nPthread Histogram KNN (bit-packed rows, " << sizeof(PackedRow) << " bytes per row): " << endl;
+		cout << packedStore.binary_count() << " binary columns, " << packedStore.ordinal_count() << " ordinal columns" << endl;
+		chrono::steady_clock::time_point packedBegin = chrono::steady_clock::now();
+
+		PthreadHistogramKnn packedKnn(k_value); // Use K=3
+		int packedPrediction = packedKnn.predict_class(packedStore, target);
+		cout << "Packed Prediction: " << packedPrediction << endl;
+
+		if (packedPrediction == 0) {
+			cout << "Predicted class: Negative" << endl;
+		}
+		else if (packedPrediction == 1) {
+			cout << "Predicted class: Prediabetes or Diabetes" << endl;
+		}
+		else {
+			cout << "Prediction could not be made." << endl;
+		}
+
+		chrono::steady_clock::time_point packedEnd = chrono::steady_clock::now();
+		cout << "Classification Time = " << chrono::duration_cast<chrono::microseconds>(packedEnd - packedBegin).count() << "[s]" << endl;
+	}
 #pragma endregion
 
 	//cout << "The speed of classification is " << (double)((knnEnd - knnBegin) / (pthreadEnd - pthreadBegin)) << " Times fasters" << endl;
 
+	traceExport.finish();
+
 	// Deallocate memory for dataset
 	for (int i = 0; i < dataset_size; i++) {
 		delete[] dataset[i];
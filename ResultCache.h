@@ -0,0 +1,141 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "IntegerFeatureStore.h"
+#include "KnnTopK.h"
+
+//lock stripes of the cache, a query only ever locks the stripe its key hashes to
+const int result_cache_shards = 16;
+//largest K a cache entry keeps
+const int result_cache_max_k = 16;
+
+//key of a cached result: the query as one byte per feature, the same encoding IntegerFeatureStore uses
+//features are small integers, so identical patients give byte-identical keys
+struct QueryKey {
+	uint8_t values[max_integer_features];
+	int width;
+
+	bool operator==(const QueryKey& other) const {
+		return width == other.width && std::memcmp(values, other.values, width) == 0;
+	}
+};
+
+struct QueryKeyHash {
+	size_t operator()(const QueryKey& key) const {
+		uint64_t hash = 1469598103934665603ULL;
+		for (int j = 0; j < key.width; j++) {
+			hash ^= key.values[j];
+			hash *= 1099511628211ULL;
+		}
+		return (size_t)hash;
+	}
+};
+
+struct CachedResult {
+	int prediction;
+	int count;
+	Neighbour nearest[result_cache_max_k];
+};
+
+//sharded LRU cache of top-K results in front of predict_class
+//every entry remembers the dataset generation it was computed on; invalidate() bumps the generation,
+//so after a dataset change old entries are never served and are dropped when they are next looked up
+class ResultCache {
+private:
+	struct Entry {
+		QueryKey key;
+		uint64_t generation;
+		CachedResult result;
+	};
+
+	struct Shard {
+		std::mutex lock;
+		std::list<Entry> entries; //most recently used first
+		std::unordered_map<QueryKey, std::list<Entry>::iterator, QueryKeyHash> index;
+	};
+
+	std::vector<Shard> shards;
+	size_t shard_capacity;
+	std::atomic<uint64_t> current_generation{ 0 };
+	std::atomic<long long> hit_count{ 0 };
+	std::atomic<long long> miss_count{ 0 };
+
+public:
+	explicit ResultCache(size_t capacity) :
+		shards(result_cache_shards),
+		shard_capacity((capacity + result_cache_shards - 1) / result_cache_shards) {}
+
+	//false when the query is not integer, such a query bypasses the cache
+	static bool make_key(const IntegerFeatureStore& store, const double* target, QueryKey& key) {
+		IntegerFeatureStore::Query query;
+		if (!store.encode_query(target, query)) return false;
+		key.width = store.feature_width();
+		std::memcpy(key.values, query.values, key.width);
+		return true;
+	}
+
+	bool lookup(const QueryKey& key, CachedResult& out) {
+		Shard& shard = shard_of(key);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto found = shard.index.find(key);
+		if (found != shard.index.end()) {
+			if (found->second->generation == current_generation.load(std::memory_order_acquire)) {
+				shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+				out = found->second->result;
+				hit_count.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+			shard.entries.erase(found->second);
+			shard.index.erase(found);
+		}
+		miss_count.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	//generation is the value of generation() read before the result was computed,
+	//a result that raced with invalidate() is then never stored as current
+	void insert(const QueryKey& key, uint64_t generation, const Neighbour* nearest, int count, int prediction) {
+		if (generation != current_generation.load(std::memory_order_acquire)) return;
+		Entry entry;
+		entry.key = key;
+		entry.generation = generation;
+		entry.result.prediction = prediction;
+		entry.result.count = (count < result_cache_max_k) ? count : result_cache_max_k;
+		std::copy(nearest, nearest + entry.result.count, entry.result.nearest);
+
+		Shard& shard = shard_of(key);
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto found = shard.index.find(key);
+		if (found != shard.index.end()) {
+			shard.entries.erase(found->second);
+			shard.index.erase(found);
+		}
+		shard.entries.push_front(entry);
+		shard.index[key] = shard.entries.begin();
+		if (shard.entries.size() > shard_capacity) {
+			shard.index.erase(shard.entries.back().key);
+			shard.entries.pop_back();
+		}
+	}
+
+	//call on every dataset mutation (rows added, removed or rescaled)
+	void invalidate() { current_generation.fetch_add(1, std::memory_order_acq_rel); }
+	uint64_t generation() const { return current_generation.load(std::memory_order_acquire); }
+
+	long long hits() const { return hit_count.load(std::memory_order_relaxed); }
+	long long misses() const { return miss_count.load(std::memory_order_relaxed); }
+	double hit_rate() const {
+		long long total = hits() + misses();
+		return (total > 0) ? (double)hits() / total : 0.0;
+	}
+
+private:
+	Shard& shard_of(const QueryKey& key) {
+		return shards[QueryKeyHash()(key) % result_cache_shards];
+	}
+};
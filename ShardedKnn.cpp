@@ -0,0 +1,488 @@
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <vector>
+#define HAVE_STRUCT_TIMESPEC
+#include <pthread.h>
+#include "KnnTopK.h"
+#include "KnnDistance.h"
+#include "KnnWire.h"
+using namespace std;
+
+const int k_value = 3;
+const int dataset_size = 250000;
+const int feature_size = 22;
+//a shard that has not answered after this long gets the same request sent to its next replica
+const int default_hedge_ms = 10;
+//a batch fails when no replica of a shard answers within this long
+const int request_timeout_ms = 5000;
+//batches sent by the coordinator to measure throughput and tail latency
+const int benchmark_batches = 200;
+
+vector<double> parseLine(const string& line);
+
+#pragma region ShardWorker
+//one shard of the dataset, row i of the CSV belongs to shard i % shard_count
+//the worker answers every request with the local top-K of each query, the coordinator does the merge
+//features are raw: a shard alone cannot fit the scaler of the whole dataset
+class ShardWorker {
+private:
+	int shard_id;
+	int shard_count;
+	vector<double> rows;	//contiguous shard rows
+	vector<int> row_index;	//global row index of every shard row
+
+public:
+	ShardWorker(int shard_id, int shard_count) : shard_id(shard_id), shard_count(shard_count) {}
+
+	bool load(const string& filename) {
+		ifstream file(filename);
+		if (!file.is_open()) {
+			cerr << "Error opening file: " << filename << endl;
+			return false;
+		}
+		string line;
+		//to eliminate first line which is the header
+		getline(file, line);
+
+		int index = 0;
+		while (getline(file, line) && index < dataset_size) {
+			if (index % shard_count == shard_id) {
+				vector<double> row = parseLine(line);
+				if ((int)row.size() >= feature_size) {
+					rows.insert(rows.end(), row.begin(), row.begin() + feature_size);
+					row_index.push_back(index);
+				}
+			}
+			index++;
+		}
+		return true;
+	}
+
+	int size() const { return (int)row_index.size(); }
+
+	//a request the worker can answer: the shard's row width and K and batch size within the wire limits
+	static bool valid_request(const WireHeader& request) {
+		return request.magic == knn_request_magic && request.k > 0 && request.k <= wire_max_k
+			&& request.num_queries > 0 && request.num_queries <= wire_max_queries && request.feature_size == feature_size;
+	}
+
+	//build the response to one valid request, the payload holds num_queries rows of feature_size doubles
+	void answer(const WireHeader& request, const uint8_t* payload, vector<uint8_t>& response, vector<Neighbour>& storage, vector<double>& query) const {
+		int k = request.k;
+		int num_queries = (int)request.num_queries;
+
+		response.assign(wire_header_size + (size_t)num_queries * 4 + (size_t)num_queries * k * wire_neighbour_size, 0);
+		encode_header(response.data(), { knn_response_magic, request.request_id, (uint16_t)k, (uint16_t)feature_size, (uint32_t)num_queries, (uint16_t)shard_id, (uint16_t)shard_count });
+		uint8_t* counts = response.data() + wire_header_size;
+		uint8_t* entries = counts + (size_t)num_queries * 4;
+
+		storage.resize(k);
+		query.resize(feature_size);
+		for (int q = 0; q < num_queries; q++) {
+			for (int j = 0; j < feature_size; j++) {
+				query[j] = get_f64(payload + ((size_t)q * feature_size + j) * 8);
+			}
+
+			TopK best(storage.data(), k);
+			for (int i = 0; i < size(); i++) {
+				const double* row = &rows[(size_t)i * feature_size];
+				double distance = bounded_squared_distance(query.data(), row, feature_size, best.bound());
+				if (distance > 0) {
+					best.offer(distance, row_index[i], (int)row[0]);
+				}
+			}
+			best.sort();
+
+			put_u32(counts + (size_t)q * 4, (uint32_t)best.size());
+			for (int n = 0; n < best.size(); n++) {
+				uint8_t* entry = entries + ((size_t)q * k + n) * wire_neighbour_size;
+				put_f64(entry, best[n].distance);
+				put_u32(entry + 8, (uint32_t)best[n].index);
+				put_u32(entry + 12, (uint32_t)best[n].label);
+			}
+		}
+	}
+
+	//accept coordinators forever, every connection is served by its own thread
+	int serve(uint16_t port) {
+		socket_t listener = listen_on(port);
+		if (listener == invalid_socket) {
+			cerr << "Cannot listen on port " << port << endl;
+			return 1;
+		}
+		cout << "Shard " << shard_id << "/" << shard_count << " serving " << size() << " rows on port " << port << endl;
+
+		while (true) {
+			socket_t connection = accept(listener, nullptr, nullptr);
+			if (connection == invalid_socket) continue;
+			set_no_delay(connection);
+
+			ConnectionParams* params = new ConnectionParams{ this, connection };
+			pthread_t thread;
+			if (pthread_create(&thread, nullptr, serve_connection, params) != 0) {
+				close_socket(connection);
+				delete params;
+				continue;
+			}
+			pthread_detach(thread);
+		}
+	}
+
+private:
+	struct ConnectionParams {
+		const ShardWorker* worker;
+		socket_t socket;
+	};
+
+	static void* serve_connection(void* arg) {
+		ConnectionParams* params = static_cast<ConnectionParams*>(arg);
+		//buffers are reused for every request of this connection
+		vector<uint8_t> payload;
+		vector<uint8_t> response;
+		vector<Neighbour> storage;
+		vector<double> query;
+		uint8_t header_bytes[wire_header_size];
+
+		while (recv_all(params->socket, header_bytes, wire_header_size)) {
+			WireHeader request = decode_header(header_bytes);
+			if (!valid_request(request)) break; //a bad header closes the connection, nothing is sized from it
+			payload.resize((size_t)request.num_queries * request.feature_size * 8);
+			if (!recv_all(params->socket, payload.data(), payload.size())) break;
+
+			params->worker->answer(request, payload.data(), response, storage, query);
+			if (!send_all(params->socket, response.data(), response.size())) break;
+		}
+
+		close_socket(params->socket);
+		delete params;
+		return nullptr;
+	}
+};
+#pragma endregion
+
+#pragma region ShardCoordinator
+struct ShardEndpoint {
+	string host;
+	uint16_t port;
+	socket_t socket;
+};
+
+//scatter-gather over the shard workers
+//each batch goes to one replica of every shard; a shard that is slower than the hedge delay gets the
+//same request sent to its next replica and the first answer wins, late answers are recognised by their
+//request id and dropped, so one slow process does not set the tail latency
+class ShardCoordinator {
+private:
+	vector<vector<ShardEndpoint>> replicas; //replicas[shard]
+	int hedge_ms;
+	uint32_t next_request_id = 1;
+	long long hedges_sent = 0;
+
+	//buffers reused by every batch
+	vector<uint8_t> request;
+	vector<uint8_t> response;
+	vector<Neighbour> shard_results;	//[shard][query][k]
+	vector<int> shard_counts;		//[shard][query]
+
+public:
+	ShardCoordinator(int hedge_ms) : hedge_ms(hedge_ms) {}
+
+	~ShardCoordinator() {
+		for (auto& shard : replicas) {
+			for (auto& endpoint : shard) {
+				if (endpoint.socket != invalid_socket) close_socket(endpoint.socket);
+			}
+		}
+	}
+
+	//endpoint is "shard@host:port"
+	bool add_endpoint(const string& spec) {
+		size_t at = spec.find('@');
+		size_t colon = spec.rfind(':');
+		if (at == string::npos || colon == string::npos || colon < at) {
+			cerr << "Endpoint must look like shard@host:port: " << spec << endl;
+			return false;
+		}
+		int shard = stoi(spec.substr(0, at));
+		string host = spec.substr(at + 1, colon - at - 1);
+		uint16_t port = (uint16_t)stoi(spec.substr(colon + 1));
+
+		socket_t s = connect_to(host, port);
+		if (s == invalid_socket) {
+			cerr << "Cannot connect to " << host << ":" << port << endl;
+			return false;
+		}
+		if ((int)replicas.size() <= shard) replicas.resize(shard + 1);
+		replicas[shard].push_back({ host, port, s });
+		return true;
+	}
+
+	int shard_count() const { return (int)replicas.size(); }
+	long long hedges() const { return hedges_sent; }
+
+	//classify a batch, nearest receives num_queries * k neighbours (ascending per query)
+	bool predict_batch(const double* const queries[], int num_queries, int k, int* predictions, vector<Neighbour>& nearest) {
+		int shards = shard_count();
+		if (k <= 0 || k > wire_max_k || num_queries <= 0 || (uint32_t)num_queries > wire_max_queries) {
+			cerr << "Batch of " << num_queries << " queries with K=" << k << " is outside the wire limits" << endl;
+			return false;
+		}
+		uint32_t request_id = next_request_id++;
+
+		request.assign(wire_header_size + (size_t)num_queries * feature_size * 8, 0);
+		encode_header(request.data(), { knn_request_magic, request_id, (uint16_t)k, (uint16_t)feature_size, (uint32_t)num_queries, 0, 0 });
+		for (int q = 0; q < num_queries; q++) {
+			for (int j = 0; j < feature_size; j++) {
+				put_f64(request.data() + wire_header_size + ((size_t)q * feature_size + j) * 8, queries[q][j]);
+			}
+		}
+
+		shard_results.assign((size_t)shards * num_queries * k, Neighbour{});
+		shard_counts.assign((size_t)shards * num_queries, 0);
+		vector<int> tried(shards, 0);
+		vector<bool> pending(shards, true);
+		int remaining = shards;
+
+		//scatter to the first live replica of every shard
+		for (int s = 0; s < shards; s++) {
+			if (!send_to_next_replica(s, tried)) return false;
+		}
+
+		chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+		chrono::steady_clock::time_point next_hedge = begin + chrono::milliseconds(hedge_ms);
+		chrono::steady_clock::time_point deadline = begin + chrono::milliseconds(request_timeout_ms);
+
+		//gather
+		while (remaining > 0) {
+			chrono::steady_clock::time_point now = chrono::steady_clock::now();
+			if (now >= deadline) {
+				cerr << "Shard request " << request_id << " timed out" << endl;
+				return false;
+			}
+			if (now >= next_hedge) {
+				//hedge every shard still waiting that has a replica left to try
+				for (int s = 0; s < shards; s++) {
+					if (pending[s] && tried[s] < (int)replicas[s].size()) {
+						if (send_to_next_replica(s, tried)) hedges_sent++;
+					}
+				}
+				next_hedge = now + chrono::milliseconds(hedge_ms);
+			}
+
+			fd_set readable;
+			FD_ZERO(&readable);
+			socket_t highest = 0;
+			for (int s = 0; s < shards; s++) {
+				if (!pending[s]) continue;
+				for (int r = 0; r < tried[s]; r++) {
+					socket_t sock = replicas[s][r].socket;
+					if (sock == invalid_socket) continue;
+					FD_SET(sock, &readable);
+					if (sock > highest) highest = sock;
+				}
+			}
+			long long wait_us = chrono::duration_cast<chrono::microseconds>(min(next_hedge, deadline) - now).count();
+			timeval timeout = { (long)(wait_us / 1000000), (long)(wait_us % 1000000) };
+			if (select((int)highest + 1, &readable, nullptr, nullptr, &timeout) <= 0) continue;
+
+			for (int s = 0; s < shards; s++) {
+				if (!pending[s]) continue;
+				for (int r = 0; r < tried[s] && pending[s]; r++) {
+					ShardEndpoint& endpoint = replicas[s][r];
+					if (endpoint.socket == invalid_socket || !FD_ISSET(endpoint.socket, &readable)) continue;
+					int result = read_response(endpoint, s, request_id, num_queries, k);
+					if (result < 0) {
+						//replica went away, fall over to the next one straight away
+						close_socket(endpoint.socket);
+						endpoint.socket = invalid_socket;
+						if (!send_to_next_replica(s, tried) && !has_live_attempt(s, tried)) return false;
+					}
+					else if (result == 1) {
+						pending[s] = false;
+						remaining--;
+					}
+				}
+			}
+		}
+
+		//merge the local top-K lists of all shards
+		nearest.assign((size_t)num_queries * k, Neighbour{});
+		for (int q = 0; q < num_queries; q++) {
+			TopK best(&nearest[(size_t)q * k], k);
+			for (int s = 0; s < shards; s++) {
+				const Neighbour* local = &shard_results[((size_t)s * num_queries + q) * k];
+				for (int n = 0; n < shard_counts[(size_t)s * num_queries + q]; n++) {
+					best.offer(local[n]);
+				}
+			}
+			best.sort();
+			predictions[q] = (best.size() > 0) ? vote(best.data(), best.size()) : -1;
+		}
+		return true;
+	}
+
+private:
+	bool send_to_next_replica(int shard, vector<int>& tried) {
+		while (tried[shard] < (int)replicas[shard].size()) {
+			ShardEndpoint& endpoint = replicas[shard][tried[shard]++];
+			if (endpoint.socket != invalid_socket && send_all(endpoint.socket, request.data(), request.size())) {
+				return true;
+			}
+			if (endpoint.socket != invalid_socket) {
+				close_socket(endpoint.socket);
+				endpoint.socket = invalid_socket;
+			}
+		}
+		return false;
+	}
+
+	bool has_live_attempt(int shard, const vector<int>& tried) const {
+		for (int r = 0; r < tried[shard]; r++) {
+			if (replicas[shard][r].socket != invalid_socket) return true;
+		}
+		return false;
+	}
+
+	//1 when this is the answer to request_id, 0 for a late answer to an older request, -1 on a broken connection
+	int read_response(ShardEndpoint& endpoint, int shard, uint32_t request_id, int num_queries, int k) {
+		uint8_t header_bytes[wire_header_size];
+		if (!recv_all(endpoint.socket, header_bytes, wire_header_size)) return -1;
+		WireHeader header = decode_header(header_bytes);
+		if (header.magic != knn_response_magic || header.k > wire_max_k || header.num_queries > wire_max_queries) return -1;
+		if (header.feature_size != feature_size || header.shard_id != shard || header.shard_count != shard_count()) {
+			cerr << "Worker " << endpoint.host << ":" << endpoint.port << " serves shard " << header.shard_id << "/" << header.shard_count
+				<< " of " << header.feature_size << " columns, the coordinator expects shard " << shard << "/" << shard_count() << endl;
+			return -1;
+		}
+
+		size_t payload = (size_t)header.num_queries * 4 + (size_t)header.num_queries * header.k * wire_neighbour_size;
+		response.resize(payload);
+		if (!recv_all(endpoint.socket, response.data(), payload)) return -1;
+		if (header.request_id != request_id || (int)header.num_queries != num_queries || header.k != k) return 0;
+
+		const uint8_t* counts = response.data();
+		const uint8_t* entries = counts + (size_t)num_queries * 4;
+		for (int q = 0; q < num_queries; q++) {
+			int count = min((int)get_u32(counts + (size_t)q * 4), k);
+			shard_counts[(size_t)shard * num_queries + q] = count;
+			for (int n = 0; n < count; n++) {
+				const uint8_t* entry = entries + ((size_t)q * k + n) * wire_neighbour_size;
+				shard_results[((size_t)shard * num_queries + q) * k + n] = { get_f64(entry), (int)get_u32(entry + 8), (int)get_u32(entry + 12) };
+			}
+		}
+		return 1;
+	}
+};
+#pragma endregion
+
+vector<double> parseLine(const string& line) {
+	vector<double> row;
+	istringstream iss(line);
+	string value;
+
+	while (getline(iss, value, ',')) {
+		try {
+			double num = stod(value);
+			row.push_back(num);
+		}
+		catch (const invalid_argument&) {
+			cerr << "Invalid data in CSV: " << value << endl;
+		}
+	}
+
+	return row;
+}
+
+//ShardedKnn worker <port> <shard_id> <shard_count>
+//ShardedKnn coordinator [--hedge-ms N] <shard@host:port> ...   (list several endpoints per shard for replicas)
+int main(int argc, char* argv[]) {
+	string filename = "diabetes_binary.csv";
+
+	if (!init_sockets()) {
+		cerr << "Cannot initialise sockets" << endl;
+		return 1;
+	}
+
+	if (argc > 4 && string(argv[1]) == "worker") {
+		uint16_t port = (uint16_t)stoi(argv[2]);
+		int shard_id = stoi(argv[3]);
+		int shard_count = stoi(argv[4]);
+		//both travel in 16 bit response fields
+		if (shard_count < 1 || shard_count > UINT16_MAX || shard_id < 0 || shard_id >= shard_count) {
+			cerr << "Shard id must be in [0, shard_count) and shard_count in [1, " << UINT16_MAX << "]" << endl;
+			return 1;
+		}
+
+		ShardWorker worker(shard_id, shard_count);
+		if (!worker.load(filename)) {
+			return 1;
+		}
+		return worker.serve(port);
+	}
+
+	if (argc > 2 && string(argv[1]) == "coordinator") {
+		int hedge_ms = default_hedge_ms;
+		int first_endpoint = 2;
+		if (argc > 4 && string(argv[2]) == "--hedge-ms") {
+			hedge_ms = stoi(argv[3]);
+			first_endpoint = 4;
+		}
+
+		ShardCoordinator coordinator(hedge_ms);
+		for (int i = first_endpoint; i < argc; i++) {
+			if (!coordinator.add_endpoint(argv[i])) {
+				return 1;
+			}
+		}
+
+		const int num_queries = 3;
+		double targets[num_queries][feature_size] = {
+			{ 0.0, 0.0, 0.0, 1.0, 24.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 3.0, 0.0, 0.0, 0.0, 2.0, 5.0, 3.0 },
+			{ 1.0, 1.0, 1.0, 1.0, 30.0, 1.0, 0.0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 5.0, 30.0, 30.0, 1.0, 0.0, 9.0, 5.0, 1.0 },
+			{ 0.0, 1.0, 1.0, 1.0, 28.0, 0.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 4.0, 0.0, 10.0, 1.0, 0.0, 12.0, 6.0, 2.0 }
+		};
+		const double* queries[num_queries] = { targets[0], targets[1], targets[2] };
+		int predictions[num_queries];
+		vector<Neighbour> nearest;
+
+		cout << "Sharded KNN over " << coordinator.shard_count() << " shards: " << endl;
+		if (!coordinator.predict_batch(queries, num_queries, k_value, predictions, nearest)) {
+			return 1;
+		}
+		for (int q = 0; q < num_queries; q++) {
+			cout << "Query " << q + 1 << " First K(" << k_value << ") value: " << endl;
+			for (int n = 0; n < k_value; n++) {
+				const Neighbour& neighbour = nearest[(size_t)q * k_value + n];
+				cout << neighbour.label << ": " << sqrt(neighbour.distance) << " (row " << neighbour.index << ")" << endl;
+			}
+			cout << "Prediction: " << predictions[q] << endl;
+		}
+
+		//throughput and tail latency over repeated batches
+		vector<long long> latencies;
+		chrono::steady_clock::time_point benchBegin = chrono::steady_clock::now();
+		for (int b = 0; b < benchmark_batches; b++) {
+			chrono::steady_clock::time_point batchBegin = chrono::steady_clock::now();
+			if (!coordinator.predict_batch(queries, num_queries, k_value, predictions, nearest)) {
+				return 1;
+			}
+			latencies.push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - batchBegin).count());
+		}
+		double seconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - benchBegin).count() / 1e6;
+		sort(latencies.begin(), latencies.end());
+
+		cout << "Throughput = " << (benchmark_batches * num_queries) / seconds << " queries/s" << endl;
+		cout << "Batch latency p50 = " << latencies[latencies.size() / 2] << "[s], p99 = " << latencies[latencies.size() * 99 / 100] << "[s]" << endl;
+		cout << "Hedged requests = " << coordinator.hedges() << endl;
+		return 0;
+	}
+
+	cerr << "Usage: ShardedKnn worker <port> <shard_id> <shard_count>" << endl;
+	cerr << "       ShardedKnn coordinator [--hedge-ms N] <shard@host:port> ..." << endl;
+	return 1;
+}
@@ -0,0 +1,233 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "FeatureScaler.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//named shared-memory copy of the scaled dataset, so N classifier processes on one host hold one copy
+//layout: one header page (shape + the fitted scaler) followed by rows * feature_size doubles
+//the segment size is rounded up to 2 MB, so a path on a hugetlbfs mount (e.g. /dev/hugepages/knn)
+//can be used as the name to back it with huge pages; a plain name ("/knn") goes to shm_open
+//on Windows the segment is a named pagefile mapping and lives as long as the publisher keeps it open
+//a published segment is never rewritten in place, processes that have it mapped keep reading the old rows
+const char shared_segment_magic[8] = { 'K', 'N', 'N', 'S', 'H', 'M', '1', '\0' };
+const size_t shared_header_size = 4096;
+const size_t shared_segment_alignment = 2 * 1024 * 1024;
+
+struct SharedSegmentHeader {
+	char magic[8];
+	uint32_t feature_size;
+	uint32_t ready; //written last by the publisher, attach refuses a half-written segment
+	uint64_t rows;
+	double offsets[max_feature_size];
+	double scales[max_feature_size];
+	int columns[max_feature_size];
+};
+static_assert(sizeof(SharedSegmentHeader) <= shared_header_size, "shared segment header must fit in its page");
+
+class SharedFeatureStore {
+private:
+	uint8_t* base = nullptr;
+	size_t mapped_size = 0;
+	std::vector<const double*> pointers;
+#ifdef _WIN32
+	HANDLE mapping = nullptr;
+#endif
+
+public:
+	SharedFeatureStore() {}
+	SharedFeatureStore(const SharedFeatureStore&) = delete;
+	SharedFeatureStore& operator=(const SharedFeatureStore&) = delete;
+	~SharedFeatureStore() { detach(); }
+
+	//create (or replace) the segment and copy the scaled rows and the scaler into it
+	//a file (hugetlbfs) is written under a temporary name and renamed over the old one once it is ready,
+	//a shm object is unlinked first and created anew; on Windows a name that is still open is refused
+	bool publish(const std::string& name, const double* const dataset[], int rows, int feature_size, const FeatureScaler& scaler) {
+		detach();
+		if (feature_size > max_feature_size || scaler.feature_size() != feature_size) {
+			return false;
+		}
+		size_t size = segment_size(rows, feature_size);
+		std::string created = name;
+#ifndef _WIN32
+		if (is_file_path(name)) created = name + "." + std::to_string((long long)getpid());
+		else shm_unlink(name.c_str());
+#endif
+		if (!map_segment(created, size, true)) {
+			return false;
+		}
+
+		SharedSegmentHeader* header = reinterpret_cast<SharedSegmentHeader*>(base);
+		std::memset(header, 0, sizeof(SharedSegmentHeader));
+		double* data = reinterpret_cast<double*>(base + shared_header_size);
+		for (int i = 0; i < rows; i++) {
+			std::memcpy(data + (size_t)i * feature_size, dataset[i], feature_size * sizeof(double));
+		}
+		std::memcpy(header->magic, shared_segment_magic, sizeof(header->magic));
+		header->feature_size = (uint32_t)feature_size;
+		header->rows = (uint64_t)rows;
+		scaler.export_transform(header->offsets, header->scales, header->columns);
+		std::atomic_thread_fence(std::memory_order_release);
+		header->ready = 1;
+#ifndef _WIN32
+		if (created != name && rename(created.c_str(), name.c_str()) != 0) {
+			detach();
+			unlink(created.c_str());
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	//map an existing segment read-only, only the header page is touched here
+	bool attach(const std::string& name) {
+		detach();
+		if (!map_segment(name, 0, false)) {
+			return false;
+		}
+		//the row count is checked as 64 bits against the mapped bytes, so no product can overflow
+		const SharedSegmentHeader* header = reinterpret_cast<const SharedSegmentHeader*>(base);
+		bool valid = mapped_size >= shared_header_size
+			&& std::memcmp(header->magic, shared_segment_magic, sizeof(header->magic)) == 0
+			&& header->ready == 1
+			&& header->feature_size >= 1 && header->feature_size <= (uint32_t)max_feature_size
+			&& header->rows <= (uint64_t)std::numeric_limits<int>::max()
+			&& header->rows <= (mapped_size - shared_header_size) / (header->feature_size * sizeof(double));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (!valid) {
+			detach();
+			return false;
+		}
+		return true;
+	}
+
+	void detach() {
+		pointers.clear();
+		if (base == nullptr) return;
+#ifdef _WIN32
+		UnmapViewOfFile(base);
+		CloseHandle(mapping);
+		mapping = nullptr;
+#else
+		munmap(base, mapped_size);
+#endif
+		base = nullptr;
+		mapped_size = 0;
+	}
+
+	//drop the name, mappings that are still open stay valid (no-op on Windows)
+	static void remove(const std::string& name) {
+#ifndef _WIN32
+		if (is_file_path(name)) unlink(name.c_str());
+		else shm_unlink(name.c_str());
+#endif
+	}
+
+	int rows() const { return base ? (int)header()->rows : 0; }
+	int feature_size() const { return base ? (int)header()->feature_size : 0; }
+	const double* data() const { return reinterpret_cast<const double*>(base + shared_header_size); }
+
+	//row pointer table for the predict_class signatures, built on first use in this process
+	const double* const* row_pointers() {
+		if (pointers.empty() && base != nullptr) {
+			pointers.resize(rows());
+			for (int i = 0; i < rows(); i++) {
+				pointers[i] = data() + (size_t)i * feature_size();
+			}
+		}
+		return pointers.data();
+	}
+
+	//the scaler fitted by the publisher, queries must go through the same transform
+	bool load_scaler(FeatureScaler& scaler) const {
+		return base != nullptr && scaler.import_transform(header()->offsets, header()->scales, header()->columns, feature_size());
+	}
+
+private:
+	const SharedSegmentHeader* header() const { return reinterpret_cast<const SharedSegmentHeader*>(base); }
+
+	static size_t segment_size(int rows, int feature_size) {
+		size_t size = shared_header_size + (size_t)rows * feature_size * sizeof(double);
+		return (size + shared_segment_alignment - 1) / shared_segment_alignment * shared_segment_alignment;
+	}
+
+	//"/name" is a POSIX shared-memory object, anything with a directory in it is a file (hugetlbfs)
+	static bool is_file_path(const std::string& name) {
+		return name.find('/', 1) != std::string::npos;
+	}
+
+	//create = true makes a writable segment of size bytes, otherwise the whole segment is mapped read-only
+	bool map_segment(const std::string& name, size_t size, bool create) {
+#ifdef _WIN32
+		std::string windows_name = "Local\\" + name;
+		if (create) {
+			mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+				(DWORD)((uint64_t)size >> 32), (DWORD)(size & 0xFFFFFFFF), windows_name.c_str());
+			//an existing mapping would be handed back as it is, with readers still on it
+			if (mapping != nullptr && GetLastError() == ERROR_ALREADY_EXISTS) {
+				CloseHandle(mapping);
+				mapping = nullptr;
+				return false;
+			}
+		}
+		else {
+			mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, windows_name.c_str());
+		}
+		if (mapping == nullptr) return false;
+		void* view = MapViewOfFile(mapping, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, size);
+		if (view == nullptr) {
+			CloseHandle(mapping);
+			mapping = nullptr;
+			return false;
+		}
+		if (!create) {
+			MEMORY_BASIC_INFORMATION info;
+			VirtualQuery(view, &info, sizeof(info));
+			size = info.RegionSize;
+		}
+#else
+		//a new segment is always a new object, an existing one is never truncated under its readers
+		int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDONLY;
+		int fd = is_file_path(name) ? open(name.c_str(), flags, 0644) : shm_open(name.c_str(), flags, 0644);
+		if (fd < 0) return false;
+		if (create && ftruncate(fd, (off_t)size) != 0) {
+			close(fd);
+			return false;
+		}
+		if (!create) {
+			struct stat info;
+			if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+				close(fd);
+				return false;
+			}
+			size = (size_t)info.st_size;
+		}
+		void* view = mmap(nullptr, size, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (view == MAP_FAILED) return false;
+#ifdef MADV_HUGEPAGE
+		//transparent huge pages for a shm segment, ignored where shmem THP is off
+		madvise(view, size, MADV_HUGEPAGE);
+#endif
+#endif
+		base = static_cast<uint8_t*>(view);
+		mapped_size = size;
+		return true;
+	}
+};
@@ -7,140 +7,983 @@
 #include <chrono>
 #include <vector>
 #include <mutex>
+#include <random>
+#include <limits>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <condition_variable>
 #include "../include/taskflow/taskflow.hpp"
 #include "../include/taskflow/algorithm/for_each.hpp"
 #include "../include/taskflow/algorithm/sort.hpp"
+#include "../include/taskflow/algorithm/reduce.hpp"
+#include "../include/taskflow/algorithm/pipeline.hpp"
+#include "../include/taskflow/algorithm/data_pipeline.hpp"
+#include "FeatureScaler.h"
+#include "KnnScratch.h"
+#include "KnnTopK.h"
+#include "KnnDistance.h"
+#include "TraceRecorder.h"
+#include "KnnMetric.h"
+#include "KnnAutotuner.h"
+#include "BinaryDataset.h"
 
 using namespace std;
 using namespace chrono;
 using namespace tf;
 
-//the number that serial sort again after the parallel sort to resolve the race condition
-const int num_record_to_sort = 20;
+//number of row ranges a query is scanned in, each keeps its own top-K before the merge
+const int num_scan_chunks = 64;
+//number of CSV rows parsed per block in streaming mode
+const int stream_block_rows = 4096;
+//number of row ranges the scaling statistics are computed over in parallel
+const int num_scaling_chunks = 64;
+//store the features by decreasing scaled variance so the early-exit distance loop drops rows sooner
+//(under ZScore every column has unit variance and the file order is kept)
+const bool reorder_features = true;
+//IVF index: number of k-means clusters, k-means rounds and clusters probed per query
+const int ivf_num_clusters = 256;
+const int ivf_kmeans_iterations = 10;
+const int ivf_nprobe = 8;
+const unsigned ivf_seed = 42;
+//slack taken off every cluster lower bound so rounding never prunes a cluster that holds a neighbour
+const double ivf_bound_slack = 1e-9;
+//measured parallel settings are kept here between runs, --retune measures them again
+const string tuning_profile_filename = "knn_profile.txt";
+//queries timed per candidate setting during calibration
+const int calibration_queries = 3;
+//bulk scoring: queries scored together by one task, and stored rows scanned by all of them before moving on
+//(a block of rows stays in cache while every query of the tile reads it)
+const int bulk_query_tile = 32;
+const int bulk_row_block = 512;
+//chunk tasks per asynchronous query, and rows scanned between two checks of its cancel flag
+const int async_scan_chunks = 16;
+const int async_cancel_check_rows = 2048;
+
+//executor observer that turns every task run into a span on its worker's row of the trace
+//the partitions for_each_index spawns are not reported to observers, so the chunk bodies record their
+//own TraceSpan; both use the recorder's id of the running thread, so they land on the same row
+class ChromeTraceObserver : public ObserverInterface {
+private:
+	TraceRecorder& recorder;
+	vector<vector<long long>> started; //begin times of the tasks running on each worker, nested runs stack
+
+public:
+	ChromeTraceObserver(TraceRecorder& recorder) : recorder(recorder) {}
+
+	void set_up(size_t num_workers) override final {
+		started.assign(num_workers, vector<long long>());
+	}
+
+	void on_entry(WorkerView w, TaskView) override final {
+		started[w.id()].push_back(recorder.now_us());
+	}
+
+	void on_exit(WorkerView w, TaskView tv) override final {
+		long long begin = started[w.id()].back();
+		started[w.id()].pop_back();
+		string name = tv.name().empty() ? string(to_string(tv.type())) : tv.name();
+		recorder.record(name, "taskflow", trace_process_taskflow, recorder.thread_id(), begin, recorder.now_us());
+	}
+};
 
+//Metric is one of the policies of KnnMetric.h, the scan is compiled for it
+template <typename Metric = SquaredL2>
 class TaskflowParallelKnn {
 private:
 	int neighbours_number;
+	Metric metric;
+	TuningProfile profile;
+	ChunkTuner tuner;
+
+	//the worker pool and all task graphs live as long as the object
+	//a query only rebinds the query pointer and picks the graph of the tuner's chunk count, nothing is rebuilt per call
+	Executor executor;
+	Taskflow taskflows[chunk_tuner_candidates];	//single query, one per tuner chunk count: distance + chunk top-K -> merge -> vote
+	Taskflow batchflow;	//many queries: pipeline so successive queries overlap across stages
+
+	//dataset the graphs were built for
+	const double* const* dataset = nullptr;
+	int dataset_size = 0;
+	int feature_size = 0;
+
+	//query of the current run and its result
+	const double* query = nullptr;
+	int prediction = -1;
+
+	//top-K buffers of every chunk (for the largest chunk count, the graphs share them) and of the merged result,
+	//sized once when the graphs are built
+	vector<Neighbour> chunk_storage;
+	vector<TopK> chunk_best;
+	vector<Neighbour> merged_storage;
+	TopK merged;
+
+	//batch state, one top-K buffer per pipeline line
+	const double* const* batch_queries = nullptr;
+	int* batch_predictions = nullptr;
+	int batch_size = 0;
+	vector<Neighbour> line_storage;
+	vector<TopK> line_best;
+	Pipeline<Pipe<>, Pipe<>, Pipe<>> pipeline;
 
 public:
-	TaskflowParallelKnn(int k) : neighbours_number(k) {}
+	TaskflowParallelKnn(int k, Metric metric = Metric(), const TuningProfile& profile = default_tuning_profile(0, 0, num_scan_chunks)) :
+		neighbours_number(k),
+		metric(metric),
+		profile(profile),
+		tuner(profile.scan_chunks),
+		executor(profile.threads),
+		merged_storage(k),
+		line_storage(executor.num_workers() * k),
+		line_best(executor.num_workers()),
+		pipeline(executor.num_workers(),
+			//stage 1: hand out the next query of the batch
+			Pipe<>{ PipeType::SERIAL, [this](Pipeflow& pf) {
+				if ((int)pf.token() >= batch_size) {
+					pf.stop();
+				}
+			} },
+			//stage 2: full scan of one query, several queries are scanned at the same time
+			Pipe<>{ PipeType::PARALLEL, [this](Pipeflow& pf) {
+				TraceSpan span("pipeline scan", "taskflow", trace_process_taskflow);
+				TopK& best = line_best[pf.line()];
+				best = TopK(&line_storage[pf.line() * neighbours_number], neighbours_number);
+				scan_rows(this->dataset, batch_queries[pf.token()], 0, this->dataset_size, this->feature_size, best);
+			} },
+			//stage 3: rank and vote, in query order
+			Pipe<>{ PipeType::SERIAL, [this](Pipeflow& pf) {
+				TopK& best = line_best[pf.line()];
+				best.sort();
+				batch_predictions[pf.token()] = vote(best.data(), best.size());
+			} }) {
+		batchflow.composed_of(pipeline).name("knn pipeline");
+	}
 
-	int predict_class(double* dataset[], const double* target, int dataset_size, int feature_size) {
-		double* distances[3];
-		int zeros_count = 0;
-		int ones_count = 0;
+	//record every task this object's executor runs from now on
+	void trace(TraceRecorder& recorder) {
+		executor.make_observer<ChromeTraceObserver>(recorder);
+	}
 
-		// Allocate memory for distances and index order
-		distances[0] = new double[dataset_size]; //euclidean distance 
-		distances[1] = new double[dataset_size]; //label : prediction 0 or 1
-		distances[2] = new double[dataset_size]; //index number 
+	int predict_class(const double* const dataset[], const double* target, int dataset_size, int feature_size) {
+		run_query(dataset, target, dataset_size, feature_size);
 
-		double* index_order = new double[dataset_size];
+		cout << "Top 3 Nearest K value: " << endl;
+		for (int i = 0; i < merged.size(); i++) {
+			cout << merged[i].label << ": " << Metric::display(merged[i].distance) << endl;
+		}
 
-		Taskflow taskflow;
-		Executor executor;
-
-		//Create a task into taskflow not execute immediately
-		//Taskflow parallel iteration --> 4 parameter
-		//(first_index, last_index, step_size, lambda function)
-		taskflow.for_each_index(0, dataset_size, 1, [=, &distances](int i) {
-			distances[0][i] = euclidean_distance(target, dataset[i], feature_size);
-			distances[1][i] = dataset[i][0]; // Store outcome label
-			distances[2][i] = i; // Store index
-			});
+		return prediction;
+	}
 
-		//Execute the task within the taskflow and wiat all task is complete 
-		executor.run(taskflow).wait();
+	//classify many queries with the same graph, predictions[i] receives the class of queries[i]
+	void predict_batch(const double* const dataset[], const double* const queries[], int num_queries, int* predictions, int dataset_size, int feature_size) {
+		if (!profile.batch_pipeline) {
+			//intra-query: every query gets all the workers, one after another
+			for (int q = 0; q < num_queries; q++) {
+				predictions[q] = run_query(dataset, queries[q], dataset_size, feature_size);
+			}
+			return;
+		}
+		bind(dataset, dataset_size, feature_size);
 
-		//Call for sorting --> Parallel sorting implement 
-		selection_sort(distances, dataset_size);
+		batch_queries = queries;
+		batch_predictions = predictions;
+		batch_size = num_queries;
+		pipeline.reset();
+		executor.run(batchflow).wait();
+	}
 
-		//for (int i = 0; i < 10; i++) {
-		//	cout << distances[0][i] << "," << distances[1][i] << "," << distances[2][i] << endl;
-		//}
+	bool refined_online() const { return profile.threads > 1 && tuner.refined(); }
 
-		cout << "Top 3 Nearest K value: " << endl;
+	//settings in use, with the chunk count the online tuner found fastest so far
+	TuningProfile tuned_profile() const {
+		TuningProfile tuned = profile;
+		tuned.scan_chunks = tuner.best_chunks();
+		if (tuner.best_average() > 0.0) tuned.micros_per_query = tuner.best_average();
+		return tuned;
+	}
 
-		int count = 0;
-		// Count label occurrences in the K nearest neighbors
-		for (int i = 0; count < neighbours_number; i++) {
-			if (distances[1][i] == 0 && distances[0][i] > 0) {
-				zeros_count += 1;
-				cout << "0: " << distances[0][i] << endl;
-				count++;
+	//classify one query without printing, fills merged
+	int run_query(const double* const dataset[], const double* target, int dataset_size, int feature_size) {
+		if (profile.threads <= 1) {
+			//small data: the workers cost more than they save, scan on the calling thread
+			merged = TopK(merged_storage.data(), neighbours_number);
+			scan_rows(dataset, target, 0, dataset_size, feature_size, merged);
+			merged.sort();
+			prediction = vote(merged.data(), merged.size());
+			return prediction;
+		}
+
+		bind(dataset, dataset_size, feature_size);
+
+		//rebind the query and run the prebuilt graph of the chunk count the tuner picks
+		query = target;
+		int candidate = tuner.next();
+		steady_clock::time_point begin = steady_clock::now();
+		executor.run(taskflows[candidate]).wait();
+		tuner.report((double)duration_cast<microseconds>(steady_clock::now() - begin).count());
+		return prediction;
+	}
+
+private:
+	//build the single query graph of every tuner chunk count once per dataset
+	void bind(const double* const dataset[], int dataset_size, int feature_size) {
+		if (this->dataset == dataset && this->dataset_size == dataset_size && this->feature_size == feature_size) {
+			return;
+		}
+		this->dataset = dataset;
+		this->dataset_size = dataset_size;
+		this->feature_size = feature_size;
+		chunk_storage.assign((size_t)tuner.largest_chunks() * neighbours_number, Neighbour{});
+		chunk_best.assign(tuner.largest_chunks(), TopK());
+
+		for (int candidate = 0; candidate < tuner.candidate_count(); candidate++) {
+			build_graph(taskflows[candidate], tuner.chunks(candidate));
+		}
+	}
+
+	void build_graph(Taskflow& taskflow, int scan_chunks) {
+		int rows_per_chunk = (dataset_size + scan_chunks - 1) / scan_chunks;
+		taskflow.clear();
+
+		//distance and per-chunk top-K are fused, each chunk keeps only its K best rows
+		//so no dataset sized distance array has to be written and sorted
+		auto scanChunk = [this, rows_per_chunk](int c) {
+			TraceSpan span("distance chunk", "taskflow", trace_process_taskflow);
+			chunk_best[c] = TopK(&chunk_storage[c * neighbours_number], neighbours_number);
+			int start = c * rows_per_chunk;
+			int end = min(this->dataset_size, start + rows_per_chunk);
+			scan_rows(this->dataset, query, start, end, this->feature_size, chunk_best[c]);
+		};
+		Task scanTask = (profile.partitioner == PartitionerKind::Static)
+			? taskflow.for_each_index(0, scan_chunks, 1, scanChunk, StaticPartitioner())
+			: taskflow.for_each_index(0, scan_chunks, 1, scanChunk, GuidedPartitioner());
+		scanTask.name("distance + chunk top-K");
+
+		Task mergeTask = taskflow.emplace([this, scan_chunks]() {
+			merged = TopK(merged_storage.data(), neighbours_number);
+			for (int c = 0; c < scan_chunks; c++) {
+				merged.merge(chunk_best[c]);
 			}
-			else if (distances[1][i] == 1 && distances[0][i] > 0) {
-				ones_count += 1;
-				cout << "1: " << distances[0][i] << endl;
-				count++;
+			merged.sort();
+			}).name("merge");
+
+		Task voteTask = taskflow.emplace([this]() {
+			prediction = vote(merged.data(), merged.size());
+			}).name("vote");
+
+		scanTask.precede(mergeTask);
+		mergeTask.precede(voteTask);
+	}
+
+	//offer every row in [start, end) to best, exact duplicates of the query (distance 0) are not neighbours
+	void scan_rows(const double* const dataset[], const double* target, int start, int end, int feature_size, TopK& best) const {
+		for (int i = start; i < end; i++) {
+			if (dataset[i] == target) continue; // do not use the same point
+			//once K rows are kept, a row is dropped as soon as its partial sum passes the K-th best
+			double distance = metric.rank(target, dataset[i], feature_size, best.bound());
+			if (distance > 0) {
+				best.offer(distance, i, (int)dataset[i][0]);
 			}
 		}
+	}
+};
 
-		int prediction = (zeros_count > ones_count) ? 0 : 1;
 
-		// Clean up memory
-		delete[] distances[0];
-		delete[] distances[1];
-		delete[] distances[2];
+enum class AsyncStatus { Completed, Cancelled };
 
-		return prediction;
-	}
+struct AsyncKnnResult {
+	AsyncStatus status;
+	int prediction;				//-1 when cancelled or no neighbour was found
+	vector<Neighbour> nearest;	//ascending rank distances, empty when cancelled
+};
+
+//non-blocking KNN on an executor shared with the rest of the program
+//submit() splits the scan into async_scan_chunks tasks and returns at once; the last chunk to finish merges,
+//votes, fulfils the future and runs the completion callback, so no worker ever blocks waiting for another
+//every query runs on the same worker threads, many queries in flight never start threads of their own
+template <typename Metric = SquaredL2>
+class TaskflowAsyncKnn {
+public:
+	using Callback = std::function<void(const AsyncKnnResult&)>;
 
 private:
-	static void selection_sort(double** distances, int dataset_size) {
-		Taskflow taskflow;
-		Executor executor;
+	struct QueryState {
+		vector<double> target;		//copy, the caller's buffer may be gone before the scan runs
+		std::atomic<bool> cancelled{ false };
+		std::atomic<bool> stopped_early{ false };	//a chunk saw the cancel before the end of its rows
+		std::atomic<int> remaining{ async_scan_chunks };
+		vector<Neighbour> storage;	//async_scan_chunks * k
+		vector<TopK> chunk_best;
+		std::promise<AsyncKnnResult> promise;
+		Callback callback;
+	};
 
-		//Taskflow parallel iteration --> 4 parameter
-		//(first_index, last_index, step_size, lambda function)
-		taskflow.for_each_index(0, dataset_size, 1, [=, &distances](int i) {
-			int min_index = i;
-			for (int j = i + 1; j < dataset_size; j++) {
-				if (distances[0][j] < distances[0][min_index]) {
-					min_index = j;
+public:
+	//handle of one query in flight
+	class Query {
+	private:
+		std::shared_ptr<QueryState> state;
+		std::future<AsyncKnnResult> future;
+
+	public:
+		Query() {}
+		Query(std::shared_ptr<QueryState> state) : state(state), future(state->promise.get_future()) {}
+
+		//the scan stops at its next check, the result then has status Cancelled; a cancel that comes after the
+		//last check of every chunk changes nothing, the result is the complete one
+		void cancel() { if (state) state->cancelled.store(true, std::memory_order_relaxed); }
+		bool ready() const { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+		void wait() const { future.wait(); }
+		AsyncKnnResult get() { return future.get(); }
+	};
+
+private:
+	int neighbours_number;
+	Metric metric;
+	Executor& executor;
+
+	const double* const* dataset;
+	int dataset_size;
+	int feature_size;
+
+	//queries whose chunks have not all finished, the destructor waits for them
+	std::mutex in_flight_lock;
+	std::condition_variable in_flight_done;
+	int in_flight = 0;
+
+public:
+	//the dataset must stay unchanged while queries are in flight
+	TaskflowAsyncKnn(Executor& executor, const double* const dataset[], int dataset_size, int feature_size, int k, Metric metric = Metric()) :
+		neighbours_number(k), metric(metric), executor(executor),
+		dataset(dataset), dataset_size(dataset_size), feature_size(feature_size) {}
+
+	~TaskflowAsyncKnn() {
+		std::unique_lock<std::mutex> guard(in_flight_lock);
+		in_flight_done.wait(guard, [this]() { return in_flight == 0; });
+	}
+
+	TaskflowAsyncKnn(const TaskflowAsyncKnn&) = delete;
+	TaskflowAsyncKnn& operator=(const TaskflowAsyncKnn&) = delete;
+
+	//callback runs on the worker that finished the query, right before the future becomes ready
+	Query submit(const double* target, Callback callback = Callback()) {
+		std::shared_ptr<QueryState> state = std::make_shared<QueryState>();
+		state->target.assign(target, target + feature_size);
+		state->storage.resize((size_t)async_scan_chunks * neighbours_number);
+		state->chunk_best.resize(async_scan_chunks);
+		state->callback = std::move(callback);
+		Query query(state);
+
+		{
+			std::lock_guard<std::mutex> guard(in_flight_lock);
+			in_flight++;
+		}
+		int rows_per_chunk = (dataset_size + async_scan_chunks - 1) / async_scan_chunks;
+		for (int c = 0; c < async_scan_chunks; c++) {
+			executor.silent_async("async chunk", [this, state, c, rows_per_chunk]() {
+				int start = c * rows_per_chunk;
+				int end = min(dataset_size, start + rows_per_chunk);
+				scan_chunk(*state, c, start, end);
+				if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					finish(*state);
 				}
+			});
+		}
+		return query;
+	}
+
+private:
+	void scan_chunk(QueryState& state, int c, int start, int end) const {
+		TraceSpan span("async chunk", "taskflow", trace_process_taskflow);
+		TopK& best = state.chunk_best[c];
+		best = TopK(&state.storage[(size_t)c * neighbours_number], neighbours_number);
+		const double* target = state.target.data();
+		for (int block = start; block < end; block += async_cancel_check_rows) {
+			if (state.cancelled.load(std::memory_order_relaxed)) {
+				state.stopped_early.store(true, std::memory_order_relaxed);
+				return;
 			}
+			int block_end = min(end, block + async_cancel_check_rows);
+			for (int i = block; i < block_end; i++) {
+				double distance = metric.rank(target, dataset[i], feature_size, best.bound());
+				if (distance > 0) {
+					best.offer(distance, i, (int)dataset[i][0]);
+				}
+			}
+		}
+	}
 
-			if (min_index != i) {
-				// Swap distances for all dimensions 
-				for (int x = 0; x < 3; x++) {
-					double temp = distances[x][i];
-					distances[x][i] = distances[x][min_index];
-					distances[x][min_index] = temp;
+	//runs once per query, on the worker of its last chunk
+	//the future is always fulfilled and the query always leaves in_flight, even when the callback throws
+	void finish(QueryState& state) {
+		AsyncKnnResult result;
+		if (state.stopped_early.load(std::memory_order_relaxed)) {
+			result.status = AsyncStatus::Cancelled;
+			result.prediction = -1;
+		}
+		else {
+			vector<Neighbour> merged_storage(neighbours_number);
+			TopK merged(merged_storage.data(), neighbours_number);
+			for (int c = 0; c < async_scan_chunks; c++) {
+				merged.merge(state.chunk_best[c]);
+			}
+			merged.sort();
+			result.status = AsyncStatus::Completed;
+			result.prediction = (merged.size() > 0) ? vote(merged.data(), merged.size()) : -1;
+			result.nearest.assign(merged.data(), merged.data() + merged.size());
+		}
+
+		if (state.callback) {
+			try {
+				state.callback(result);
+			}
+			catch (...) {
+				cerr << "Async KNN completion callback threw, the result is still delivered" << endl;
+			}
+		}
+		state.promise.set_value(std::move(result));
+
+		std::lock_guard<std::mutex> guard(in_flight_lock);
+		if (--in_flight == 0) in_flight_done.notify_all();
+	}
+};
+
+
+//inverted-file index: the stored rows are clustered by k-means and every cluster is copied contiguously,
+//a query only scans the rows of the clusters nearest to it instead of the whole dataset
+//in exact mode the remaining clusters are visited by their lower bound (distance to the centroid minus
+//the cluster radius, triangle inequality) until no cluster left can hold a row closer than the K-th best
+//inside a cluster the same inequality on the row's own distance to the centroid skips most rows
+class TaskflowIvfIndex {
+private:
+	int neighbours_number;
+	int num_clusters = 0;
+	int feature_size = 0;
+	Executor executor;
+
+	vector<double> centroids;	//num_clusters * feature_size, column 0 unused
+	vector<double> radius;		//largest distance (not squared) from a member to its centroid
+	vector<int> cluster_start;	//rows of cluster c are [cluster_start[c], cluster_start[c + 1])
+	vector<double> rows;		//cluster-major copy of the stored rows
+	vector<int> row_index;		//dataset index of every copied row
+	vector<double> member_distance;	//distance of every copied row to its centroid, ascending within a cluster
+
+	//rows visited by the last query
+	int rows_scanned = 0;
+
+	struct ClusterOrder {
+		double centroid_distance;
+		double lower_bound;
+		int cluster;
+	};
+
+public:
+	TaskflowIvfIndex(int k) : neighbours_number(k) {}
+
+	//record every task this object's executor runs from now on (k-means rounds show load imbalance)
+	void trace(TraceRecorder& recorder) {
+		executor.make_observer<ChromeTraceObserver>(recorder);
+	}
+
+	//cluster the stored rows, returns the final sum of squared distances of the rows to their centroids
+	double build(const double* const dataset[], int dataset_size, int feature_size, int clusters, int iterations) {
+		this->feature_size = feature_size;
+		num_clusters = min(clusters, dataset_size);
+		seed_centroids(dataset, dataset_size);
+
+		int rows_per_chunk = (dataset_size + num_scan_chunks - 1) / num_scan_chunks;
+		vector<int> assignment(dataset_size);
+		vector<double> chunk_sums((size_t)num_scan_chunks * num_clusters * feature_size);
+		vector<int> chunk_counts((size_t)num_scan_chunks * num_clusters);
+		vector<double> chunk_inertia(num_scan_chunks);
+		double inertia = 0.0;
+
+		//each chunk assigns its rows to the nearest centroid and sums them per cluster, no race condition
+		auto assign_chunk = [&](int c) {
+			TraceSpan span("assign chunk", "taskflow", trace_process_taskflow);
+			double* sums = &chunk_sums[(size_t)c * num_clusters * this->feature_size];
+			int* counts = &chunk_counts[(size_t)c * num_clusters];
+			fill(sums, sums + (size_t)num_clusters * this->feature_size, 0.0);
+			fill(counts, counts + num_clusters, 0);
+			chunk_inertia[c] = 0.0;
+
+			int start = c * rows_per_chunk;
+			int end = min(dataset_size, start + rows_per_chunk);
+			for (int i = start; i < end; i++) {
+				int nearest = 0;
+				double nearest_distance = numeric_limits<double>::infinity();
+				for (int m = 0; m < num_clusters; m++) {
+					double distance = bounded_squared_distance(dataset[i], centroid(m), this->feature_size, nearest_distance);
+					if (distance < nearest_distance) {
+						nearest_distance = distance;
+						nearest = m;
+					}
+				}
+				assignment[i] = nearest;
+				counts[nearest]++;
+				chunk_inertia[c] += nearest_distance;
+				double* sum = sums + (size_t)nearest * this->feature_size;
+				for (int j = 1; j < this->feature_size; j++) {
+					sum[j] += dataset[i][j];
+				}
+			}
+		};
+
+		//one k-means round: assign -> (total inertia, new centroids)
+		Taskflow kmeansflow;
+		Task resetTask = kmeansflow.emplace([&]() { inertia = 0.0; }).name("reset");
+		Task assignTask = kmeansflow.for_each_index(0, num_scan_chunks, 1, assign_chunk).name("assign");
+		Task inertiaTask = kmeansflow.reduce(chunk_inertia.begin(), chunk_inertia.end(), inertia, plus<double>()).name("inertia");
+		Task updateTask = kmeansflow.for_each_index(0, num_clusters, 1, [&](int m) {
+			double* mean = &centroids[(size_t)m * this->feature_size];
+			long long count = 0;
+			fill(mean, mean + this->feature_size, 0.0);
+			for (int c = 0; c < num_scan_chunks; c++) {
+				const double* sum = &chunk_sums[((size_t)c * num_clusters + m) * this->feature_size];
+				for (int j = 1; j < this->feature_size; j++) {
+					mean[j] += sum[j];
 				}
+				count += chunk_counts[(size_t)c * num_clusters + m];
 			}
+			//an empty cluster keeps its previous centroid
+			if (count == 0) {
+				copy(previous.begin() + (size_t)m * this->feature_size, previous.begin() + (size_t)(m + 1) * this->feature_size, mean);
+				return;
+			}
+			for (int j = 1; j < this->feature_size; j++) {
+				mean[j] /= count;
+			}
+			}).name("update centroids");
+		Task keepTask = kmeansflow.emplace([&]() { previous = centroids; }).name("keep centroids");
+		resetTask.precede(assignTask);
+		assignTask.precede(inertiaTask, keepTask);
+		keepTask.precede(updateTask);
+
+		//last pass assigns the rows to the final centroids without moving them
+		Taskflow assignflow;
+		Task finalResetTask = assignflow.emplace([&]() { inertia = 0.0; }).name("reset");
+		Task finalAssignTask = assignflow.for_each_index(0, num_scan_chunks, 1, assign_chunk).name("assign");
+		Task finalInertiaTask = assignflow.reduce(chunk_inertia.begin(), chunk_inertia.end(), inertia, plus<double>()).name("inertia");
+		finalResetTask.precede(finalAssignTask);
+		finalAssignTask.precede(finalInertiaTask);
+
+		executor.run_n(kmeansflow, iterations).wait();
+		executor.run(assignflow).wait();
+
+		arrange(dataset, dataset_size, assignment);
+		return inertia;
+	}
+
+	//scan the nprobe clusters with the nearest centroids, exact = true keeps going until the lower bounds rule out the rest
+	int predict_class(const double* target, int nprobe, bool exact) {
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		Neighbour* storage = scratch.allocate<Neighbour>(neighbours_number);
+		ClusterOrder* order = scratch.allocate<ClusterOrder>(num_clusters);
+
+		for (int m = 0; m < num_clusters; m++) {
+			double distance = sqrt(squared_distance(target, centroid(m), feature_size));
+			order[m] = { distance, max(0.0, distance - radius[m] - ivf_bound_slack), m };
+		}
+		sort(order, order + num_clusters, [](const ClusterOrder& a, const ClusterOrder& b) {
+			return a.centroid_distance < b.centroid_distance;
 			});
 
+		TopK best(storage, neighbours_number);
+		rows_scanned = 0;
+		int probed = min(nprobe, num_clusters);
+		for (int p = 0; p < probed; p++) {
+			scan_cluster(target, order[p].cluster, order[p].centroid_distance, best);
+		}
+
+		if (exact) {
+			sort(order + probed, order + num_clusters, [](const ClusterOrder& a, const ClusterOrder& b) {
+				return a.lower_bound < b.lower_bound;
+				});
+			for (int p = probed; p < num_clusters; p++) {
+				if (order[p].lower_bound * order[p].lower_bound > best.bound()) break;
+				scan_cluster(target, order[p].cluster, order[p].centroid_distance, best);
+			}
+		}
+		best.sort();
+
+		cout << "Top 3 Nearest K value: " << endl;
+		for (int i = 0; i < best.size(); i++) {
+			cout << best[i].label << ": " << sqrt(best[i].distance) << endl;
+		}
+
+		return (best.size() > 0) ? vote(best.data(), best.size()) : -1;
+	}
+
+	int last_rows_scanned() const { return rows_scanned; }
+	int clusters() const { return num_clusters; }
+
+private:
+	vector<double> previous; //centroids of the previous round
+
+	const double* centroid(int m) const { return &centroids[(size_t)m * feature_size]; }
+
+	//distinct random rows as the first centroids, duplicated rows would only give empty clusters
+	void seed_centroids(const double* const dataset[], int dataset_size) {
+		centroids.assign((size_t)num_clusters * feature_size, 0.0);
+		mt19937 generator(ivf_seed);
+		uniform_int_distribution<int> pick(0, dataset_size - 1);
+		int seeded = 0;
+		for (int attempt = 0; seeded < num_clusters && attempt < num_clusters * 100; attempt++) {
+			const double* row = dataset[pick(generator)];
+			bool duplicate = false;
+			for (int m = 0; m < seeded && !duplicate; m++) {
+				duplicate = squared_distance(row, centroid(m), feature_size) == 0.0;
+			}
+			if (!duplicate) {
+				copy(row, row + feature_size, centroids.begin() + (size_t)seeded * feature_size);
+				seeded++;
+			}
+		}
+		num_clusters = seeded;
+		centroids.resize((size_t)num_clusters * feature_size);
+		previous = centroids;
+	}
+
+	//copy the rows cluster by cluster, sorted by their distance to the centroid, and measure the radius of every cluster
+	void arrange(const double* const dataset[], int dataset_size, const vector<int>& assignment) {
+		cluster_start.assign(num_clusters + 1, 0);
+		for (int i = 0; i < dataset_size; i++) {
+			cluster_start[assignment[i] + 1]++;
+		}
+		for (int m = 0; m < num_clusters; m++) {
+			cluster_start[m + 1] += cluster_start[m];
+		}
+
+		rows.resize((size_t)dataset_size * feature_size);
+		row_index.resize(dataset_size);
+		vector<int> next(cluster_start.begin(), cluster_start.end() - 1);
+		for (int i = 0; i < dataset_size; i++) {
+			int slot = next[assignment[i]]++;
+			copy(dataset[i], dataset[i] + feature_size, rows.begin() + (size_t)slot * feature_size);
+			row_index[slot] = i;
+		}
+
+		radius.assign(num_clusters, 0.0);
+		member_distance.resize(dataset_size);
+		Taskflow taskflow;
+		taskflow.for_each_index(0, num_clusters, 1, [this](int m) {
+			int first = cluster_start[m];
+			int count = cluster_start[m + 1] - first;
+			vector<pair<double, int>> members(count);
+			for (int r = 0; r < count; r++) {
+				members[r] = { sqrt(squared_distance(&rows[(size_t)(first + r) * feature_size], centroid(m), feature_size)), r };
+			}
+			sort(members.begin(), members.end());
+
+			vector<double> cluster_rows(rows.begin() + (size_t)first * feature_size, rows.begin() + (size_t)(first + count) * feature_size);
+			vector<int> cluster_index(row_index.begin() + first, row_index.begin() + first + count);
+			for (int r = 0; r < count; r++) {
+				int source = members[r].second;
+				copy(cluster_rows.begin() + (size_t)source * feature_size, cluster_rows.begin() + (size_t)(source + 1) * feature_size, rows.begin() + (size_t)(first + r) * feature_size);
+				row_index[first + r] = cluster_index[source];
+				member_distance[first + r] = members[r].first;
+			}
+			radius[m] = (count > 0) ? members[count - 1].first : 0.0;
+			});
 		executor.run(taskflow).wait();
+	}
 
-		//Serial Sort again to resolve the race condition but the number sort is the first 20 records
-		for (int i = 0; i < num_record_to_sort; i++) {
-			int min_index = i;
-			for (int j = i + 1; j < dataset_size; j++) {
-				if (distances[0][j] < distances[0][min_index]) {
-					min_index = j;
-				}
+	//|d(query, centroid) - d(row, centroid)| is a lower bound of d(query, row), rows it rules out are not touched
+	void scan_cluster(const double* target, int m, double centroid_distance, TopK& best) {
+		for (int r = cluster_start[m]; r < cluster_start[m + 1]; r++) {
+			double gap = fabs(centroid_distance - member_distance[r]) - ivf_bound_slack;
+			if (gap > 0 && gap * gap > best.bound()) {
+				//rows are sorted by member_distance, once they are past the query the gap only grows
+				if (member_distance[r] > centroid_distance) break;
+				continue;
+			}
+			const double* row = &rows[(size_t)r * feature_size];
+			double distance = bounded_squared_distance(target, row, feature_size, best.bound());
+			if (distance > 0) {
+				best.offer(distance, row_index[r], (int)row[0]);
 			}
+			rows_scanned++;
+		}
+	}
+};
 
-			if (min_index != i) {
-				// Swap distances for all dimensions 
-				for (int x = 0; x < 3; x++) {
-					double temp = distances[x][i];
-					distances[x][i] = distances[x][min_index];
-					distances[x][min_index] = temp;
+//load-and-classify in one go: CSV blocks are parsed in one pipeline stage and scored in the next,
+//so the scan of the first blocks overlaps with parsing the rest of the file
+//the running top-K of every pending query is kept across blocks and voted on at the end
+class StreamingKnn {
+private:
+	int neighbours_number;
+	int feature_size;
+	const FeatureScaler* scaler; //optional, rows are scaled as soon as they are parsed
+	Executor executor;
+
+public:
+	StreamingKnn(int k, int feature_size, const FeatureScaler* scaler = nullptr) :
+		neighbours_number(k), feature_size(feature_size), scaler(scaler) {}
+
+	//queries must already be in the stored feature space (transformed by the same scaler)
+	//returns the number of rows scanned, or -1 when the file cannot be opened
+	int classify_file(const string& filename, const double* const queries[], int num_queries, int* predictions, int max_rows) {
+		ifstream file(filename);
+		if (!file.is_open()) {
+			cerr << "Error opening file: " << filename << endl;
+			return -1;
+		}
+
+		//to eliminate first line which is the header
+		string line;
+		getline(file, line);
+
+		const int k = neighbours_number;
+		size_t num_lines = executor.num_workers();
+
+		//every pipeline line owns one block of parsed rows and one top-K per query
+		vector<vector<double>> blocks(num_lines, vector<double>((size_t)stream_block_rows * feature_size));
+		vector<int> block_start(num_lines, 0);
+		vector<Neighbour> line_storage(num_lines * num_queries * k);
+		vector<TopK> line_best(num_lines * num_queries);
+
+		//running top-K of every query, kept across blocks
+		vector<Neighbour> running_storage((size_t)num_queries * k);
+		vector<TopK> running(num_queries);
+		for (int q = 0; q < num_queries; q++) {
+			running[q] = TopK(&running_storage[q * k], k);
+		}
+
+		int rows_read = 0;
+
+		DataPipeline pipeline(num_lines,
+			//stage 1: parse the next block of rows, serial because the file is read in order
+			make_data_pipe<void, int>(PipeType::SERIAL, [&](Pipeflow& pf) -> int {
+				double* block = blocks[pf.line()].data();
+				int rows = 0;
+				while (rows < stream_block_rows && rows_read + rows < max_rows && getline(file, line)) {
+					double* row = block + (size_t)rows * feature_size;
+					if (!parse_row(line, row, feature_size)) {
+						cerr << "Invalid data in CSV: " << line << endl;
+						continue;
+					}
+					if (scaler != nullptr) {
+						scaler->apply_row(row);
+					}
+					rows++;
 				}
-			}
+				if (rows == 0) {
+					pf.stop();
+					return 0;
+				}
+				block_start[pf.line()] = rows_read;
+				rows_read += rows;
+				return rows;
+			}),
+			//stage 2: score the block against every pending query, blocks are scored in parallel
+			make_data_pipe<int, int>(PipeType::PARALLEL, [&](int& rows, Pipeflow& pf) -> int {
+				const double* block = blocks[pf.line()].data();
+				for (int q = 0; q < num_queries; q++) {
+					size_t slot = pf.line() * num_queries + q;
+					TopK& best = line_best[slot];
+					best = TopK(&line_storage[slot * k], k);
+					for (int r = 0; r < rows; r++) {
+						const double* row = block + (size_t)r * feature_size;
+						double distance = bounded_squared_distance(queries[q], row, feature_size, best.bound());
+						if (distance > 0) {
+							best.offer(distance, block_start[pf.line()] + r, (int)row[0]);
+						}
+					}
+				}
+				return rows;
+			}),
+			//stage 3: fold the block result into the running top-K
+			make_data_pipe<int, void>(PipeType::SERIAL, [&](int&, Pipeflow& pf) {
+				for (int q = 0; q < num_queries; q++) {
+					running[q].merge(line_best[pf.line() * num_queries + q]);
+				}
+			})
+		);
+
+		Taskflow taskflow;
+		taskflow.composed_of(pipeline).name("stream knn");
+		executor.run(taskflow).wait();
+
+		for (int q = 0; q < num_queries; q++) {
+			running[q].sort();
+			predictions[q] = vote(running[q].data(), running[q].size());
 		}
+		return rows_read;
 	}
 
-	double euclidean_distance(const double* x, const double* y, int feature_size) {
-		double l2 = 0.0;
-		for (int i = 1; i < feature_size; i++) {
-			l2 += pow((x[i] - y[i]), 2);
+	//parse one CSV line straight into row, false when it does not hold feature_size numbers
+	static bool parse_row(const string& line, double* row, int feature_size) {
+		const char* p = line.c_str();
+		for (int j = 0; j < feature_size; j++) {
+			char* next;
+			row[j] = strtod(p, &next);
+			if (next == p) return false;
+			p = (*next == ',') ? next + 1 : next;
 		}
-		return sqrt(l2);
+		return true;
+	}
+};
+
+
+//offline scoring of a whole file of queries (CSV like diabetes_binary.csv or a binary dataset file, the label
+//column is ignored) into a CSV of predictions with the K nearest rows and their distances
+//pipeline: read a tile of queries (serial) -> scale, scan and format the tile (parallel) -> write (serial, in order)
+//the text of a tile is built by the worker that scored it, the writer stage only copies whole buffers
+//the query column is the row's position among the data rows of the input (0-based, header excluded), so a
+//skipped invalid CSV line leaves a gap instead of shifting the ids of the queries after it
+class BulkScorer {
+private:
+	int neighbours_number;
+	int feature_size;
+	const FeatureScaler* scaler;
+	Executor executor;
+
+public:
+	BulkScorer(int k, int feature_size, const FeatureScaler* scaler) :
+		neighbours_number(k), feature_size(feature_size), scaler(scaler) {}
+
+	//returns the number of queries scored, or -1 when a file cannot be opened
+	long long score_file(const double* const dataset[], int dataset_size, const string& input, const string& output) {
+		BinaryDatasetReader binary;
+		bool is_binary = binary.open(input);
+		if (is_binary && binary.feature_size() != feature_size) {
+			cerr << "Query file has " << binary.feature_size() << " columns, expected " << feature_size << endl;
+			return -1;
+		}
+		ifstream csv;
+		string line;
+		if (!is_binary) {
+			csv.open(input);
+			if (!csv.is_open()) {
+				cerr << "Error opening file: " << input << endl;
+				return -1;
+			}
+			//to eliminate first line which is the header
+			getline(csv, line);
+		}
+		ofstream out(output, ios::binary | ios::trunc);
+		if (!out.is_open()) {
+			cerr << "Error opening file: " << output << endl;
+			return -1;
+		}
+		out << "query,prediction";
+		for (int n = 1; n <= neighbours_number; n++) {
+			out << ",neighbour_" << n << ",distance_" << n;
+		}
+		out << "\n";
+
+		const int k = neighbours_number;
+		size_t num_lines = executor.num_workers();
+
+		//every pipeline line owns one tile of queries, their top-K buffers and the tile's output text
+		vector<vector<double>> tiles(num_lines, vector<double>((size_t)bulk_query_tile * feature_size));
+		vector<vector<Neighbour>> tile_storage(num_lines, vector<Neighbour>((size_t)bulk_query_tile * k));
+		vector<string> tile_text(num_lines);
+		vector<vector<long long>> tile_ids(num_lines, vector<long long>(bulk_query_tile));
+		long long rows_seen = 0;	//data rows of the input, invalid ones included
+		long long queries_read = 0;
+
+		DataPipeline pipeline(num_lines,
+			//stage 1: read the next tile, serial because the file is read in order
+			make_data_pipe<void, int>(PipeType::SERIAL, [&](Pipeflow& pf) -> int {
+				double* tile = tiles[pf.line()].data();
+				long long* ids = tile_ids[pf.line()].data();
+				int rows = 0;
+				if (is_binary) {
+					rows = binary.read_block(tile, bulk_query_tile);
+					for (int q = 0; q < rows; q++) {
+						ids[q] = rows_seen++;
+					}
+				}
+				else {
+					while (rows < bulk_query_tile && getline(csv, line)) {
+						long long id = rows_seen++;
+						if (!StreamingKnn::parse_row(line, tile + (size_t)rows * feature_size, feature_size)) {
+							cerr << "Invalid data in CSV: " << line << endl;
+							continue;
+						}
+						ids[rows++] = id;
+					}
+				}
+				if (rows == 0) {
+					pf.stop();
+					return 0;
+				}
+				queries_read += rows;
+				return rows;
+			}),
+			//stage 2: score the tile, tiles are scored in parallel
+			make_data_pipe<int, int>(PipeType::PARALLEL, [&](int& rows, Pipeflow& pf) -> int {
+				TraceSpan span("bulk tile", "taskflow", trace_process_taskflow);
+				score_tile(dataset, dataset_size, tiles[pf.line()].data(), rows, tile_storage[pf.line()].data(),
+					tile_ids[pf.line()].data(), tile_text[pf.line()]);
+				return rows;
+			}),
+			//stage 3: append the tile's text to the output, in query order
+			make_data_pipe<int, void>(PipeType::SERIAL, [&](int&, Pipeflow& pf) {
+				const string& text = tile_text[pf.line()];
+				out.write(text.data(), (streamsize)text.size());
+			})
+		);
+
+		Taskflow taskflow;
+		taskflow.composed_of(pipeline).name("bulk scoring");
+		executor.run(taskflow).wait();
+
+		out.close();
+		if (!out) {
+			cerr << "Error writing file: " << output << endl;
+			return -1;
+		}
+		return queries_read;
 	}
 
+private:
+	void score_tile(const double* const dataset[], int dataset_size, double* tile, int rows, Neighbour* storage,
+		const long long* ids, string& text) const {
+		const int k = neighbours_number;
+		TopK best[bulk_query_tile];
+		for (int q = 0; q < rows; q++) {
+			double* query = tile + (size_t)q * feature_size;
+			if (scaler != nullptr) {
+				scaler->apply_row(query);
+			}
+			best[q] = TopK(storage + (size_t)q * k, k);
+		}
+
+		//every block of stored rows is read by all queries of the tile while it is in cache
+		for (int block = 0; block < dataset_size; block += bulk_row_block) {
+			int block_end = min(dataset_size, block + bulk_row_block);
+			for (int q = 0; q < rows; q++) {
+				const double* query = tile + (size_t)q * feature_size;
+				TopK& queryBest = best[q];
+				for (int i = block; i < block_end; i++) {
+					double distance = bounded_squared_distance(query, dataset[i], feature_size, queryBest.bound());
+					if (distance > 0) {
+						queryBest.offer(distance, i, (int)dataset[i][0]);
+					}
+				}
+			}
+		}
+
+		text.clear();
+		char buffer[64];
+		for (int q = 0; q < rows; q++) {
+			best[q].sort();
+			int prediction = (best[q].size() > 0) ? vote(best[q].data(), best[q].size()) : -1;
+			int length = snprintf(buffer, sizeof(buffer), "%lld,%d", ids[q], prediction);
+			text.append(buffer, length);
+			for (int n = 0; n < best[q].size(); n++) {
+				length = snprintf(buffer, sizeof(buffer), ",%d,%.6g", best[q][n].index, sqrt(best[q][n].distance));
+				text.append(buffer, length);
+			}
+			text.push_back('\n');
+		}
+	}
 };
 
 
@@ -151,15 +994,16 @@ private:
 public:
 	SerialMergeSortKnn(int k) : neighbours_number(k) {}
 
-	int predict_class(double* dataset[], const double* target, int dataset_size, int feature_size) {
+	int predict_class(const double* const dataset[], const double* target, int dataset_size, int feature_size) {
 		double* distances[3];
 		int zeros_count = 0;
 		int ones_count = 0;
 
-		// Allocate memory for distances and index order
-		distances[0] = new double[dataset_size];
-		distances[1] = new double[dataset_size];
-		distances[2] = new double[dataset_size];
+		ScratchArena& scratch = thread_scratch();
+		ScratchScope scope(scratch);
+		distances[0] = scratch.allocate<double>(dataset_size);
+		distances[1] = scratch.allocate<double>(dataset_size);
+		distances[2] = scratch.allocate<double>(dataset_size);
 
 		get_knn(dataset, target, distances, dataset_size, feature_size);
 
@@ -187,12 +1031,6 @@ public:
 		}
 
 		int prediction = (zeros_count > ones_count) ? 0 : 1;
-
-		// Clean up memory
-		delete[] distances[0];
-		delete[] distances[1];
-		delete[] distances[2];
-
 		return prediction;
 	}
 
@@ -227,7 +1065,7 @@ private:
 	}
 
 
-	void get_knn(double* x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
+	void get_knn(const double* const x[], const double* y, double* distances[3], int dataset_size, int feature_size) {
 		int count = 0;
 		for (int i = 0; i < dataset_size; i++) {
 			if (x[i] == y) continue; // do not use the same point
@@ -241,6 +1079,132 @@ private:
 
 };
 
+//fit the scaler over the whole dataset in one parallel pass and rescale the stored rows in place
+//false when the scaler cannot be fitted, the rows are then left as they are
+bool scale_dataset(double** dataset, int dataset_size, int feature_size, ScalingMode mode, FeatureScaler& scaler) {
+	std::vector<FeatureStats> stats(num_scaling_chunks, FeatureStats(feature_size));
+	int rows_per_chunk = (dataset_size + num_scaling_chunks - 1) / num_scaling_chunks;
+
+	Taskflow taskflow;
+	Executor executor;
+
+	//each chunk accumulates the statistics of its own range of rows, no race condition
+	Task statsTask = taskflow.for_each_index(0, num_scaling_chunks, 1, [&](int c) {
+		int start = c * rows_per_chunk;
+		int end = min(dataset_size, start + rows_per_chunk);
+		for (int i = start; i < end; i++) {
+			stats[c].accumulate(dataset[i]);
+		}
+		});
+
+	//condition task: 0 runs applyTask, 1 has no successor and ends the graph without scaling
+	bool fitted = false;
+	Task fitTask = taskflow.emplace([&]() -> int {
+		for (int c = 1; c < num_scaling_chunks; c++) {
+			stats[0].merge(stats[c]);
+		}
+		fitted = scaler.fit(stats[0], mode, nullptr, reorder_features);
+		return fitted ? 0 : 1;
+		});
+
+	Task applyTask = taskflow.for_each_index(0, dataset_size, 1, [&](int i) {
+		scaler.apply_row(dataset[i]);
+		});
+
+	statsTask.precede(fitTask);
+	fitTask.precede(applyTask);
+	executor.run(taskflow).wait();
+	if (!fitted) {
+		cerr << "Cannot scale rows wider than " << max_feature_size << " columns" << endl;
+	}
+	return fitted;
+}
+
+//best of calibration_queries timed runs (after one warm-up run) of one setting, in microseconds
+double time_setting(const TuningProfile& setting, const double* const dataset[], const double* const queries[], int dataset_size, int feature_size) {
+	TaskflowParallelKnn<> knn(3, SquaredL2(), setting);
+	knn.run_query(dataset, queries[0], dataset_size, feature_size);
+	double best = numeric_limits<double>::infinity();
+	for (int q = 0; q < calibration_queries; q++) {
+		steady_clock::time_point begin = steady_clock::now();
+		knn.run_query(dataset, queries[q], dataset_size, feature_size);
+		best = min(best, (double)duration_cast<microseconds>(steady_clock::now() - begin).count());
+	}
+	return best;
+}
+
+//startup calibration on the dataset itself: every thread count (powers of two up to the hardware threads,
+//1 = on the calling thread) with chunk counts of 1, 4 and 16 per thread and both partitioners,
+//then pipelined (inter-query) against one-after-another (intra-query) batches for the fastest setting
+TuningProfile calibrate_taskflow(const double* const dataset[], int dataset_size, int feature_size) {
+	//stored rows spread over the dataset stand in for queries
+	const double* queries[calibration_queries];
+	for (int q = 0; q < calibration_queries; q++) {
+		queries[q] = dataset[(long long)(2 * q + 1) * dataset_size / (2 * calibration_queries)];
+	}
+
+	vector<int> thread_counts;
+	for (int t = 1; t < hardware_threads(); t *= 2) thread_counts.push_back(t);
+	thread_counts.push_back(hardware_threads());
+
+	TuningProfile best = default_tuning_profile(dataset_size, feature_size, num_scan_chunks);
+	best.micros_per_query = numeric_limits<double>::infinity();
+	for (int threads : thread_counts) {
+		for (int per_thread : { 1, 4, 16 }) {
+			for (PartitionerKind partitioner : { PartitionerKind::Guided, PartitionerKind::Static }) {
+				TuningProfile setting = best;
+				setting.threads = threads;
+				setting.scan_chunks = threads * per_thread;
+				setting.partitioner = partitioner;
+				setting.micros_per_query = time_setting(setting, dataset, queries, dataset_size, feature_size);
+				if (setting.micros_per_query < best.micros_per_query) best = setting;
+				if (threads == 1) break; //chunks and partitioner do not matter on the calling thread
+			}
+			if (threads == 1) break;
+		}
+	}
+
+	//a batch of two queries per worker, pipelined and one after another
+	int batch_size = 2 * best.threads;
+	vector<const double*> batch(batch_size);
+	vector<int> predictions(batch_size);
+	for (int q = 0; q < batch_size; q++) {
+		batch[q] = dataset[(long long)q * dataset_size / batch_size];
+	}
+	double batch_micros[2];
+	for (int pipelined = 0; pipelined < 2; pipelined++) {
+		TuningProfile setting = best;
+		setting.batch_pipeline = (pipelined == 1);
+		TaskflowParallelKnn<> knn(3, SquaredL2(), setting);
+		knn.predict_batch(dataset, batch.data(), 1, predictions.data(), dataset_size, feature_size);
+		steady_clock::time_point begin = steady_clock::now();
+		knn.predict_batch(dataset, batch.data(), batch_size, predictions.data(), dataset_size, feature_size);
+		batch_micros[pipelined] = (double)duration_cast<microseconds>(steady_clock::now() - begin).count();
+	}
+	best.batch_pipeline = (batch_micros[1] < batch_micros[0]);
+	return best;
+}
+
+void print_profile(const TuningProfile& profile) {
+	cout << "Threads: " << profile.threads << (profile.threads == 1 ? " (calling thread)" : "")
+		<< ", chunks: " << profile.scan_chunks
+		<< ", partitioner: " << (profile.partitioner == PartitionerKind::Static ? "static" : "guided")
+		<< ", batches: " << (profile.batch_pipeline ? "inter-query pipeline" : "intra-query") << endl;
+}
+
+//the same Taskflow engine compiled for another metric
+template <typename Metric>
+int run_metric_knn(const double* const dataset[], const double* target, int dataset_size, int feature_size, Metric metric = Metric()) {
+	cout << "\n" << Metric::name() << ": " << endl;
+	steady_clock::time_point metricBegin = steady_clock::now();
+	TaskflowParallelKnn<Metric> metricKnn(3, metric); // Use K=3
+	int metricPrediction = metricKnn.predict_class(dataset, target, dataset_size, feature_size);
+	steady_clock::time_point metricEnd = steady_clock::now();
+	cout << Metric::name() << " Prediction: " << metricPrediction << endl;
+	cout << "Classification Time = " << duration_cast<microseconds>(metricEnd - metricBegin).count() << "[s]" << endl;
+	return metricPrediction;
+}
+
 std::vector<double> parseLine(const string& line) {
 	std::vector<double> row;
 	std::istringstream iss(line);
@@ -259,7 +1223,7 @@ std::vector<double> parseLine(const string& line) {
 	return row;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 	string filename = "diabetes_binary.csv";
 
 	//const int dataset_size = 30000; 
@@ -270,11 +1234,44 @@ int main() {
 	int time_serial_knn = 0;
 	int time_reduce = 0;
 
-	double** dataset = new double* [dataset_size];
 	double target[feature_size] = { 0.0, 0.0, 0.0, 1.0, 24.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 3.0, 0.0, 0.0, 0.0, 2.0, 5.0, 3.0 };
 	//double target[feature_size] = { 1.0, 1.0, 1.0, 1.0, 30.0, 1.0, 0.0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 5.0, 30.0, 30.0, 1.0, 0.0, 9.0, 5.0, 1.0 };
 	//double target[feature_size] = { 0.0, 1.0, 1.0, 1.0, 28.0, 0.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 4.0, 0.0, 10.0, 1.0, 0.0, 12.0, 6.0, 2.0 };
 
+	//--trace <file>: record a timeline of the run and write it as Chrome trace JSON
+	//after the Taskflow runs, or when main returns early
+	string trace_filename;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (string(argv[i]) == "--trace") trace_filename = argv[i + 1];
+	}
+	TraceRecorder recorder;
+	TraceExport traceExport(recorder, trace_filename);
+
+#pragma region StreamingKnn
+	//--stream: score the query while the CSV is still being parsed, nothing is loaded up front
+	//the scaler needs a full pass over the data, so this one-shot mode works on the raw features
+	if (argc > 1 && string(argv[1]) == "--stream") {
+		cout << "Streaming Taskflow KNN: " << endl;
+		steady_clock::time_point streamBegin = steady_clock::now();
+
+		StreamingKnn streamKnn(3, feature_size); // Use K=3
+		const double* stream_queries[1] = { target };
+		int streamPrediction = -1;
+		int rows = streamKnn.classify_file(filename, stream_queries, 1, &streamPrediction, dataset_size);
+		if (rows < 0) {
+			return 1;
+		}
+
+		steady_clock::time_point streamEnd = steady_clock::now();
+		cout << "Number of records: " << rows << endl;
+		cout << "Streaming Prediction: " << streamPrediction << endl;
+		cout << "Load + Classification Time = " << duration_cast<microseconds>(streamEnd - streamBegin).count() << "[s]" << endl;
+		return 0;
+	}
+#pragma endregion
+
+	double** dataset = new double* [dataset_size];
+
 	// Allocate memory for dataset and target
 	for (int i = 0; i < dataset_size; i++) {
 		dataset[i] = new double[feature_size];
@@ -302,12 +1299,63 @@ int main() {
 
 	cout << "Number of records: " << index << endl;
 
+	//scale the stored rows once and apply the same transform to the query
+	FeatureScaler scaler;
+	if (!scale_dataset(dataset, dataset_size, feature_size, default_scaling_mode, scaler)) {
+		return 1;
+	}
+	double scaled_target[feature_size];
+	scaler.transform_query(target, scaled_target);
+
+#pragma region BulkScoring
+	//--score <queries> <output>: score every query of a CSV or binary file into a predictions CSV, then exit
+	for (int i = 1; i + 2 < argc; i++) {
+		if (string(argv[i]) != "--score") continue;
+		cout << "\nBulk scoring " << argv[i + 1] << " -> " << argv[i + 2] << endl;
+		steady_clock::time_point scoreBegin = steady_clock::now();
+		BulkScorer scorer(3, feature_size, &scaler); // Use K=3
+		long long scored = scorer.score_file(dataset, dataset_size, argv[i + 1], argv[i + 2]);
+		if (scored < 0) {
+			return 1;
+		}
+		steady_clock::time_point scoreEnd = steady_clock::now();
+		double seconds = duration_cast<microseconds>(scoreEnd - scoreBegin).count() / 1e6;
+		cout << "Queries scored: " << scored << endl;
+		cout << "Scoring Time = " << duration_cast<microseconds>(scoreEnd - scoreBegin).count() << "[s], "
+			<< scored / max(seconds, 1e-9) << " queries/s" << endl;
+		return 0;
+	}
+#pragma endregion
+
+#pragma region Autotune
+	//settings of an earlier run on this machine and dataset size are reused, otherwise measured now
+	bool retune = false;
+	for (int i = 1; i < argc; i++) {
+		if (string(argv[i]) == "--retune") retune = true;
+	}
+	TuningProfile profile;
+	if (!retune && load_tuning_profile(tuning_profile_filename, profile) && profile_matches(profile, dataset_size, feature_size)) {
+		cout << "\nLoaded tuning profile " << tuning_profile_filename << ": ";
+	}
+	else {
+		steady_clock::time_point tuneBegin = steady_clock::now();
+		profile = calibrate_taskflow(dataset, dataset_size, feature_size);
+		steady_clock::time_point tuneEnd = steady_clock::now();
+		save_tuning_profile(tuning_profile_filename, profile);
+		cout << "\nCalibration Time = " << duration_cast<microseconds>(tuneEnd - tuneBegin).count() << "[s], tuned: ";
+	}
+	print_profile(profile);
+#pragma endregion
+
 #pragma region ParallelMergeSortKnn
 	cout << "\n\Taskflow KNN: " << endl;
 	steady_clock::time_point start = steady_clock::now();
-	TaskflowParallelKnn parallelKnn(3); // Use K=3
+	TaskflowParallelKnn<> parallelKnn(3, SquaredL2(), profile); // Use K=3
+	if (active_trace()) {
+		parallelKnn.trace(*active_trace());
+	}
 
-	int parallelPrediction = parallelKnn.predict_class(dataset, target, dataset_size, feature_size);
+	int parallelPrediction = parallelKnn.predict_class(dataset, scaled_target, dataset_size, feature_size);
 	cout << "Taskflow Prediction: " << parallelPrediction << endl;
 
 	if (parallelPrediction == 0) {
@@ -325,6 +1373,107 @@ int main() {
 	cout << "Classification Time = " << time_parallel_knn << "[s]" << endl;
 #pragma endregion
 
+#pragma region TaskflowBatchKnn
+	//the same object keeps its executor and graphs, a batch of queries is one pipeline run
+	cout << "\n\nTaskflow batch KNN: " << endl;
+	const int num_queries = 3;
+	double batch_targets[num_queries][feature_size] = {
+		{ 0.0, 0.0, 0.0, 1.0, 24.0, 1.0, 0.0, 0.0, 1.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 3.0, 0.0, 0.0, 0.0, 2.0, 5.0, 3.0 },
+		{ 1.0, 1.0, 1.0, 1.0, 30.0, 1.0, 0.0, 1.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 5.0, 30.0, 30.0, 1.0, 0.0, 9.0, 5.0, 1.0 },
+		{ 0.0, 1.0, 1.0, 1.0, 28.0, 0.0, 0.0, 1.0, 1.0, 0.0, 1.0, 0.0, 1.0, 0.0, 4.0, 0.0, 10.0, 1.0, 0.0, 12.0, 6.0, 2.0 }
+	};
+	double scaled_batch[num_queries][feature_size];
+	const double* batch_queries[num_queries];
+	int batch_predictions[num_queries];
+	for (int q = 0; q < num_queries; q++) {
+		scaler.transform_query(batch_targets[q], scaled_batch[q]);
+		batch_queries[q] = scaled_batch[q];
+	}
+
+	steady_clock::time_point batchBegin = steady_clock::now();
+	parallelKnn.predict_batch(dataset, batch_queries, num_queries, batch_predictions, dataset_size, feature_size);
+	steady_clock::time_point batchEnd = steady_clock::now();
+
+	for (int q = 0; q < num_queries; q++) {
+		cout << "Query " << q + 1 << " Prediction: " << batch_predictions[q] << endl;
+	}
+	cout << "Batch Classification Time = " << duration_cast<microseconds>(batchEnd - batchBegin).count() << "[s]" << endl;
+
+	//keep what the online tuner learned for the next run, once it has timed every chunk count it compares
+	if (parallelKnn.refined_online()) {
+		save_tuning_profile(tuning_profile_filename, parallelKnn.tuned_profile());
+	}
+#pragma endregion
+
+#pragma region TaskflowAsyncKnn
+	//callers submit and carry on; the three queries and a cancelled fourth share one executor's workers
+	cout << "\n\nTaskflow async KNN: " << endl;
+	Executor sharedExecutor;
+	std::atomic<int> callbacks_run{ 0 };
+	steady_clock::time_point asyncBegin = steady_clock::now();
+	{
+		TaskflowAsyncKnn<> asyncKnn(sharedExecutor, dataset, dataset_size, feature_size, 3); // Use K=3
+		vector<TaskflowAsyncKnn<>::Query> inFlight;
+		for (int q = 0; q < num_queries; q++) {
+			inFlight.push_back(asyncKnn.submit(batch_queries[q], [&callbacks_run](const AsyncKnnResult&) { callbacks_run++; }));
+		}
+		TaskflowAsyncKnn<>::Query cancelled = asyncKnn.submit(scaled_target);
+		cancelled.cancel();
+
+		for (int q = 0; q < num_queries; q++) {
+			AsyncKnnResult result = inFlight[q].get();
+			cout << "Query " << q + 1 << " Prediction: " << result.prediction << endl;
+		}
+		AsyncKnnResult cancelledResult = cancelled.get();
+		cout << "Cancelled query: " << (cancelledResult.status == AsyncStatus::Cancelled ? "cancelled" : "completed before the cancel") << endl;
+	}
+	steady_clock::time_point asyncEnd = steady_clock::now();
+	cout << "Completion callbacks: " << callbacks_run.load() << endl;
+	cout << "Async Classification Time = " << duration_cast<microseconds>(asyncEnd - asyncBegin).count() << "[s]" << endl;
+#pragma endregion
+
+#pragma region TaskflowMetricKnn
+	//L1, L-infinity and Hamming suit the mix of 0/1 flags and small ordinals; the weighted L2 doubles the
+	//weight of general, mental and physical health on top of the scaling (weights follow the stored column order)
+	cout << "\n\nTaskflow KNN with other metrics: " << endl;
+	run_metric_knn<Manhattan>(dataset, scaled_target, dataset_size, feature_size);
+	run_metric_knn<Chebyshev>(dataset, scaled_target, dataset_size, feature_size);
+	run_metric_knn<Hamming>(dataset, scaled_target, dataset_size, feature_size);
+	double metric_weights[feature_size];
+	for (int j = 0; j < feature_size; j++) {
+		int source = scaler.source_column(j);
+		metric_weights[j] = (source >= 14 && source <= 16) ? 2.0 : 1.0;
+	}
+	run_metric_knn(dataset, scaled_target, dataset_size, feature_size, WeightedL2(metric_weights, feature_size));
+#pragma endregion
+
+#pragma region TaskflowIvfKnn
+	cout << "\n\nTaskflow IVF KNN: " << endl;
+	steady_clock::time_point ivfBuildBegin = steady_clock::now();
+	TaskflowIvfIndex ivfIndex(3); // Use K=3
+	if (active_trace()) {
+		ivfIndex.trace(*active_trace());
+	}
+	double inertia = ivfIndex.build(dataset, dataset_size, feature_size, ivf_num_clusters, ivf_kmeans_iterations);
+	steady_clock::time_point ivfBuildEnd = steady_clock::now();
+	cout << ivfIndex.clusters() << " clusters, inertia " << inertia << endl;
+	cout << "Index Build Time = " << duration_cast<microseconds>(ivfBuildEnd - ivfBuildBegin).count() << "[s]" << endl;
+
+	for (int mode = 0; mode < 2; mode++) {
+		bool exact = (mode == 1);
+		cout << (exact ? "\nExact search:" : "\nProbe search (nprobe = " + to_string(ivf_nprobe) + "):") << endl;
+		steady_clock::time_point ivfBegin = steady_clock::now();
+		int ivfPrediction = ivfIndex.predict_class(scaled_target, ivf_nprobe, exact);
+		steady_clock::time_point ivfEnd = steady_clock::now();
+		cout << "IVF Prediction: " << ivfPrediction << endl;
+		cout << "Rows scanned: " << ivfIndex.last_rows_scanned() << " of " << dataset_size << endl;
+		cout << "Classification Time = " << duration_cast<microseconds>(ivfEnd - ivfBegin).count() << "[s]" << endl;
+	}
+#pragma endregion
+
+
+	//the trace covers the Taskflow runs above, the serial baseline below is not part of it
+	traceExport.finish();
 
 	//Knn
 #pragma region SerialMergeSortKnn
@@ -332,7 +1481,7 @@ int main() {
 	steady_clock::time_point knnBegin = steady_clock::now();
 	SerialMergeSortKnn knn(3); // Use K=3
 
-	int prediction = knn.predict_class(dataset, target, dataset_size, feature_size);
+	int prediction = knn.predict_class(dataset, scaled_target, dataset_size, feature_size);
 	cout << "Prediction: " << prediction << endl;
 
 	if (prediction == 0) {
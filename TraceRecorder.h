@@ -0,0 +1,143 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//opt-in timeline of what every thread ran, written as Chrome trace JSON
+//(open in chrome://tracing or ui.perfetto.dev); each backend uses its own process id so the
+//files of two runs can be loaded side by side
+const int trace_process_taskflow = 1;
+const int trace_process_pthreads = 2;
+
+struct TraceEvent {
+	std::string name;
+	const char* category;
+	int process;
+	int thread;
+	long long begin_us;
+	long long end_us;
+};
+
+class TraceRecorder {
+private:
+	std::mutex lock;
+	std::vector<TraceEvent> events;
+	std::chrono::steady_clock::time_point origin;
+	std::atomic<int> next_thread{ 0 };
+
+public:
+	TraceRecorder() : origin(std::chrono::steady_clock::now()) {}
+
+	long long now_us() const {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+	}
+
+	//small stable id of the calling thread, for threads that do not have one of their own (pthreads)
+	int thread_id() {
+		thread_local int id = -1;
+		if (id < 0) id = next_thread.fetch_add(1);
+		return id;
+	}
+
+	void record(const std::string& name, const char* category, int process, int thread, long long begin_us, long long end_us) {
+		std::lock_guard<std::mutex> guard(lock);
+		events.push_back({ name, category, process, thread, begin_us, end_us });
+	}
+
+	size_t size() {
+		std::lock_guard<std::mutex> guard(lock);
+		return events.size();
+	}
+
+	//complete ("X") events, one per span
+	bool write_json(const std::string& filename) {
+		std::lock_guard<std::mutex> guard(lock);
+		std::ofstream file(filename, std::ios::trunc);
+		if (!file.is_open()) return false;
+		file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		for (size_t i = 0; i < events.size(); i++) {
+			const TraceEvent& e = events[i];
+			file << "{\"name\":\"" << escape(e.name) << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"ts\":" << e.begin_us
+				<< ",\"dur\":" << (e.end_us - e.begin_us) << ",\"pid\":" << e.process << ",\"tid\":" << e.thread << "}"
+				<< (i + 1 < events.size() ? ",\n" : "\n");
+		}
+		file << "]}\n";
+		return file.good();
+	}
+
+private:
+	static std::string escape(const std::string& text) {
+		std::string out;
+		for (char c : text) {
+			if (c == '"' || c == '\\') out.push_back('\\');
+			if ((unsigned char)c >= 0x20) out.push_back(c);
+		}
+		return out;
+	}
+};
+
+//recorder of the current run, nullptr when tracing is off
+inline TraceRecorder*& active_trace() {
+	static TraceRecorder* recorder = nullptr;
+	return recorder;
+}
+
+//records the lifetime of the object as one span on the calling thread, does nothing when tracing is off
+class TraceSpan {
+private:
+	TraceRecorder* recorder;
+	const char* name;
+	const char* category;
+	int process;
+	long long begin_us;
+
+public:
+	TraceSpan(const char* name, const char* category, int process) :
+		recorder(active_trace()), name(name), category(category), process(process),
+		begin_us(recorder ? recorder->now_us() : 0) {}
+
+	~TraceSpan() {
+		if (recorder) recorder->record(name, category, process, recorder->thread_id(), begin_us, recorder->now_us());
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+//makes recorder the active trace of the run and writes it to filename on finish() or, at the latest, when the
+//guard goes out of scope, so a mode that returns early from main still exports its spans
+//does nothing when filename is empty (no --trace)
+class TraceExport {
+private:
+	TraceRecorder& recorder;
+	std::string filename;
+	bool done;
+
+public:
+	TraceExport(TraceRecorder& recorder, const std::string& filename) :
+		recorder(recorder), filename(filename), done(filename.empty()) {
+		if (!done) active_trace() = &recorder;
+	}
+
+	~TraceExport() { finish(); }
+
+	//stop recording and write the file, later calls do nothing
+	void finish() {
+		if (done) return;
+		done = true;
+		active_trace() = nullptr;
+		if (recorder.write_json(filename)) {
+			std::cout << "\nTrace of " << recorder.size() << " spans written to " << filename << std::endl;
+		}
+		else {
+			std::cerr << "Cannot write trace: " << filename << std::endl;
+		}
+	}
+
+	TraceExport(const TraceExport&) = delete;
+	TraceExport& operator=(const TraceExport&) = delete;
+};